@@ -0,0 +1,214 @@
+#include <kernel/arch/x86_64/acpi.h>
+#include <kernel/arch/x86_64/cmos.h>
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/clocksource.h>
+#include <kernel/mmu.h>
+#include <kernel/string.h>
+#include <klog.h>
+
+static const char *TAG = "acpi";
+
+static struct acpi_sdt_header *acpi_root; /* RSDT or XSDT */
+static int acpi_root_is_xsdt;
+
+/* tables can live anywhere in the low 4 GiB; map them write-back */
+static struct acpi_sdt_header *acpi_map_table(uintptr_t phys)
+{
+    struct acpi_sdt_header *header = mmu_map_mmio(phys, sizeof(*header), MMU_CACHE_WB);
+    if (!header || !mmu_map_mmio(phys, header->length, MMU_CACHE_WB)) {
+        return NULL;
+    }
+    return header;
+}
+
+static const struct rsdp_descriptor *rsdp_scan(uintptr_t start, size_t len)
+{
+    for (uintptr_t addr = start; addr + sizeof(struct rsdp_descriptor) <= start + len; addr += 16) {
+        const struct rsdp_descriptor *rsdp = (const struct rsdp_descriptor *)addr;
+        if (!memcmp(rsdp->signature, "RSD PTR ", 8) && checksum8(rsdp, sizeof(*rsdp)) == 0) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+/* the first KiB of the EBDA, then the BIOS ROM area */
+static const struct rsdp_descriptor *rsdp_find(void)
+{
+    /* the BIOS data area is in the first page, which gcc assumes nothing valid lives in */
+    uintptr_t ebda_segment = 0x40E;
+    asm("" : "+r"(ebda_segment));
+    const uintptr_t ebda = (uintptr_t)*(volatile uint16_t *)ebda_segment << 4;
+    const struct rsdp_descriptor *rsdp = NULL;
+
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        rsdp = rsdp_scan(ebda, 1024);
+    }
+    return rsdp ? rsdp : rsdp_scan(0xE0000, 0x20000);
+}
+
+int acpi_initialize(const void *rsdp_ptr)
+{
+    const struct rsdp_descriptor *rsdp = rsdp_ptr ? rsdp_ptr : rsdp_find();
+    if (!rsdp || checksum8(rsdp, sizeof(*rsdp)) != 0) {
+        KLOGW(TAG, "no RSDP");
+        return -1;
+    }
+
+    const struct rsdp_descriptor_20 *rsdp20 = (const struct rsdp_descriptor_20 *)rsdp;
+    if (rsdp->revision >= 2 && rsdp20->xsdt_address && checksum8(rsdp20, rsdp20->length) == 0) {
+        acpi_root = acpi_map_table(rsdp20->xsdt_address);
+        acpi_root_is_xsdt = 1;
+    } else {
+        acpi_root = acpi_map_table(rsdp->rsdt_address);
+        acpi_root_is_xsdt = 0;
+    }
+    if (!acpi_root || !acpi_checksum(acpi_root)) {
+        KLOGW(TAG, "bad %s", acpi_root_is_xsdt ? "XSDT" : "RSDT");
+        acpi_root = NULL;
+        return -1;
+    }
+    KLOGI(TAG, "%s at %p, OEM %.6s", acpi_root_is_xsdt ? "XSDT" : "RSDT", acpi_root, acpi_root->oemid);
+
+    const struct fadt *fadt = (const struct fadt *)acpi_find_table("FACP");
+    if (fadt && fadt->header.length > offsetof(struct fadt, century) && fadt->century) {
+        arch_clock_set_century_register(fadt->century);
+    }
+    return 0;
+}
+
+struct acpi_sdt_header *acpi_find_table(const char *signature)
+{
+    if (!acpi_root) {
+        return NULL;
+    }
+
+    const size_t entry_size = acpi_root_is_xsdt ? 8 : 4;
+    const size_t count = (acpi_root->length - sizeof(*acpi_root)) / entry_size;
+    const uint8_t *entries = (const uint8_t *)(acpi_root + 1);
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * entry_size, entry_size); /* XSDT entries are not 8-byte aligned */
+
+        struct acpi_sdt_header *header = acpi_map_table(phys);
+        if (header && !memcmp(header->signature, signature, 4) && acpi_checksum(header)) {
+            return header;
+        }
+    }
+    return NULL;
+}
+
+static uint16_t pm_timer_port;
+
+static uint64_t pm_timer_read(void)
+{
+    return inportl(pm_timer_port);
+}
+
+static struct clocksource pm_timer_clocksource = {
+    .name = "acpi_pm",
+    .read = pm_timer_read,
+    .mask = 0xFFFFFF,
+    .frequency = ACPI_PM_TIMER_FREQUENCY,
+    .rating = CLOCKSOURCE_RATING_PM_TIMER,
+};
+
+int acpi_pm_timer_initialize(void)
+{
+    const struct fadt *fadt = (const struct fadt *)acpi_find_table("FACP");
+    if (!fadt) {
+        return -1;
+    }
+
+    uint64_t port = fadt->pm_tmr_blk;
+    if (!port && fadt->header.length >= sizeof(*fadt) &&
+        fadt->x_pm_tmr_blk.address_space_id == ACPI_SPACE_SYSTEM_IO) {
+        port = fadt->x_pm_tmr_blk.address;
+    }
+    if (!port || port > 0xFFFF || (fadt->pm_tmr_blk && fadt->pm_tmr_len < 4)) {
+        return -1;
+    }
+
+    pm_timer_port = port;
+    if (fadt->flags & FADT_FLAG_TMR_VAL_EXT) {
+        pm_timer_clocksource.mask = 0xFFFFFFFF;
+    }
+    clocksource_register(&pm_timer_clocksource);
+    return 0;
+}
+
+static void madt_add_cpu(struct acpi_madt_info *info, uint32_t apic_id, uint32_t flags)
+{
+    if (!(flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE))) {
+        return;
+    }
+    for (unsigned int i = 0; i < info->cpu_count; i++) {
+        if (info->cpu_apic_ids[i] == apic_id) {
+            return; /* listed as both a LAPIC and an x2APIC */
+        }
+    }
+    if (info->cpu_count < ACPI_MADT_MAX_CPUS) {
+        info->cpu_apic_ids[info->cpu_count++] = apic_id;
+    }
+}
+
+int acpi_madt_parse(struct acpi_madt_info *info)
+{
+    const struct madt *madt = (const struct madt *)acpi_find_table("APIC");
+    if (!madt) {
+        return -1;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->flags = madt->flags;
+    for (unsigned int i = 0; i < ACPI_ISA_IRQS; i++) {
+        info->isa_irqs[i].gsi = i;
+    }
+
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+    for (const uint8_t *p = madt->entries; p + sizeof(struct madt_entry) <= end;) {
+        const struct madt_entry *entry = (const struct madt_entry *)p;
+        if (entry->length < sizeof(*entry) || p + entry->length > end) {
+            break;
+        }
+        p += entry->length;
+
+        switch (entry->type) {
+        case MADT_LAPIC: {
+            const struct madt_lapic *lapic = (const struct madt_lapic *)entry;
+            madt_add_cpu(info, lapic->apic_id, lapic->flags);
+            break;
+        }
+        case MADT_X2APIC: {
+            const struct madt_x2apic *x2apic = (const struct madt_x2apic *)entry;
+            madt_add_cpu(info, x2apic->x2apic_id, x2apic->flags);
+            break;
+        }
+        case MADT_IOAPIC: {
+            const struct madt_ioapic *ioapic = (const struct madt_ioapic *)entry;
+            if (info->ioapic_count < ACPI_MADT_MAX_IOAPICS) {
+                info->ioapics[info->ioapic_count].id = ioapic->ioapic_id;
+                info->ioapics[info->ioapic_count].address = ioapic->address;
+                info->ioapics[info->ioapic_count].gsi_base = ioapic->gsi_base;
+                info->ioapic_count++;
+            }
+            break;
+        }
+        case MADT_SOURCE_OVERRIDE: {
+            const struct madt_source_override *override = (const struct madt_source_override *)entry;
+            if (override->bus == 0 && override->source < ACPI_ISA_IRQS) {
+                info->isa_irqs[override->source].gsi = override->gsi;
+                info->isa_irqs[override->source].flags = override->flags;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    KLOGI(TAG, "MADT: %u processors, %u IOAPICs%s", info->cpu_count, info->ioapic_count,
+          info->flags & MADT_FLAG_PCAT_COMPAT ? ", 8259s" : "");
+    return 0;
+}
@@ -1,27 +1,277 @@
 #include <kernel/arch/x86_64/cmos.h>
+#include <kernel/clocksource.h>
+#include <cpu.h>
 #include <klog.h>
+#include <cpuid.h>
+#include <stdbool.h>
 #include <x86intrin.h>
 static int64_t arch_boot_time;      /* Time (in seconds) according to the CMOS right before we examine the TSC */
-static uint64_t tsc_basis_time = 0; /* Accumulated time (in microseconds) on the TSC, when we timed it; eg. how long did boot take */
-static uint64_t tsc_mhz = 2000;     /* MHz rating we determined for the TSC. Usually also the core speed */
+static date_t arch_boot_date;       /* the date arch_boot_time was computed from; year 0 until then */
+static uint64_t tsc_frequency = 2000000000; /* Hz rate we determined for the TSC. Usually also the core speed */
 
 /**
- * @brief read timestamp counter
+ * @brief read timestamp counter, on the timeline shared by all CPUs
  */
-static inline uint64_t read_tsc(void)
+static uint64_t read_tsc(void)
 {
-    uint32_t lo, hi;
-    asm volatile("rdtsc"
-                 : "=a"(lo), "=d"(hi));
-    return ((uint64_t)hi << 32UL) | (uint64_t)lo;
+    return arch_tsc_read();
+}
+
+static date_t rtc_read_date(void);
+
+static struct clocksource tsc_clocksource = {
+    .name = "tsc",
+    .read = read_tsc,
+    .mask = ~0ULL,
+    .rating = CLOCKSOURCE_RATING_TSC,
+};
+
+/*
+PORT 0x43	r/w	PIT  mode port, control word register for counters 0-2
+     bit 7-6 = 00  counter 0 select
+         = 01  counter 1 select	  (not PS/2)
+         = 10  counter 2 select
+     bit 5-4 = 00  counter latch command
+         = 01  read/write counter bits 0-7 only
+         = 10  read/write counter bits 8-15 only
+         = 11  read/write counter bits 0-7 first, then 8-15
+     bit 3-1 = 000 mode 0 select
+         = 001 mode 1 select - programmable one shot
+         = x10 mode 2 select - rate generator
+         = x11 mode 3 select - square wave generator
+         = 100 mode 4 select - software triggered strobe
+         = 101 mode 5 select - hardware triggered strobe
+     bit 0	 = 0   binary counter 16 bits
+         = 1   BCD counter
+*/
+enum PIT_CounterMode
+{
+    PIT_MODE_INTERRUPT_ON_COUNT = 0,
+    PIT_MODE_ONE_SHOT = 1,
+    PIT_MODE_RATE_GENERATOR = 2,
+    // PIT_MODE_RATE_GENERATOR = 6,
+    PIT_MODE_SQUARE_WAVE_GENERATOR = 3,
+    // PIT_MODE_SQUARE_WAVE_GENERATOR = 7,
+    PIT_MODE_SW_TRIGGERED_STROBE = 4,
+    PIT_MODE_HW_TRIGGERED_STROBE = 5
+};
+enum PIT_CounterAccess
+{
+    PIT_COUNTER_ACCESS_LATCH_COMMAND = 0,
+    PIT_COUNTER_ACCESS_LOWER_HALF = 1,
+    PIT_COUNTER_ACCESS_HIGHER_HALF = 2,
+    PIT_COUNTER_ACCESS_ALL = 3,
+};
+typedef union
+{
+    struct
+    {
+        uint8_t bcd_counter : 1;    // 0: binary counter , 1 : BCD counter
+        uint8_t mode : 3;           // check enum PIT_CounterMode
+        uint8_t counter_access : 2; // cehck enum PIT_CounterAccess
+        uint8_t counter_select : 2; // select counter [0:2]
+    };
+    uint8_t raw;
+} PIT_Mode;
+
+enum
+{
+    PIT_COUNTER2_PORT = 0x42, // PIT  counter 2, cassette & speaker    (XT, AT, PS/2)
+    PIT_MODE_PORT = 0x43,     // control word register for counters 0-2
+    PIT_FREQUENCY = 1193182,  // Hz
+    KB_CONTROLLER_DATA_PORT = 0x60,
+    KB_CONTROLLER_PORT_B = 0x61,
+};
+enum KB_CONTROLLER_PORT_B_CR_BITS
+{
+    KB_TIMER2_GATE_TO_SPEAKER_ENABLE = (1 << 0),
+    KB_SPEAKER_DATA_ENABLE = (1 << 1),
+    KB_PARITY_CHECK_ENABLE = (1 << 2),
+    KB_CHANNEL_CHECK_ENABLE = (1 << 3),
+    // (bits 4-6) reserved
+    KB_CLEAR_KEYBOARD = (1 << 7)
+};
+
+/*
+ * PIT calibration: a handful of short windows, each bounded by two reads
+ * of counter 2. A read whose rdtsc bracket is wide (an SMI, or the vCPU
+ * being descheduled in the middle) makes its window uncertain, so the
+ * window with the tightest brackets wins instead of a single long one.
+ */
+#define PIT_WINDOW_TICKS   2983 /* 2.5 ms */
+#define PIT_WINDOWS        4
+#define PIT_SAMPLE_TRIES   3
+
+/* where the TSC frequency came from */
+enum tsc_source
+{
+    TSC_SOURCE_HYPERVISOR, // timing leaf 0x40000010, in kHz
+    TSC_SOURCE_CPUID_15H,  // crystal clock and TSC/crystal ratio
+    TSC_SOURCE_CPUID_16H,  // processor base frequency, in MHz
+    TSC_SOURCE_PIT,
+    TSC_SOURCE_REFERENCE,  // measured against a clock source, see arch_tsc_calibrate()
+};
+
+static const char *const tsc_source_names[] = {
+    [TSC_SOURCE_HYPERVISOR] = "hypervisor leaf 0x40000010",
+    [TSC_SOURCE_CPUID_15H] = "CPUID 0x15",
+    [TSC_SOURCE_CPUID_16H] = "CPUID 0x16",
+    [TSC_SOURCE_PIT] = "PIT",
+    [TSC_SOURCE_REFERENCE] = "reference clock",
+};
+
+static enum tsc_source tsc_source = TSC_SOURCE_PIT;
+static uint64_t tsc_ppm; /* uncertainty of a measured rate, 0 if the rate was not measured */
+
+struct pit_sample
+{
+    uint64_t tsc;  /* middle of the rdtsc bracket around the read */
+    uint64_t skew; /* width of that bracket */
+    uint16_t count;
+};
+
+static uint16_t pit_counter2_read(void)
+{
+    const PIT_Mode latch = {.counter_access = PIT_COUNTER_ACCESS_LATCH_COMMAND, .counter_select = 2};
+    outportb(PIT_MODE_PORT, latch.raw);
+    const uint8_t lo = inportb(PIT_COUNTER2_PORT);
+    const uint8_t hi = inportb(PIT_COUNTER2_PORT);
+    return lo | (hi << 8);
+}
+
+/* the tightest of a few bracketed reads */
+static struct pit_sample pit_sample(void)
+{
+    struct pit_sample best = {.skew = ~0ULL};
+    for (int i = 0; i < PIT_SAMPLE_TRIES; i++)
+    {
+        const uint64_t before = __rdtsc();
+        const uint16_t count = pit_counter2_read();
+        const uint64_t after = __rdtsc();
+        if (after - before < best.skew)
+            best = (struct pit_sample){.tsc = before + (after - before) / 2, .skew = after - before, .count = count};
+    }
+    return best;
+}
+
+/**
+ * @brief Measure the TSC against PIT counter 2
+ * @param ppm set to the uncertainty of the result, in parts per million
+ * @return TSC frequency in Hz, 0 if the PIT did not count
+ */
+static uint64_t tsc_calibrate_pit(uint64_t *ppm)
+{
+    // make sure speaker is disabled and enable timer2
+    outportb(KB_CONTROLLER_PORT_B, (inportb(KB_CONTROLLER_PORT_B) & ~(KB_SPEAKER_DATA_ENABLE)) | KB_TIMER2_GATE_TO_SPEAKER_ENABLE);
+
+    /* counter 2 counts down from 0xFFFF and keeps going; only the count is used, not the output */
+    PIT_Mode counter2_mode = {.bcd_counter = 0,
+                              .mode = PIT_MODE_INTERRUPT_ON_COUNT,
+                              .counter_access = PIT_COUNTER_ACCESS_ALL,
+                              .counter_select = 2};
+    outportb(PIT_MODE_PORT, counter2_mode.raw);
+    outportb(PIT_COUNTER2_PORT, 0xFF);
+    inportb(KB_CONTROLLER_DATA_PORT);
+    outportb(PIT_COUNTER2_PORT, 0xFF);
+
+    /* the count is loaded on the next PIT clock; wait for it to start moving */
+    const uint16_t loaded = pit_counter2_read();
+    for (int i = 0; i < 100000 && pit_counter2_read() == loaded; i++)
+        ;
+
+    uint64_t best_hz = 0, best_error = 0, best_cycles = 1;
+    struct pit_sample start = pit_sample();
+    for (int window = 0; window < PIT_WINDOWS; window++)
+    {
+        uint16_t elapsed = 0;
+        for (int spin = 0; spin < 1000000 && elapsed < PIT_WINDOW_TICKS; spin++)
+            elapsed = start.count - pit_counter2_read();
+        if (elapsed < PIT_WINDOW_TICKS)
+            break; /* the PIT is not counting */
+
+        const struct pit_sample end = pit_sample();
+        const uint16_t ticks = start.count - end.count;
+        const uint64_t cycles = end.tsc - start.tsc;
+        const uint64_t hz = cycles * PIT_FREQUENCY / ticks;
+        /* half of each bracket, plus one PIT tick for the counter resolution */
+        const uint64_t error = (start.skew + end.skew) / 2 + hz / PIT_FREQUENCY;
+        if (!best_hz || error * best_cycles < best_error * cycles)
+        {
+            best_hz = hz;
+            best_error = error;
+            best_cycles = cycles;
+        }
+        start = end;
+    }
+
+    *ppm = best_hz ? best_error * 1000000 / best_cycles : 0;
+    return best_hz;
+}
+
+static bool cpu_has_hypervisor(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1U << 31));
+}
+
+/* the TSC runs at a constant rate in all P-, C- and T-states */
+static bool tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8));
+}
+
+/**
+ * @brief TSC frequency as reported by the hypervisor or the CPU, without measuring
+ * @return Hz, or 0 if neither says
+ */
+static uint64_t tsc_frequency_from_cpuid(enum tsc_source *source)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (cpu_has_hypervisor())
+    {
+        __cpuid(0x40000000, eax, ebx, ecx, edx);
+        if (eax >= 0x40000010)
+        {
+            __cpuid(0x40000010, eax, ebx, ecx, edx);
+            if (eax)
+            {
+                *source = TSC_SOURCE_HYPERVISOR;
+                return (uint64_t)eax * 1000;
+            }
+        }
+    }
+
+    const unsigned int max_leaf = __get_cpuid_max(0, NULL);
+    if (max_leaf >= 0x15)
+    {
+        __cpuid(0x15, eax, ebx, ecx, edx); /* eax: denominator, ebx: numerator, ecx: crystal Hz */
+        if (eax && ebx && ecx)
+        {
+            *source = TSC_SOURCE_CPUID_15H;
+            return (uint64_t)ecx * ebx / eax;
+        }
+    }
+    if (max_leaf >= 0x16)
+    {
+        __cpuid(0x16, eax, ebx, ecx, edx);
+        if (eax)
+        {
+            *source = TSC_SOURCE_CPUID_16H;
+            return (uint64_t)eax * 1000000;
+        }
+    }
+    return 0;
 }
 
 /**
  * @brief Initializes boot time, system time, TSC rate, etc.
  *
- * We determine TSC rate with a one-shot PIT, which seems
- * to work fine... the PIT is the only thing with both reasonable
- * precision and actual known wall-clock configuration.
+ * The TSC rate comes from CPUID when the CPU or the hypervisor reports
+ * it, which costs no time at all. Otherwise it is measured against the
+ * PIT, the only thing with both reasonable precision and actual known
+ * wall-clock configuration that is always there.
  *
  * In Bochs, this has a tendency to be 1) completely wrong (usually
  * about half the time that actual execution will run at, in my
@@ -36,134 +286,205 @@ static inline uint64_t read_tsc(void)
  */
 void arch_clock_initialize(void)
 {
-    /*
-    PORT 0x43	r/w	PIT  mode port, control word register for counters 0-2
-         bit 7-6 = 00  counter 0 select
-             = 01  counter 1 select	  (not PS/2)
-             = 10  counter 2 select
-         bit 5-4 = 00  counter latch command
-             = 01  read/write counter bits 0-7 only
-             = 10  read/write counter bits 8-15 only
-             = 11  read/write counter bits 0-7 first, then 8-15
-         bit 3-1 = 000 mode 0 select
-             = 001 mode 1 select - programmable one shot
-             = x10 mode 2 select - rate generator
-             = x11 mode 3 select - square wave generator
-             = 100 mode 4 select - software triggered strobe
-             = 101 mode 5 select - hardware triggered strobe
-         bit 0	 = 0   binary counter 16 bits
-             = 1   BCD counter
-    */
-    enum PIT_CounterMode
-    {
-        PIT_MODE_INTERRUPT_ON_COUNT = 0,
-        PIT_MODE_ONE_SHOT = 1,
-        PIT_MODE_RATE_GENERATOR = 2,
-        // PIT_MODE_RATE_GENERATOR = 6,
-        PIT_MODE_SQUARE_WAVE_GENERATOR = 3,
-        // PIT_MODE_SQUARE_WAVE_GENERATOR = 7,
-        PIT_MODE_SW_TRIGGERED_STROBE = 4,
-        PIT_MODE_HW_TRIGGERED_STROBE = 5
-    };
-    enum PIT_CounterAccess
-    {
-        PIT_COUNTER_ACCESS_LATCH_COMMAND = 0,
-        PIT_COUNTER_ACCESS_LOWER_HALF = 1,
-        PIT_COUNTER_ACCESS_HIGHER_HALF = 2,
-        PIT_COUNTER_ACCESS_ALL = 3,
-    };
-    typedef union
-    {
-        struct
-        {
-            uint8_t bcd_counter : 1;    // 0: binary counter , 1 : BCD counter
-            uint8_t mode : 3;           // check enum PIT_CounterMode
-            uint8_t counter_access : 2; // cehck enum PIT_CounterAccess
-            uint8_t counter_select : 2; // select counter [0:2]
-        };
-        uint8_t raw;
-    } PIT_Mode;
-
-    enum
-    {
-        PIT_COUNTER2_PORT = 0x42, // PIT  counter 2, cassette & speaker    (XT, AT, PS/2)
-        PIT_MODE_PORT = 0x43,     // control word register for counters 0-2
-        KB_CONTROLLER_DATA_PORT = 0x60,
-        KB_CONTROLLER_PORT_B = 0x61,
-    };
-    enum KB_CONTROLLER_PORT_B_CR_BITS
-    {
-        KB_TIMER2_GATE_TO_SPEAKER_ENABLE = (1 << 0),
-        KB_SPEAKER_DATA_ENABLE = (1 << 1),
-        KB_PARITY_CHECK_ENABLE = (1 << 2),
-        KB_CHANNEL_CHECK_ENABLE = (1 << 3),
-        // (bits 4-6) reserved
-        KB_CLEAR_KEYBOARD = (1 << 7)
-    };
-    enum KB_CONTROLLER_PORT_B_STATUS_BITS
-    {
-        KB_TIMER2_GATE_TO_SPEAKER_STATUS = (1 << 0),
-        KB_SPEAKER_DATA_STATUS = (1 << 1),
-        KB_PARITY_CHECK_STATUS = (1 << 2),
-        KB_CHANNEL_CHECK_STATUS = (1 << 3),
-        // bit 4	 toggles with each refresh request
-        KB_TIMER2_OUTPUT_STATUS = (1 << 5),
-        KB_CHANNEL_CHECK_OCURRED = (1 << 6),
-        KB_PARITY_CHECK_OCURRED = (1 << 7)
-    };
-    //date_t date = read_rtc();
-    arch_boot_time = read_epoch_time();
-    /* Disables and sets gating for channel 2 */
+    arch_boot_date = rtc_read_date();
+    arch_boot_time = date_to_epoch(&arch_boot_date);
+    const uint64_t tsc_boot = arch_tsc_read();
+
+    enum tsc_source source = TSC_SOURCE_PIT;
+    uint64_t ppm = 0;
+    uint64_t tsc_hz = tsc_frequency_from_cpuid(&source);
+    if (!tsc_hz)
+        tsc_hz = tsc_calibrate_pit(&ppm);
+    tsc_source = source;
+    tsc_ppm = ppm;
+    const uint64_t calibration_cycles = arch_tsc_read() - tsc_boot;
+
+    const uint64_t current_tsc_mhz = tsc_hz / 1000000;
+    if (current_tsc_mhz != 0)
+        __atomic_store_n(&tsc_frequency, tsc_hz, __ATOMIC_RELAXED);
+    else
+        tsc_hz = tsc_frequency;
+    /* arch_tsc_to_time() converts with these even if the TSC is never registered */
+    clocksource_set_frequency(&tsc_clocksource, tsc_hz);
 
-    // make sure speaker is disabled and enable timer2
-    outportb(KB_CONTROLLER_PORT_B, (inportb(KB_CONTROLLER_PORT_B) & ~(KB_SPEAKER_DATA_ENABLE)) | KB_TIMER2_GATE_TO_SPEAKER_ENABLE);
+    const bool invariant = tsc_is_invariant();
+    const bool hypervisor = cpu_has_hypervisor();
+    const uint64_t calibration_us = calibration_cycles * 1000000 / tsc_hz;
 
-    /* Configure channel 2 to one-shot */
-    PIT_Mode counter2_mode = {.bcd_counter = 0,
-                              .mode = PIT_MODE_ONE_SHOT,
-                              .counter_access = PIT_COUNTER_ACCESS_ALL,
-                              .counter_select = 2};
+    if (source == TSC_SOURCE_PIT)
+        KLOGI("TSC", "%lu.%06lu MHz from the PIT, +-%lu ppm", tsc_hz / 1000000, tsc_hz % 1000000, ppm);
+    else
+        KLOGI("TSC", "%lu.%06lu MHz from %s (%s)", tsc_hz / 1000000, tsc_hz % 1000000, tsc_source_names[source],
+              source == TSC_SOURCE_CPUID_16H ? "nominal" : "exact");
+    KLOGI("TSC", "invariant: %s, hypervisor: %s, calibration took %lu us",
+          invariant ? "yes" : "no", hypervisor ? "yes" : "no", calibration_us);
+    KLOGD("TSC", "Boot time is %lus\n", arch_boot_time);
 
-    // set reload register = 0x2E9B = 11931 (which is approximately 10 ms)
-    outportb(PIT_MODE_PORT, counter2_mode.raw); 
-    outportb(PIT_COUNTER2_PORT, 0x9B); 
-    inportb(KB_CONTROLLER_DATA_PORT);
-    outportb(PIT_COUNTER2_PORT, 0x2E);
+    if (current_tsc_mhz != 0)
+    {
+        /* a hypervisor keeps the guest TSC at a constant rate even without the invariant bit */
+        if (!invariant && !hypervisor)
+            tsc_clocksource.rating = CLOCKSOURCE_RATING_TSC_UNSTABLE;
+        clocksource_register(&tsc_clocksource);
+    }
+    clock_set_realtime(arch_boot_time * NSEC_PER_SEC);
+}
 
-    /* disable and enable timer 2 */
-    uint8_t kb_port_cr = inportb(KB_CONTROLLER_PORT_B);
-    kb_port_cr &= ~(KB_TIMER2_GATE_TO_SPEAKER_ENABLE);
-    outportb(KB_CONTROLLER_PORT_B, kb_port_cr);
-    outportb(KB_CONTROLLER_PORT_B, kb_port_cr | KB_TIMER2_GATE_TO_SPEAKER_ENABLE);
+/**
+ * @brief Change the TSC rate after a recalibration
+ *
+ * Time up to now is kept at the old rate, so the wall clock does not jump.
+ */
+void arch_tsc_set_frequency(uint64_t hz)
+{
+    if (hz < 1000000)
+        return;
 
-    const uint64_t time_start = __rdtsc();
+    __atomic_store_n(&tsc_frequency, hz, __ATOMIC_RELAXED);
+    clocksource_set_frequency(&tsc_clocksource, hz);
+}
+
+#define TSC_REFERENCE_WINDOW_MS 10
+
+struct reference_sample
+{
+    uint64_t tsc;  /* middle of the rdtsc bracket around the read */
+    uint64_t skew; /* width of that bracket */
+    uint64_t count;
+};
 
-    if (inportb(KB_CONTROLLER_PORT_B) & KB_TIMER2_OUTPUT_STATUS)
+/* the tightest of a few bracketed reads */
+static struct reference_sample reference_sample(const struct clocksource *ref)
+{
+    struct reference_sample best = {.skew = ~0ULL};
+    for (int i = 0; i < PIT_SAMPLE_TRIES; i++)
     {
-        /* Loop until output goes low */
-        while (inportb(KB_CONTROLLER_PORT_B) & KB_TIMER2_OUTPUT_STATUS)
-            ;
+        const uint64_t before = __rdtsc();
+        const uint64_t count = ref->read();
+        const uint64_t after = __rdtsc();
+        if (after - before < best.skew)
+            best = (struct reference_sample){.tsc = before + (after - before) / 2, .skew = after - before, .count = count};
     }
-    else
+    return best;
+}
+
+/**
+ * @brief Measure the TSC again against @p ref, e.g. the HPET
+ *
+ * Only done if the rate was measured against the PIT or is the nominal
+ * one from CPUID 0x16; the new rate is kept if it is more precise.
+ */
+void arch_tsc_calibrate(const struct clocksource *ref)
+{
+    if (!ref || (tsc_source != TSC_SOURCE_PIT && tsc_source != TSC_SOURCE_CPUID_16H))
+        return;
+
+    const uint64_t window = ref->frequency * TSC_REFERENCE_WINDOW_MS / 1000;
+    const uint64_t timeout = arch_tsc_frequency(); /* a second */
+    const struct reference_sample start = reference_sample(ref);
+    struct reference_sample end;
+    do
     {
-        /* Loop until output goes high */
-        while ((inportb(KB_CONTROLLER_PORT_B) & KB_TIMER2_OUTPUT_STATUS) == 0)
-            ;
-    }
-    const uint64_t time_end = __rdtsc();
+        end = reference_sample(ref);
+        if (end.tsc - start.tsc > timeout)
+        {
+            KLOGW("TSC", "%s is not counting", ref->name);
+            return;
+        }
+    } while (((end.count - start.count) & ref->mask) < window);
+
+    const uint64_t ticks = (end.count - start.count) & ref->mask;
+    const uint64_t cycles = end.tsc - start.tsc;
+    /* in two steps, each within 64 bits: ticks is a 10 ms window, so the remainder times the frequency stays small */
+    const uint64_t hz = cycles / ticks * ref->frequency + cycles % ticks * ref->frequency / ticks;
+    /* half of each bracket, plus one reference tick for the counter resolution */
+    const uint64_t error = (start.skew + end.skew) / 2 + hz / ref->frequency;
+    const uint64_t ppm = error * 1000000 / cycles;
+    if (tsc_source == TSC_SOURCE_PIT && ppm >= tsc_ppm)
+        return;
+
+    KLOGI("TSC", "%lu.%06lu MHz from %s, +-%lu ppm", hz / 1000000, hz % 1000000, ref->name, ppm);
+    tsc_source = TSC_SOURCE_REFERENCE;
+    tsc_ppm = ppm;
+    arch_tsc_set_frequency(hz);
+}
 
-    const uint64_t current_tsc_mhz = (time_end - time_start) / 10000; // divide by 10ms  to obtain speed in Mhz
-    if (current_tsc_mhz != 0)
-        tsc_mhz = current_tsc_mhz;
-    tsc_basis_time = time_start / tsc_mhz;
+/**
+ * @brief Stop trusting the TSC as a clock source, e.g. because the CPUs' TSCs disagree
+ */
+void arch_tsc_mark_unstable(const char *reason)
+{
+    if (tsc_clocksource.rating <= CLOCKSOURCE_RATING_TSC_UNSTABLE)
+        return;
 
-    KLOGD("TSC", "TSC timed at %lu MHz\n", tsc_mhz);
-    KLOGD("TSC", "Boot time is %lus\n", arch_boot_time);
-    KLOGD("TSC", "Initial TSC timestamp was %luus\n", tsc_basis_time);
+    KLOGW("TSC", "unstable: %s", reason);
+    clocksource_set_rating(&tsc_clocksource, CLOCKSOURCE_RATING_TSC_UNSTABLE);
+}
+
+/**
+ * @brief TSC rate in MHz, as determined by arch_clock_initialize()
+ */
+uint64_t arch_cpu_mhz(void)
+{
+    return arch_tsc_frequency() / 1000000;
+}
+
+/**
+ * @brief TSC rate in Hz, as determined by arch_clock_initialize() and arch_tsc_calibrate()
+ */
+uint64_t arch_tsc_frequency(void)
+{
+    return __atomic_load_n(&tsc_frequency, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Convert a TSC reading into wall-clock time
+ *
+ * Taken from the clocksource time base rather than kept separately, so
+ * stamps follow clock_set_realtime() and a change of clock source. A
+ * counter read, a multiplication and a shift; no port I/O with the TSC
+ * in use, no division by the TSC rate and no lock, so it is cheap enough
+ * to use for every log line.
+ *
+ * @param tsc        value read with rdtsc
+ * @param seconds    seconds since the Unix epoch
+ * @param subseconds microseconds into that second
+ */
+void arch_tsc_to_time(uint64_t tsc, uint64_t *seconds, uint64_t *subseconds)
+{
+    const uint64_t ns = clock_realtime_ns_at(&tsc_clocksource, tsc);
+    *seconds = ns / NSEC_PER_SEC;
+    *subseconds = ns % NSEC_PER_SEC / 1000;
 }
 
 unsigned short century_register = 0x00; // Set by ACPI table parsing code if possible
-static date_t current_date;
+
+/**
+ * @brief Use CMOS register @p reg for the century from now on
+ *
+ * The ACPI tables are parsed after arch_clock_initialize() has read the RTC
+ * and assumed the 21st century, so the boot time is corrected here: the
+ * clocks move by the whole centuries the guess was off, and the time counted
+ * since boot stays as it is.
+ */
+void arch_clock_set_century_register(unsigned short reg)
+{
+    century_register = reg;
+    if (!arch_boot_date.year)
+        return; /* arch_clock_initialize() will read it itself */
+
+    const date_t now = rtc_read_date();
+    date_t boot_date = arch_boot_date;
+    boot_date.year = now.year - now.year % 100 + boot_date.year % 100;
+    const int64_t delta = (int64_t)date_to_epoch(&boot_date) - arch_boot_time;
+    if (!delta)
+        return;
+
+    arch_boot_date = boot_date;
+    arch_boot_time += delta;
+    clock_set_realtime(clock_realtime_ns() + delta * NSEC_PER_SEC);
+    KLOGI("RTC", "century register %#x: boot year is %u", reg, boot_date.year);
+}
 
 enum
 {
@@ -220,97 +541,74 @@ unsigned char get_RTC_register(int reg)
     return inportb(CMOS_DATA_PORT);
 }
 
-// #define IS_LEAP_YEAR(year) (((year) % 4 == 0) && (((year) % 100 != 0) || ((year) % 400 == 0)))
-#define IS_LEAP_YEAR(year) (((year)&3) == 0 && (((year) % 25) != 0 || ((year)&15) == 0)) /* optimized version */
-
-/**
- * @brief calculate seconds passed since Unix epoch until the given year.
- *
- * @param year Gregorian Calendar Year
- * @returns Seconds passed since the Unix epoch
+/*
+ * Days since 1970-01-01 of a date in the proleptic Gregorian calendar, and
+ * back, in constant time (Howard Hinnant's days_from_civil/civil_from_days).
+ * Years are counted from March so the leap day is the last day of a year;
+ * an era is the 400-year cycle of 146097 days.
  */
-static uint64_t year_to_seconds(unsigned int year)
+static int64_t days_from_civil(int64_t year, unsigned int month, unsigned int day)
 {
-    // count days passed since 1970
-    uint64_t days = 0;
-    while (year > 1969)
-    {
-        days += 365;
-        if (IS_LEAP_YEAR(year))
-        {
-            days++;
-        }
-        year--;
-    }
-    return days * 86400;
+    year -= month <= 2;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned int year_of_era = (unsigned int)(year - era * 400);                        // [0, 399]
+    const unsigned int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1; // [0, 365]
+    const unsigned int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (int64_t)day_of_era - 719468;
 }
 
-/**
- * @brief calculate seconds passed since the start of a year until a certain month
- *
- * Handles leap year properly
- *
- * @param month Gregorian Calendar month
- * @param year   Gregorian Calendar Year
- * @return Number of seconds in that month.
- */
-static uint64_t months_to_seconds(unsigned int month, unsigned int year)
+static void civil_from_days(int64_t days, date_t *date)
 {
+    days += 719468;
+    const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned int day_of_era = (unsigned int)(days - era * 146097);                                             // [0, 146096]
+    const unsigned int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365; // [0, 399]
+    const unsigned int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const unsigned int mp = (5 * day_of_year + 2) / 153; // month, counted from March
+    date->day = day_of_year - (153 * mp + 2) / 5 + 1;
+    date->month = mp < 10 ? mp + 3 : mp - 9;
+    date->year = (unsigned int)(year_of_era + era * 400 + (date->month <= 2));
+}
 
-    // calculate days passed since since the start of a year until given "month"
-    uint64_t days = 0;
-    switch (month)
-    {
-    case 11:
-        days += 30; /* fallthrough */
-    case 10:
-        days += 31; /* fallthrough */
-    case 9:
-        days += 30; /* fallthrough */
-    case 8:
-        days += 31; /* fallthrough */
-    case 7:
-        days += 31; /* fallthrough */
-    case 6:
-        days += 30; /* fallthrough */
-    case 5:
-        days += 31; /* fallthrough */
-    case 4:
-        days += 30; /* fallthrough */
-    case 3:
-        days += 31; /* fallthrough */
-    case 2:
-        days += 28;
-        if (IS_LEAP_YEAR(year))
-        {
-            days++;
-        } /* fallthrough */
-    case 1:
-        days += 31; /* fallthrough */
-    default:
-        break;
-    }
-    return days * 86400;
+uint64_t date_to_epoch(const date_t *date)
+{
+    const int64_t days = days_from_civil(date->year, date->month, date->day);
+    return (uint64_t)days * 86400 + date->hour * 3600 + date->minute * 60 + date->second;
 }
 
-date_t read_rtc()
+void epoch_to_date(uint64_t epoch, date_t *date)
+{
+    const uint64_t seconds_of_day = epoch % 86400;
+    civil_from_days((int64_t)(epoch / 86400), date);
+    date->hour = seconds_of_day / 3600;
+    date->minute = seconds_of_day / 60 % 60;
+    date->second = seconds_of_day % 60;
+}
+
+/**
+ * @brief Read the date from the CMOS clock
+ *
+ * Slow: waits for the RTC to be between updates, twice. Only used once,
+ * at boot; after that the time is kept by the clock sources.
+ */
+static date_t rtc_read_date(void)
 {
     unsigned char century = 0;
     unsigned char last_century = 0;
     unsigned char registerB;
-    date_t last_date;
+    date_t date, last_date;
 
     // Note: This uses the "read registers until you get the same values twice in a row" technique
     //       to avoid getting dodgy/inconsistent values due to RTC updates
 
     while (get_update_in_progress_flag())
         ; // Make sure an update isn't in progress
-    current_date.second = get_RTC_register(CMOS_RTC_SECONDS);
-    current_date.minute = get_RTC_register(CMOS_RTC_MINUTES);
-    current_date.hour = get_RTC_register(CMOS_RTC_HOURS);
-    current_date.day = get_RTC_register(CMOS_RTC_DAYS);
-    current_date.month = get_RTC_register(CMOS_RTC_MONTHS);
-    current_date.year = get_RTC_register(CMOS_RTC_YEARS);
+    date.second = get_RTC_register(CMOS_RTC_SECONDS);
+    date.minute = get_RTC_register(CMOS_RTC_MINUTES);
+    date.hour = get_RTC_register(CMOS_RTC_HOURS);
+    date.day = get_RTC_register(CMOS_RTC_DAYS);
+    date.month = get_RTC_register(CMOS_RTC_MONTHS);
+    date.year = get_RTC_register(CMOS_RTC_YEARS);
     if (century_register != 0)
     {
         century = get_RTC_register(century_register);
@@ -319,22 +617,22 @@ date_t read_rtc()
     do
     {
         last_century = century;
-        last_date = current_date;
+        last_date = date;
 
         while (get_update_in_progress_flag())
             ; // Make sure an update isn't in progress
-        current_date.second = get_RTC_register(CMOS_RTC_SECONDS);
-        current_date.minute = get_RTC_register(CMOS_RTC_MINUTES);
-        current_date.hour = get_RTC_register(CMOS_RTC_HOURS);
-        current_date.day = get_RTC_register(CMOS_RTC_DAYS);
-        current_date.month = get_RTC_register(CMOS_RTC_MONTHS);
-        current_date.year = get_RTC_register(CMOS_RTC_YEARS);
+        date.second = get_RTC_register(CMOS_RTC_SECONDS);
+        date.minute = get_RTC_register(CMOS_RTC_MINUTES);
+        date.hour = get_RTC_register(CMOS_RTC_HOURS);
+        date.day = get_RTC_register(CMOS_RTC_DAYS);
+        date.month = get_RTC_register(CMOS_RTC_MONTHS);
+        date.year = get_RTC_register(CMOS_RTC_YEARS);
         if (century_register != 0)
         {
             century = get_RTC_register(century_register);
         }
-    } while ((last_date.second != current_date.second) || (last_date.minute != current_date.minute) || (last_date.hour != current_date.hour) ||
-             (last_date.day != current_date.day) || (last_date.month != current_date.month) || (last_date.year != current_date.year) ||
+    } while ((last_date.second != date.second) || (last_date.minute != date.minute) || (last_date.hour != date.hour) ||
+             (last_date.day != date.day) || (last_date.month != date.month) || (last_date.year != date.year) ||
              (last_century != century));
 
     registerB = get_RTC_register(CMOS_STATUS_REG_B);
@@ -348,48 +646,47 @@ date_t read_rtc()
     if (!(registerB & CMOS_STATUS_B_BINARY_MODE))
     {
 #define BCD_TO_BIN(val) ((((val) / 16) * 10) + ((val)&0xf))
-        current_date.second = BCD_TO_BIN(current_date.second);
-        current_date.minute = BCD_TO_BIN(current_date.minute);
-        current_date.day = BCD_TO_BIN(current_date.day);
-        current_date.month = BCD_TO_BIN(current_date.month);
-        current_date.year = BCD_TO_BIN(current_date.year);
+        date.second = BCD_TO_BIN(date.second);
+        date.minute = BCD_TO_BIN(date.minute);
+        date.day = BCD_TO_BIN(date.day);
+        date.month = BCD_TO_BIN(date.month);
+        date.year = BCD_TO_BIN(date.year);
         if (century_register != 0)
         {
             century = BCD_TO_BIN(century);
         }
 
         // hours are handled a little differently since they come in two different formats (12 hour/ 24 hour)
-        current_date.hour = ((current_date.hour & 0x0F) + (((current_date.hour & 0x70) / 16) * 10)) | (current_date.hour & 0x80);
+        date.hour = ((date.hour & 0x0F) + (((date.hour & 0x70) / 16) * 10)) | (date.hour & 0x80);
     }
 
     // Convert 12 hour clock to 24 hour clock if necessary
-    if (!(registerB & CMOS_STATUS_B_HOUR_FORMAT) && (current_date.hour & 0x80))
+    if (!(registerB & CMOS_STATUS_B_HOUR_FORMAT) && (date.hour & 0x80))
     {
-        current_date.hour = ((current_date.hour & 0x7F) + 12) % 24;
+        date.hour = ((date.hour & 0x7F) + 12) % 24;
     }
 
     // Calculate the full (4-digit) year
     if (century_register != 0)
     {
-        current_date.year += century * 100;
+        date.year += century * 100;
     }
     else
     {
-        current_date.year += 2000; // rtc year register contains years passed since 2000
+        date.year += 2000; // rtc year register contains years passed since 2000
     }
 
-    return current_date;
+    return date;
 }
 
-uint64_t read_epoch_time()
-{
-    // calculate std::time from <time.h>
-    uint64_t time =
-        year_to_seconds(current_date.year - 1) +
-        months_to_seconds(current_date.month - 1, current_date.year) +
-        (current_date.day - 1) * 86400 +
-        (current_date.hour) * 3600 +
-        (current_date.minute) * 60 +
-        current_date.second + 0;
-    return time;
-}
\ No newline at end of file
+uint64_t read_epoch_time(void)
+{
+    return clock_realtime_ns() / NSEC_PER_SEC;
+}
+
+date_t read_date(void)
+{
+    date_t date;
+    epoch_to_date(read_epoch_time(), &date);
+    return date;
+}
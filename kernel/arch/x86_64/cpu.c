@@ -1,15 +1,51 @@
 #include <cpu.h>
+#include <console.h>
+#include <kernel/arch/x86_64/irq.h>
+#include <klog.h>
 
+struct processor_local processor_local_data[MAX_CPUS];
 
+void arch_cpu_local_initialize(int cpu_id)
+{
+    enum {
+        IA32_GS_BASE = 0xC0000101,
+    };
+    struct processor_local *local = &processor_local_data[cpu_id];
+    const uintptr_t base = (uintptr_t)local;
 
+    local->self = local;
+    local->cpu_id = cpu_id;
+    local->tsc_offset = 0;
+    asm volatile("wrmsr" : : "c"(IA32_GS_BASE), "a"((uint32_t)base), "d"((uint32_t)(base >> 32)));
+}
 
+void arch_idle(void)
+{
+    for (;;) {
+        if (klog_poll()) {
+            asm volatile("pause");
+            continue;
+        }
+        /* a record logged by an interrupt between the poll and the cli is seen by the second poll */
+        asm volatile("cli" : : : "memory");
+        if (klog_poll()) {
+            arch_irq_enable();
+            continue;
+        }
+        /* sti only takes effect after the next instruction, so no interrupt slips in before the hlt */
+        asm volatile("sti\n\thlt" : : : "memory");
+    }
+}
 
 // Halt and catch fire function.
 void arch_hcf(void)
 {
+    irq_stats_dump();
+    /* the last words have to be out before interrupts go off for good */
+    klog_sync();
+    console_flush();
     asm("cli");
     for (;;) {
         asm("hlt");
     }
 }
-
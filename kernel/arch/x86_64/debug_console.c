@@ -1,16 +1,17 @@
 #include <kernel/arch/x86_64/debug_console.h>
 #include <kernel/arch/x86_64/ports.h>
+#include <console.h>
 #include <misc/kprintf.h>
 void debugcon_init()
 {
-    kprintf_set_putchar(debugcon_putchar);
+    console_set_output(debugcon_write);
+    kprintf_set_write(console_write);
 }
 
-void debugcon_putchar(char ch)
+void debugcon_write(const char *buf, size_t len)
 {
     enum {
         DEBUG_CONSOLE_PORT = 0xE9,
     };
-    outportb(DEBUG_CONSOLE_PORT, ch);
+    outportbm(DEBUG_CONSOLE_PORT, (unsigned char *)buf, len);
 }
-
@@ -0,0 +1,79 @@
+#include <kernel/arch/x86_64/gdt.h>
+#include <cpu.h>
+
+/* GDT access bits, as in the bootstrap GDT */
+enum {
+    GDT_PRESENT = (1 << 7),
+    GDT_NOT_SYS = (1 << 4),
+    GDT_EXEC = (1 << 3),
+    GDT_RW = (1 << 1),
+    GDT_TYPE_TSS_AVAILABLE = 0x9,
+};
+
+/* GDT flag bits */
+enum {
+    GDT_GRAN_4K = (1 << 7),
+    GDT_SZ_32 = (1 << 6),
+    GDT_LONG_MODE = (1 << 5),
+};
+
+struct gdt {
+    uint64_t null;
+    uint64_t code;
+    uint64_t data;
+    uint64_t tss_low;
+    uint64_t tss_high;
+} __attribute__((packed, aligned(8)));
+
+struct gdt_pointer {
+    uint16_t limit;
+    uintptr_t base;
+} __attribute__((packed));
+
+static struct gdt gdts[MAX_CPUS];
+static struct tss tsses[MAX_CPUS];
+static uint8_t ist_stacks[MAX_CPUS][IST_COUNT][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+static uint64_t gdt_segment(uint8_t access, uint8_t flags)
+{
+    return 0xFFFFULL | (uint64_t)access << 40 | (uint64_t)(flags | 0xF) << 48;
+}
+
+void gdt_initialize(void)
+{
+    const int cpu = arch_cpu_id();
+    struct gdt *gdt = &gdts[cpu];
+    struct tss *tss = &tsses[cpu];
+
+    for (int i = 0; i < IST_COUNT; i++) {
+        tss->ist[i] = (uintptr_t)ist_stacks[cpu][i] + IST_STACK_SIZE; /* slot i + 1 */
+    }
+    tss->iomap_base = sizeof(*tss); /* no I/O permission bitmap */
+
+    const uintptr_t base = (uintptr_t)tss;
+    const uint64_t limit = sizeof(*tss) - 1;
+    gdt->null = 0;
+    gdt->code = gdt_segment(GDT_PRESENT | GDT_NOT_SYS | GDT_EXEC | GDT_RW, GDT_GRAN_4K | GDT_LONG_MODE);
+    gdt->data = gdt_segment(GDT_PRESENT | GDT_NOT_SYS | GDT_RW, GDT_GRAN_4K | GDT_SZ_32);
+    gdt->tss_low = (limit & 0xFFFF) | (uint64_t)(base & 0xFFFFFF) << 16 |
+                   (uint64_t)(GDT_PRESENT | GDT_TYPE_TSS_AVAILABLE) << 40 | ((limit >> 16) & 0xF) << 48 |
+                   (uint64_t)((base >> 24) & 0xFF) << 56;
+    gdt->tss_high = base >> 32;
+
+    const struct gdt_pointer pointer = {.limit = sizeof(*gdt) - 1, .base = (uintptr_t)gdt};
+
+    /* reload CS with a far return; FS and GS are left alone, loading them would clear the per-CPU GS base */
+    asm volatile("lgdt %0\n\t"
+                 "pushq %1\n\t"
+                 "leaq 1f(%%rip), %%rax\n\t"
+                 "pushq %%rax\n\t"
+                 "lretq\n"
+                 "1:\n\t"
+                 "movw %w2, %%ds\n\t"
+                 "movw %w2, %%es\n\t"
+                 "movw %w2, %%ss\n\t"
+                 "ltr %w3"
+                 :
+                 : "m"(pointer), "i"(GDT_KERNEL_CODE), "r"(GDT_KERNEL_DATA), "r"(GDT_TSS)
+                 : "rax", "memory");
+}
@@ -0,0 +1,277 @@
+#include <kernel/arch/x86_64/acpi.h>
+#include <kernel/arch/x86_64/hpet.h>
+#include <kernel/arch/x86_64/ioapic.h>
+#include <kernel/arch/x86_64/irq.h>
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <kernel/mmu.h>
+#include <cpu.h>
+#include <klog.h>
+#include <cpuid.h>
+
+static const char *TAG = "hpet";
+
+#define FEMTOSECONDS_PER_SECOND 1000000000000000ULL
+#define HPET_MAX_PERIOD 100000000 /* fs; the specification caps the period at 100 ns */
+
+/*
+ * Comparators only match on equality: one written after the counter has
+ * passed it fires when the counter wraps, which may be minutes later. A
+ * write takes a few hundred ns on real chipsets, so events closer than
+ * this are reported as too late.
+ */
+#define HPET_MIN_CYCLES 128
+#define HPET_MIN_PROG_DELTA (HPET_MIN_CYCLES + (HPET_MIN_CYCLES >> 1))
+
+#define MSI_ADDRESS_BASE 0xFEE00000
+#define MSI_ADDRESS_DEST_SHIFT 12
+
+static volatile uint8_t *hpet_base;
+static uint64_t hpet_hz;
+static unsigned int hpet_comparator_count;
+
+struct hpet_comparator {
+    struct clock_event_device evt; /* must stay first, the clock event callbacks cast back */
+    unsigned int index;
+    int enabled;
+    int gsi; /* IOAPIC input, -1 with FSB delivery */
+};
+
+static struct hpet_comparator hpet_comparators[HPET_MAX_COMPARATORS];
+
+static inline uint32_t hpet_read32(unsigned int reg)
+{
+    return *(volatile uint32_t *)(hpet_base + reg);
+}
+
+static inline void hpet_write32(unsigned int reg, uint32_t value)
+{
+    *(volatile uint32_t *)(hpet_base + reg) = value;
+}
+
+static inline uint64_t hpet_read64(unsigned int reg)
+{
+    return *(volatile uint64_t *)(hpet_base + reg);
+}
+
+static inline void hpet_write64(unsigned int reg, uint64_t value)
+{
+    *(volatile uint64_t *)(hpet_base + reg) = value;
+}
+
+static inline unsigned int hpet_timer_reg(unsigned int reg, unsigned int index)
+{
+    return reg + index * HPET_TIMER_STRIDE;
+}
+
+static uint64_t hpet_clocksource_read(void)
+{
+    return hpet_read64(HPET_MAIN_COUNTER);
+}
+
+static uint64_t hpet_clocksource_read32(void)
+{
+    return hpet_read32(HPET_MAIN_COUNTER);
+}
+
+static struct clocksource hpet_clocksource = {
+    .name = "hpet",
+    .read = hpet_clocksource_read,
+    .mask = ~0ULL,
+    .rating = CLOCKSOURCE_RATING_HPET,
+};
+
+/* comparators run in 32-bit mode, so the same code works with a 32-bit main counter */
+static int hpet_set_next_event(struct clock_event_device *evt, uint64_t ticks)
+{
+    struct hpet_comparator *comparator = (struct hpet_comparator *)evt;
+
+    if (!comparator->enabled) {
+        const unsigned int config = hpet_timer_reg(HPET_TIMER_CONFIG, comparator->index);
+        hpet_write32(config, hpet_read32(config) | HPET_TIMER_INT_ENABLE);
+        comparator->enabled = 1;
+    }
+
+    const uint32_t target = hpet_read32(HPET_MAIN_COUNTER) + (uint32_t)ticks;
+    hpet_write32(hpet_timer_reg(HPET_TIMER_COMPARATOR, comparator->index), target);
+    return (int32_t)(target - hpet_read32(HPET_MAIN_COUNTER)) < HPET_MIN_CYCLES ? -1 : 0;
+}
+
+static void hpet_shutdown(struct clock_event_device *evt)
+{
+    struct hpet_comparator *comparator = (struct hpet_comparator *)evt;
+    const unsigned int config = hpet_timer_reg(HPET_TIMER_CONFIG, comparator->index);
+
+    hpet_write32(config, hpet_read32(config) & ~HPET_TIMER_INT_ENABLE);
+    comparator->enabled = 0;
+}
+
+static void hpet_interrupt(unsigned int vector, struct regs *regs)
+{
+    (void)regs;
+    const unsigned int comparator = vector - IRQ_VECTOR_HPET;
+    if (comparator >= HPET_MAX_COMPARATORS) {
+        return;
+    }
+    struct clock_event_device *evt = &hpet_comparators[comparator].evt;
+    if (evt->event_handler) {
+        evt->event_handler(evt);
+    }
+}
+
+static void hpet_ioapic_interrupt(unsigned int vector, struct regs *regs)
+{
+    for (unsigned int i = 0; i < hpet_comparator_count; i++) {
+        if (hpet_comparators[i].gsi == (int)(vector - IRQ_VECTOR_IOAPIC)) {
+            hpet_interrupt(IRQ_VECTOR_HPET + i, regs);
+            return;
+        }
+    }
+}
+
+/* initial APIC ID of the calling CPU, the MSI destination */
+static unsigned int hpet_this_apic_id(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    return ebx >> 24;
+}
+
+/* register comparator @p index, whose interrupt is already routed to the calling CPU */
+static void hpet_comparator_register(unsigned int index, int gsi)
+{
+    struct hpet_comparator *comparator = &hpet_comparators[index];
+    comparator->index = index;
+    comparator->gsi = gsi;
+    comparator->evt = (struct clock_event_device){
+        .name = "hpet",
+        .features = CLOCKEVENT_FEATURE_ONESHOT,
+        .rating = CLOCKEVENT_RATING_HPET,
+        .cpu = arch_cpu_id(),
+        .frequency = hpet_hz,
+        .min_delta_ticks = HPET_MIN_PROG_DELTA,
+        .max_delta_ticks = 0x7FFFFFFF,
+        .set_next_event = hpet_set_next_event,
+        .shutdown = hpet_shutdown,
+    };
+    clockevent_register(&comparator->evt);
+}
+
+/* turn every comparator off, then register those that can send MSIs */
+static void hpet_comparators_initialize(uint64_t capabilities)
+{
+    const unsigned int count = ((capabilities >> HPET_CAP_NUM_TIMERS_SHIFT) & HPET_CAP_NUM_TIMERS_MASK) + 1;
+    const unsigned int apic_id = hpet_this_apic_id();
+    unsigned int registered = 0;
+
+    hpet_comparator_count = count;
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned int config_reg = hpet_timer_reg(HPET_TIMER_CONFIG, i);
+        uint32_t config = hpet_read32(config_reg);
+        config &= ~(HPET_TIMER_INT_ENABLE | HPET_TIMER_PERIODIC | HPET_TIMER_LEVEL_TRIGGERED | HPET_TIMER_FSB_ENABLE);
+        hpet_write32(config_reg, config);
+
+        if (!(config & HPET_TIMER_FSB_CAP)) {
+            continue; /* needs an IOAPIC input, see hpet_route_comparators() */
+        }
+
+        hpet_write64(hpet_timer_reg(HPET_TIMER_FSB_ROUTE, i),
+                     (uint64_t)(MSI_ADDRESS_BASE | apic_id << MSI_ADDRESS_DEST_SHIFT) << 32 | (IRQ_VECTOR_HPET + i));
+        if (config & HPET_TIMER_SIZE_64_CAP) {
+            config |= HPET_TIMER_32BIT_MODE;
+        }
+        hpet_write32(config_reg, config | HPET_TIMER_FSB_ENABLE);
+        irq_install_handler(IRQ_VECTOR_HPET + i, hpet_interrupt);
+        hpet_comparator_register(i, -1);
+        registered++;
+    }
+    KLOGI(TAG, "%u comparators, %u with MSI delivery", count, registered);
+}
+
+void hpet_route_comparators(void)
+{
+    uint32_t used = 0; /* GSIs taken by an earlier comparator */
+    unsigned int registered = 0;
+
+    for (unsigned int i = 0; i < hpet_comparator_count; i++) {
+        const unsigned int config_reg = hpet_timer_reg(HPET_TIMER_CONFIG, i);
+        uint32_t config = hpet_read32(config_reg);
+        if (config & HPET_TIMER_FSB_CAP) {
+            continue;
+        }
+
+        /* the ISA inputs belong to the legacy devices, so only the ones above are taken */
+        uint32_t route_cap = hpet_read32(config_reg + 4) & ~used & ~((1U << ACPI_ISA_IRQS) - 1);
+        int gsi = -1;
+        while (route_cap && gsi < 0) {
+            const unsigned int candidate = __builtin_ctz(route_cap);
+            route_cap &= route_cap - 1;
+            if (ioapic_set_affinity(candidate, arch_cpu_id()) == 0 &&
+                ioapic_route_gsi(candidate, 0, hpet_ioapic_interrupt) == 0) {
+                gsi = (int)candidate;
+            }
+        }
+        if (gsi < 0) {
+            continue; /* stays off */
+        }
+        used |= 1U << gsi;
+
+        config &= ~(HPET_TIMER_INT_ROUTE_MASK << HPET_TIMER_INT_ROUTE_SHIFT);
+        config |= (uint32_t)gsi << HPET_TIMER_INT_ROUTE_SHIFT;
+        if (config & HPET_TIMER_SIZE_64_CAP) {
+            config |= HPET_TIMER_32BIT_MODE;
+        }
+        hpet_write32(config_reg, config);
+        hpet_comparator_register(i, gsi);
+        registered++;
+    }
+    if (registered) {
+        KLOGI(TAG, "%u comparators through the IOAPIC", registered);
+    }
+}
+
+int hpet_initialize(void)
+{
+    const struct hpet_table *table = (const struct hpet_table *)acpi_find_table("HPET");
+    if (!table || table->base_address.address_space_id != ACPI_SPACE_SYSTEM_MEMORY) {
+        return -1;
+    }
+
+    hpet_base = mmu_map_mmio(table->base_address.address, 0x400, MMU_CACHE_UC);
+    if (!hpet_base) {
+        return -1;
+    }
+
+    const uint64_t capabilities = hpet_read64(HPET_GENERAL_CAPABILITIES);
+    const uint32_t period = capabilities >> 32;
+    if (!period || period > HPET_MAX_PERIOD) {
+        KLOGW(TAG, "bogus counter period %u fs", period);
+        hpet_base = NULL;
+        return -1;
+    }
+    hpet_hz = FEMTOSECONDS_PER_SECOND / period;
+
+    /* the comparators are reprogrammed with the counter stopped */
+    const uint64_t config = hpet_read64(HPET_GENERAL_CONFIG) & ~(HPET_CONFIG_ENABLE | HPET_CONFIG_LEGACY_REPLACEMENT);
+    hpet_write64(HPET_GENERAL_CONFIG, config);
+    hpet_comparators_initialize(capabilities);
+    hpet_write64(HPET_GENERAL_CONFIG, config | HPET_CONFIG_ENABLE);
+
+    if (!(capabilities & HPET_CAP_COUNT_SIZE_64)) {
+        hpet_clocksource.read = hpet_clocksource_read32;
+        hpet_clocksource.mask = 0xFFFFFFFF;
+    }
+    hpet_clocksource.frequency = hpet_hz;
+    clocksource_register(&hpet_clocksource);
+    return 0;
+}
+
+uint64_t hpet_frequency(void)
+{
+    return hpet_hz;
+}
+
+const struct clocksource *hpet_clocksource_get(void)
+{
+    return hpet_base ? &hpet_clocksource : NULL;
+}
@@ -0,0 +1,217 @@
+#include <kernel/arch/x86_64/gdt.h>
+#include <kernel/arch/x86_64/irq.h>
+#include <kernel/arch/x86_64/lapic.h>
+#include <kernel/misc.h>
+#include <cpu.h>
+#include <klog.h>
+
+static const char *TAG = "irq";
+
+/* present, ring 0, 64-bit interrupt gate: IF is cleared on entry */
+#define IDT_INTERRUPT_GATE 0x8E
+
+extern const uintptr_t isr_stub_table[IRQ_VECTORS_COUNT];
+
+static idt_entry_t idt[IRQ_VECTORS_COUNT] __attribute__((aligned(16)));
+static irq_handler_t irq_handlers[IRQ_VECTORS_COUNT];
+static struct irq_stats irq_stats[MAX_CPUS][IRQ_VECTORS_COUNT] __attribute__((aligned(64)));
+
+static const char *exception_names[IRQ_EXCEPTIONS_COUNT] = {
+    "divide error",
+    "debug",
+    "non-maskable interrupt",
+    "breakpoint",
+    "overflow",
+    "bound range exceeded",
+    "invalid opcode",
+    "device not available",
+    "double fault",
+    "coprocessor segment overrun",
+    "invalid TSS",
+    "segment not present",
+    "stack-segment fault",
+    "general protection fault",
+    "page fault",
+    "reserved",
+    "x87 floating-point exception",
+    "alignment check",
+    "machine check",
+    "SIMD floating-point exception",
+    "virtualization exception",
+    "control protection exception",
+    [22 ... 27] = "reserved",
+    "hypervisor injection exception",
+    "VMM communication exception",
+    "security exception",
+    "reserved",
+};
+
+/* the exceptions that may hit with a broken stack; the others stay on the stack they interrupt, so they can nest */
+static unsigned int idt_ist_slot(unsigned int vector)
+{
+    switch (vector) {
+    case 2:
+        return IST_NMI;
+    case 8:
+        return IST_DOUBLE_FAULT;
+    case 18:
+        return IST_MACHINE_CHECK;
+    default:
+        return 0;
+    }
+}
+
+static void idt_set_gate(unsigned int vector, uintptr_t handler, unsigned int ist)
+{
+    idt[vector] = (idt_entry_t){
+        .base_low = handler & 0xFFFF,
+        .selector = GDT_KERNEL_CODE,
+        .zero = ist,
+        .flags = IDT_INTERRUPT_GATE,
+        .base_mid = (handler >> 16) & 0xFFFF,
+        .base_high = handler >> 32,
+    };
+}
+
+static void irq_account(unsigned int vector, uint64_t entry_tsc)
+{
+    const uint64_t cycles = arch_tsc_read() - entry_tsc;
+    struct irq_stats *stats = &irq_stats[arch_cpu_id()][vector];
+
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) - IRQ_HISTOGRAM_MIN_SHIFT : 0;
+    if (bucket < 0) {
+        bucket = 0;
+    } else if (bucket >= IRQ_HISTOGRAM_BUCKETS) {
+        bucket = IRQ_HISTOGRAM_BUCKETS - 1;
+    }
+
+    stats->count++;
+    stats->cycles += cycles;
+    stats->histogram[bucket]++;
+}
+
+static void exception_dump(const struct regs *r)
+{
+    uintptr_t cr2 = 0;
+    if (r->int_no == 14) {
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    }
+
+    KLOGE(TAG, "cpu %d: %s (vector %lu, error %#lx) at %#lx", arch_cpu_id(), exception_names[r->int_no],
+          r->int_no, r->err_code, r->rip);
+    if (r->int_no == 14) {
+        KLOGE(TAG, "  address %#lx", cr2);
+    }
+    KLOGE(TAG, "  rax %016lx rbx %016lx rcx %016lx rdx %016lx", r->rax, r->rbx, r->rcx, r->rdx);
+    KLOGE(TAG, "  rsi %016lx rdi %016lx rbp %016lx rsp %016lx", r->rsi, r->rdi, r->rbp, r->rsp);
+    KLOGE(TAG, "  r8  %016lx r9  %016lx r10 %016lx r11 %016lx", r->r8, r->r9, r->r10, r->r11);
+    KLOGE(TAG, "  r12 %016lx r13 %016lx r14 %016lx r15 %016lx", r->r12, r->r13, r->r14, r->r15);
+    KLOGE(TAG, "  cs %#lx ss %#lx rflags %#lx", r->cs, r->ss, r->rflags);
+}
+
+/* execution can go on after these */
+static void exception_report(unsigned int vector, struct regs *r)
+{
+    KLOGW(TAG, "cpu %d: %s at %#lx", arch_cpu_id(), exception_names[vector], r->rip);
+}
+
+/*
+ * An NMI can arrive with any lock held, klog's included, so it must not log:
+ * isr_exception() counting it is all that happens.
+ */
+static void nmi_handler(unsigned int vector, struct regs *r)
+{
+    (void)vector;
+    (void)r;
+}
+
+/* called by the entry stubs of vectors 0-31 */
+void isr_exception(struct regs *r, uint64_t entry_tsc)
+{
+    const unsigned int vector = r->int_no;
+    const irq_handler_t handler = irq_handlers[vector];
+
+    if (!handler) {
+        exception_dump(r);
+        arch_hcf();
+    }
+    handler(vector, r);
+    irq_account(vector, entry_tsc);
+}
+
+/* called by the entry stubs of vectors 32-255 */
+void isr_irq(uint64_t vector, uint64_t entry_tsc)
+{
+    const irq_handler_t handler = irq_handlers[vector];
+
+    if (handler) {
+        handler(vector, NULL);
+    }
+    /* the local APIC does not expect an EOI for a spurious interrupt */
+    if (vector != IRQ_VECTOR_SPURIOUS) {
+        lapic_eoi();
+    }
+    irq_account(vector, entry_tsc);
+}
+
+void idt_initialize(void)
+{
+    if (!idt[0].flags) {
+        for (unsigned int i = 0; i < IRQ_VECTORS_COUNT; i++) {
+            idt_set_gate(i, isr_stub_table[i], idt_ist_slot(i));
+        }
+        irq_handlers[1] = exception_report;
+        irq_handlers[2] = nmi_handler;
+        irq_handlers[3] = exception_report;
+    }
+
+    /* one table for every CPU */
+    const struct idt_pointer pointer = {.limit = sizeof(idt) - 1, .base = (uintptr_t)idt};
+    asm volatile("lidt %0" : : "m"(pointer));
+}
+
+void irq_install_handler(unsigned int vector, irq_handler_t handler)
+{
+    if (vector >= IRQ_VECTORS_COUNT) {
+        return;
+    }
+    __atomic_store_n(&irq_handlers[vector], handler, __ATOMIC_RELEASE);
+}
+
+const struct irq_stats *irq_get_stats(int cpu, unsigned int vector)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS || vector >= IRQ_VECTORS_COUNT) {
+        return NULL;
+    }
+    return &irq_stats[cpu][vector];
+}
+
+/* upper bound in cycles of the bucket holding the given fraction of the interrupts, in per mille */
+static uint64_t irq_stats_percentile(const struct irq_stats *stats, unsigned int per_mille)
+{
+    const uint64_t rank = (stats->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < IRQ_HISTOGRAM_BUCKETS - 1; bucket++) {
+        seen += stats->histogram[bucket];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return bucket == IRQ_HISTOGRAM_BUCKETS - 1 ? UINT64_MAX : 1ULL << (bucket + 1 + IRQ_HISTOGRAM_MIN_SHIFT);
+}
+
+void irq_stats_dump(void)
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (unsigned int vector = 0; vector < IRQ_VECTORS_COUNT; vector++) {
+            const struct irq_stats *stats = &irq_stats[cpu][vector];
+            if (!stats->count) {
+                continue;
+            }
+            KLOGI(TAG, "cpu %d vector %#x: %lu, %lu cycles on average, p50 < %lu, p99 < %lu", cpu, vector,
+                  stats->count, stats->cycles / stats->count, irq_stats_percentile(stats, 500),
+                  irq_stats_percentile(stats, 990));
+        }
+    }
+}
@@ -0,0 +1,219 @@
+#include <kernel/arch/x86_64/acpi.h>
+#include <kernel/arch/x86_64/ioapic.h>
+#include <kernel/arch/x86_64/lapic.h>
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/mmu.h>
+#include <kernel/spinlock.h>
+#include <cpu.h>
+#include <klog.h>
+#include <stdbool.h>
+
+static const char *TAG = "ioapic";
+
+enum
+{
+    PIC1_COMMAND = 0x20,
+    PIC1_DATA = 0x21,
+    PIC2_COMMAND = 0xA0,
+    PIC2_DATA = 0xA1,
+};
+
+enum
+{
+    PIC_ICW1_INIT = 0x11, // initialize, ICW4 follows
+    PIC_ICW4_8086 = 0x01,
+};
+
+struct ioapic {
+    volatile uint8_t *base;
+    uint32_t gsi_base;
+    unsigned int inputs;
+};
+
+struct ioapic_gsi {
+    int cpu;        /* -1 until routed or pinned */
+    bool pinned;    /* by ioapic_set_affinity() */
+    uint32_t flags; /* polarity and trigger mode */
+    bool routed;
+};
+
+static struct acpi_madt_info madt;
+static struct ioapic ioapics[ACPI_MADT_MAX_IOAPICS];
+static unsigned int ioapic_count;
+static struct ioapic_gsi gsis[IOAPIC_MAX_GSIS];
+static int next_cpu; /* where the next GSI without affinity goes */
+
+/* the GSI state and the IOREGSEL/IOWIN pairs, which must not interleave */
+static spin_lock_t ioapic_lock = SPIN_LOCK_INIT;
+
+static uint32_t ioapic_read(const struct ioapic *ioapic, uint32_t reg)
+{
+    *(volatile uint32_t *)(ioapic->base + IOAPIC_REGSEL) = reg;
+    return *(volatile uint32_t *)(ioapic->base + IOAPIC_WINDOW);
+}
+
+static void ioapic_write(const struct ioapic *ioapic, uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(ioapic->base + IOAPIC_REGSEL) = reg;
+    *(volatile uint32_t *)(ioapic->base + IOAPIC_WINDOW) = value;
+}
+
+static struct ioapic *ioapic_for_gsi(unsigned int gsi)
+{
+    for (unsigned int i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].inputs) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+/* mask first, so that the input never fires with half of the entry written */
+static void ioapic_set_redirection(struct ioapic *ioapic, unsigned int input, uint64_t entry)
+{
+    ioapic_write(ioapic, IOAPIC_REDIRECTION + 2 * input, IOAPIC_MASKED);
+    ioapic_write(ioapic, IOAPIC_REDIRECTION + 2 * input + 1, entry >> 32);
+    ioapic_write(ioapic, IOAPIC_REDIRECTION + 2 * input, entry);
+}
+
+/* move the 8259s off the exception vectors, in case one raises a spurious IRQ, and mask every input */
+static void pic_disable(void)
+{
+    outportb(PIC1_COMMAND, PIC_ICW1_INIT);
+    outportb(PIC2_COMMAND, PIC_ICW1_INIT);
+    outportb(PIC1_DATA, IRQ_VECTOR_PIC);
+    outportb(PIC2_DATA, IRQ_VECTOR_PIC + 8);
+    outportb(PIC1_DATA, 1 << 2); // the slave is on IRQ 2
+    outportb(PIC2_DATA, 2);
+    outportb(PIC1_DATA, PIC_ICW4_8086);
+    outportb(PIC2_DATA, PIC_ICW4_8086);
+    outportb(PIC1_DATA, 0xFF);
+    outportb(PIC2_DATA, 0xFF);
+}
+
+/* the next CPU after the last one picked whose local APIC is up */
+static int ioapic_pick_cpu(void)
+{
+    for (int i = 0; i < MAX_CPUS; i++) {
+        const int cpu = (next_cpu + i) % MAX_CPUS;
+        if (lapic_apic_id(cpu) >= 0) {
+            next_cpu = cpu + 1;
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static void ioapic_program(unsigned int gsi)
+{
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    const struct ioapic_gsi *state = &gsis[gsi];
+
+    const uint64_t entry = (uint64_t)lapic_apic_id(state->cpu) << IOAPIC_DESTINATION_SHIFT | state->flags |
+                           (IRQ_VECTOR_IOAPIC + gsi);
+    ioapic_set_redirection(ioapic, gsi - ioapic->gsi_base, entry);
+}
+
+int ioapic_initialize(void)
+{
+    /* nothing drives the 8259s, and unmasked they would fire on the exception vectors once interrupts are on */
+    pic_disable();
+
+    if (acpi_madt_parse(&madt) || !madt.ioapic_count) {
+        KLOGW(TAG, "none found, device IRQs are not delivered");
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < madt.ioapic_count; i++) {
+        struct ioapic *ioapic = &ioapics[ioapic_count];
+        ioapic->base = mmu_map_mmio(madt.ioapics[i].address, 0x1000, MMU_CACHE_UC);
+        if (!ioapic->base) {
+            continue;
+        }
+        ioapic->gsi_base = madt.ioapics[i].gsi_base;
+        ioapic->inputs = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+
+        for (unsigned int input = 0; input < ioapic->inputs; input++) {
+            ioapic_set_redirection(ioapic, input, IOAPIC_MASKED);
+        }
+        KLOGI(TAG, "id %u at %#x: GSIs %u-%u", madt.ioapics[i].id, madt.ioapics[i].address, ioapic->gsi_base,
+              ioapic->gsi_base + ioapic->inputs - 1);
+        ioapic_count++;
+    }
+    if (!ioapic_count) {
+        return -1;
+    }
+
+    for (unsigned int gsi = 0; gsi < IOAPIC_MAX_GSIS; gsi++) {
+        gsis[gsi].cpu = -1;
+    }
+    return 0;
+}
+
+int ioapic_route_gsi(unsigned int gsi, uint32_t flags, irq_handler_t handler)
+{
+    if (gsi >= IOAPIC_MAX_GSIS || !ioapic_for_gsi(gsi)) {
+        KLOGW(TAG, "cannot route GSI %u", gsi);
+        return -1;
+    }
+
+    struct ioapic_gsi *state = &gsis[gsi];
+    const unsigned long irq_flags = arch_irq_save();
+    spin_lock(&ioapic_lock);
+    if (!state->pinned || lapic_apic_id(state->cpu) < 0) {
+        state->cpu = ioapic_pick_cpu();
+    }
+    const int cpu = state->cpu;
+    if (cpu >= 0) {
+        state->flags = flags & (IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL_TRIGGERED);
+        state->routed = true;
+        irq_install_handler(IRQ_VECTOR_IOAPIC + gsi, handler);
+        ioapic_program(gsi);
+    }
+    spin_unlock(&ioapic_lock);
+    arch_irq_restore(irq_flags);
+
+    if (cpu < 0) {
+        return -1;
+    }
+    KLOGI(TAG, "GSI %u -> cpu %d, vector %#x", gsi, cpu, IRQ_VECTOR_IOAPIC + gsi);
+    return 0;
+}
+
+int ioapic_route_isa_irq(unsigned int irq, irq_handler_t handler)
+{
+    if (irq >= ACPI_ISA_IRQS) {
+        return -1;
+    }
+
+    /* ISA interrupts are active high and edge triggered unless an override says otherwise */
+    const unsigned int gsi = madt.isa_irqs[irq].gsi;
+    const uint16_t mps_flags = madt.isa_irqs[irq].flags;
+    uint32_t flags = 0;
+    if ((mps_flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW) {
+        flags |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((mps_flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL) {
+        flags |= IOAPIC_LEVEL_TRIGGERED;
+    }
+    return ioapic_route_gsi(gsi, flags, handler) ? -1 : (int)gsi;
+}
+
+int ioapic_set_affinity(unsigned int gsi, int cpu)
+{
+    if (gsi >= IOAPIC_MAX_GSIS || lapic_apic_id(cpu) < 0) {
+        return -1;
+    }
+
+    struct ioapic_gsi *state = &gsis[gsi];
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&ioapic_lock);
+    state->cpu = cpu;
+    state->pinned = true;
+    if (state->routed) {
+        ioapic_program(gsi);
+    }
+    spin_unlock(&ioapic_lock);
+    arch_irq_restore(flags);
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include <kernel/arch/x86_64/cmos.h>
+#include <kernel/arch/x86_64/irq.h>
+#include <kernel/arch/x86_64/lapic.h>
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <kernel/mmu.h>
+#include <cpu.h>
+#include <klog.h>
+#include <cpuid.h>
+#include <stdbool.h>
+#include <x86intrin.h>
+
+static const char *TAG = "lapic";
+
+#define LAPIC_CALIBRATION_NS 10000000 /* 10 ms */
+#define LAPIC_TIMER_MIN_DELTA 0xF
+
+static volatile uint8_t *lapic_base; /* xAPIC mode only */
+static bool lapic_x2apic;
+static uint64_t lapic_timer_hz; /* one-shot count rate after the divider, 0 until measured */
+
+/* APIC ID of every CPU whose local APIC is up, for interrupt destinations */
+static uint32_t lapic_ids[MAX_CPUS];
+static uint32_t lapic_online; /* bit per CPU */
+
+static struct clock_event_device lapic_timers[MAX_CPUS];
+
+/* in x2APIC mode register n * 0x10 is MSR 0x800 + n */
+static inline uint32_t lapic_read(unsigned int reg)
+{
+    if (lapic_x2apic) {
+        return arch_rdmsr(IA32_X2APIC_MSR_BASE + (reg >> 4));
+    }
+    return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+static inline void lapic_write(unsigned int reg, uint32_t value)
+{
+    if (lapic_x2apic) {
+        arch_wrmsr(IA32_X2APIC_MSR_BASE + (reg >> 4), value);
+        return;
+    }
+    *(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+int lapic_initialize(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 9))) {
+        KLOGW(TAG, "no local APIC");
+        return -1;
+    }
+    const bool has_x2apic = ecx & (1 << 21);
+
+    /* x2APIC can only be entered from xAPIC mode, not straight from disabled */
+    uint64_t apic_base = arch_rdmsr(IA32_APIC_BASE);
+    if (!(apic_base & IA32_APIC_BASE_ENABLE)) {
+        apic_base |= IA32_APIC_BASE_ENABLE;
+        arch_wrmsr(IA32_APIC_BASE, apic_base);
+    }
+    if (has_x2apic && !(apic_base & IA32_APIC_BASE_X2APIC)) {
+        apic_base |= IA32_APIC_BASE_X2APIC;
+        arch_wrmsr(IA32_APIC_BASE, apic_base);
+    }
+    lapic_x2apic = apic_base & IA32_APIC_BASE_X2APIC;
+
+    if (!lapic_x2apic && !lapic_base) {
+        lapic_base = mmu_map_mmio(apic_base & IA32_APIC_BASE_ADDRESS_MASK, 0x1000, MMU_CACHE_UC);
+        if (!lapic_base) {
+            return -1;
+        }
+    }
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | IRQ_VECTOR_SPURIOUS);
+
+    const int cpu = arch_cpu_id();
+    lapic_ids[cpu] = lapic_x2apic ? lapic_read(LAPIC_ID) : lapic_read(LAPIC_ID) >> 24;
+    __atomic_fetch_or(&lapic_online, 1U << cpu, __ATOMIC_RELEASE);
+
+    if (lapic_x2apic) {
+        KLOGI(TAG, "cpu %d: id %u, version %#x, x2APIC mode", cpu, lapic_ids[cpu], lapic_read(LAPIC_VERSION) & 0xFF);
+    } else {
+        KLOGI(TAG, "cpu %d: id %u, version %#x at %#lx", cpu, lapic_ids[cpu], lapic_read(LAPIC_VERSION) & 0xFF,
+              apic_base & IA32_APIC_BASE_ADDRESS_MASK);
+    }
+    return 0;
+}
+
+int lapic_apic_id(int cpu)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS || !(__atomic_load_n(&lapic_online, __ATOMIC_ACQUIRE) & (1U << cpu))) {
+        return -1;
+    }
+    return lapic_ids[cpu];
+}
+
+void lapic_eoi(void)
+{
+    if (lapic_x2apic) {
+        arch_wrmsr(IA32_X2APIC_MSR_BASE + (LAPIC_EOI >> 4), 0);
+    } else if (lapic_base) {
+        lapic_write(LAPIC_EOI, 0);
+    }
+}
+
+static int lapic_deadline_set_next_event(struct clock_event_device *evt, uint64_t ticks)
+{
+    (void)evt;
+    /* a deadline that has already passed fires right away, so this cannot be too late */
+    arch_wrmsr(IA32_TSC_DEADLINE, __rdtsc() + ticks);
+    return 0;
+}
+
+static void lapic_deadline_shutdown(struct clock_event_device *evt)
+{
+    (void)evt;
+    arch_wrmsr(IA32_TSC_DEADLINE, 0);
+}
+
+static int lapic_oneshot_set_next_event(struct clock_event_device *evt, uint64_t ticks)
+{
+    (void)evt;
+    lapic_write(LAPIC_TIMER_INITIAL_COUNT, ticks);
+    return 0;
+}
+
+static void lapic_oneshot_shutdown(struct clock_event_device *evt)
+{
+    (void)evt;
+    lapic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
+}
+
+static void lapic_timer_interrupt(unsigned int vector, struct regs *regs)
+{
+    (void)vector;
+    (void)regs;
+    struct clock_event_device *evt = &lapic_timers[arch_cpu_id()];
+    if (evt->event_handler) {
+        evt->event_handler(evt);
+    }
+}
+
+/*
+ * TSC-deadline mode counts in TSC cycles, so it is only used when the TSC
+ * itself is trusted as the best clock source, i.e. it runs at a constant rate.
+ */
+static bool lapic_has_tsc_deadline(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    const struct clocksource *cs = clocksource_current();
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 24)) && cs &&
+           cs->rating >= CLOCKSOURCE_RATING_TSC;
+}
+
+/* count rate after the divide-by-16, measured against the monotonic clock */
+static uint64_t lapic_timer_calibrate(void)
+{
+    if (!clocksource_current()) {
+        return 0;
+    }
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_LVT_TIMER_ONESHOT | IRQ_VECTOR_LAPIC_TIMER);
+    lapic_write(LAPIC_TIMER_INITIAL_COUNT, 0xFFFFFFFF);
+
+    const uint64_t start_ns = clock_monotonic_ns();
+    const uint32_t start_count = lapic_read(LAPIC_TIMER_CURRENT_COUNT);
+    uint64_t end_ns;
+    do {
+        end_ns = clock_monotonic_ns();
+    } while (end_ns - start_ns < LAPIC_CALIBRATION_NS);
+    const uint32_t end_count = lapic_read(LAPIC_TIMER_CURRENT_COUNT);
+    lapic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
+
+    const uint64_t hz = (uint64_t)(start_count - end_count) * NSEC_PER_SEC / (end_ns - start_ns);
+    KLOGI(TAG, "timer: %lu.%06lu MHz after divide by 16, against %s", hz / 1000000, hz % 1000000,
+          clocksource_current()->name);
+    return hz;
+}
+
+int lapic_timer_initialize(void)
+{
+    if (!lapic_x2apic && !lapic_base) {
+        return -1;
+    }
+
+    const int cpu = arch_cpu_id();
+    struct clock_event_device *evt = &lapic_timers[cpu];
+
+    if (lapic_has_tsc_deadline()) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_TIMER_TSC_DEADLINE | IRQ_VECTOR_LAPIC_TIMER);
+        /* the LVT write has to land before the first write to the deadline MSR */
+        asm volatile("mfence" : : : "memory");
+        *evt = (struct clock_event_device){
+            .name = "lapic-deadline",
+            .rating = CLOCKEVENT_RATING_TSC_DEADLINE,
+            .frequency = arch_tsc_frequency(),
+            .max_delta_ticks = INT64_MAX,
+            .set_next_event = lapic_deadline_set_next_event,
+            .shutdown = lapic_deadline_shutdown,
+        };
+    } else {
+        if (!lapic_timer_hz) {
+            lapic_timer_hz = lapic_timer_calibrate();
+        }
+        if (!lapic_timer_hz) {
+            KLOGW(TAG, "timer is not counting");
+            return -1;
+        }
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_TIMER_ONESHOT | IRQ_VECTOR_LAPIC_TIMER);
+        *evt = (struct clock_event_device){
+            .name = "lapic",
+            .rating = CLOCKEVENT_RATING_LAPIC,
+            .frequency = lapic_timer_hz,
+            .max_delta_ticks = 0x7FFFFFFF,
+            .set_next_event = lapic_oneshot_set_next_event,
+            .shutdown = lapic_oneshot_shutdown,
+        };
+    }
+    evt->features = CLOCKEVENT_FEATURE_ONESHOT | CLOCKEVENT_FEATURE_PERCPU;
+    evt->cpu = cpu;
+    evt->min_delta_ticks = LAPIC_TIMER_MIN_DELTA;
+    irq_install_handler(IRQ_VECTOR_LAPIC_TIMER, lapic_timer_interrupt);
+    clockevent_register(evt);
+    return 0;
+}
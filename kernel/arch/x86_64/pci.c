@@ -0,0 +1,66 @@
+#include <kernel/pci.h>
+#include <kernel/arch/x86_64/ports.h>
+
+enum
+{
+    PCI_ADDRESS_PORT = 0xCF8,
+    PCI_VALUE_PORT = 0xCFC,
+};
+
+static inline uint32_t pci_get_addr(uint32_t device, int field)
+{
+    return 0x80000000 | (pci_extract_bus(device) << 16) | (pci_extract_slot(device) << 11) |
+           (pci_extract_func(device) << 8) | (field & 0xFC);
+}
+
+uint32_t pci_read_field(uint32_t device, int field, int size)
+{
+    outportl(PCI_ADDRESS_PORT, pci_get_addr(device, field));
+
+    if (size == 4) {
+        return inportl(PCI_VALUE_PORT);
+    } else if (size == 2) {
+        return inports(PCI_VALUE_PORT + (field & 2));
+    } else if (size == 1) {
+        return inportb(PCI_VALUE_PORT + (field & 3));
+    }
+    return 0xFFFF;
+}
+
+void pci_write_field(uint32_t device, int field, int size, uint32_t value)
+{
+    outportl(PCI_ADDRESS_PORT, pci_get_addr(device, field));
+
+    if (size == 4) {
+        outportl(PCI_VALUE_PORT, value);
+    } else if (size == 2) {
+        outports(PCI_VALUE_PORT + (field & 2), value);
+    } else if (size == 1) {
+        outportb(PCI_VALUE_PORT + (field & 3), value);
+    }
+}
+
+void pci_scan(pci_func_t f, void *extra)
+{
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            const uint32_t dev = pci_box_device(bus, slot, 0);
+            const uint16_t vendor = pci_read_field(dev, PCI_VENDOR_ID, 2);
+            if (vendor == PCI_NONE) {
+                continue;
+            }
+            f(dev, vendor, pci_read_field(dev, PCI_DEVICE_ID, 2), extra);
+
+            if (!(pci_read_field(dev, PCI_HEADER_TYPE, 1) & 0x80)) {
+                continue; /* single function */
+            }
+            for (int func = 1; func < 8; func++) {
+                const uint32_t fdev = pci_box_device(bus, slot, func);
+                const uint16_t fvendor = pci_read_field(fdev, PCI_VENDOR_ID, 2);
+                if (fvendor != PCI_NONE) {
+                    f(fdev, fvendor, pci_read_field(fdev, PCI_DEVICE_ID, 2), extra);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,175 @@
+#include <kernel/arch/x86_64/serial.h>
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/string.h>
+
+enum
+{
+    UART_THR = 0, // transmit holding register (write, DLAB=0)
+    UART_RBR = 0, // receive buffer register (read, DLAB=0)
+    UART_DLL = 0, // divisor latch low (DLAB=1)
+    UART_IER = 1, // interrupt enable register (DLAB=0)
+    UART_DLM = 1, // divisor latch high (DLAB=1)
+    UART_IIR = 2, // interrupt identification register (read)
+    UART_FCR = 2, // FIFO control register (write)
+    UART_LCR = 3, // line control register
+    UART_MCR = 4, // modem control register
+    UART_LSR = 5, // line status register
+    UART_MSR = 6, // modem status register
+    UART_SCR = 7, // scratch register
+};
+
+enum
+{
+    UART_IER_THRI = (1 << 1),       // interrupt when the transmit holding register is empty
+    UART_FCR_ENABLE = (1 << 0),
+    UART_FCR_CLEAR_RX = (1 << 1),
+    UART_FCR_CLEAR_TX = (1 << 2),
+    UART_FCR_TRIGGER_14 = (3 << 6),
+    UART_IIR_NO_INT = (1 << 0),
+    UART_IIR_ID_MASK = 0x0E,
+    UART_IIR_THRI = 0x02,
+    UART_IIR_FIFO_MASK = 0xC0,      // both set when the 16550 FIFO is enabled and working
+    UART_LCR_8N1 = 0x03,
+    UART_LCR_DLAB = (1 << 7),
+    UART_MCR_DTR = (1 << 0),
+    UART_MCR_RTS = (1 << 1),
+    UART_MCR_OUT2 = (1 << 3),       // gates the UART interrupt onto the IRQ line
+    UART_MCR_LOOP = (1 << 4),
+    UART_LSR_THRE = (1 << 5),       // transmit holding register (and FIFO) empty
+};
+
+#define UART_CLOCK     115200
+#define UART_FIFO_SIZE 16
+
+static unsigned short serial_port;
+static unsigned int serial_fifo_size = 1;
+
+/*
+ * Single producer (serial_write), single consumer (whoever holds tx_busy).
+ * Positions only grow; the index is the position modulo the ring size.
+ */
+static char tx_ring[SERIAL_TX_RING_SIZE];
+static uint32_t tx_head;
+static uint32_t tx_tail;
+static int tx_busy;
+static uint64_t tx_dropped;
+
+int serial_initialize(unsigned short port, uint32_t baud)
+{
+    if (!baud || UART_CLOCK % baud) {
+        return -1;
+    }
+    const uint16_t divisor = UART_CLOCK / baud;
+
+    outportb(port + UART_IER, 0);
+    outportb(port + UART_LCR, UART_LCR_DLAB);
+    outportb(port + UART_DLL, divisor & 0xFF);
+    outportb(port + UART_DLM, divisor >> 8);
+    outportb(port + UART_LCR, UART_LCR_8N1);
+    outportb(port + UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR_RX | UART_FCR_CLEAR_TX | UART_FCR_TRIGGER_14);
+
+    /* loopback self test: nothing answering means there is no UART here */
+    outportb(port + UART_MCR, UART_MCR_LOOP | UART_MCR_RTS | UART_MCR_DTR);
+    outportb(port + UART_THR, 0xAE);
+    if (inportb(port + UART_RBR) != 0xAE) {
+        return -1;
+    }
+
+    serial_fifo_size = (inportb(port + UART_IIR) & UART_IIR_FIFO_MASK) == UART_IIR_FIFO_MASK ? UART_FIFO_SIZE : 1;
+    outportb(port + UART_MCR, UART_MCR_OUT2 | UART_MCR_RTS | UART_MCR_DTR);
+    outportb(port + UART_IER, UART_IER_THRI);
+    serial_port = port;
+    return 0;
+}
+
+/*
+ * Move up to one FIFO's worth of bytes from the ring to the UART, if the FIFO
+ * is empty. The next THR-empty interrupt continues from there. Never waits
+ * on LSR.
+ *
+ * A THR-empty interrupt that comes while someone else holds tx_busy finds
+ * nothing to do and is gone, having been acknowledged by the IIR read. So
+ * whoever releases tx_busy looks at LSR again and goes on if the FIFO
+ * emptied meanwhile, the way klog_sink_drain() does.
+ */
+static void serial_tx_kick(void)
+{
+    do {
+        if (__atomic_exchange_n(&tx_busy, 1, __ATOMIC_ACQUIRE)) {
+            return; /* the other side is filling the FIFO */
+        }
+
+        uint32_t tail = tx_tail;
+        const uint32_t head = __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE);
+        if (tail != head && (inportb(serial_port + UART_LSR) & UART_LSR_THRE)) {
+            for (unsigned int n = 0; n < serial_fifo_size && tail != head; n++, tail++) {
+                outportb(serial_port + UART_THR, tx_ring[tail & (SERIAL_TX_RING_SIZE - 1)]);
+            }
+            __atomic_store_n(&tx_tail, tail, __ATOMIC_RELEASE);
+        }
+
+        __atomic_store_n(&tx_busy, 0, __ATOMIC_RELEASE);
+    } while (tx_tail != __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE) &&
+             (inportb(serial_port + UART_LSR) & UART_LSR_THRE));
+}
+
+void serial_write(const char *buf, size_t len)
+{
+    if (!serial_port) {
+        return;
+    }
+
+    const uint32_t head = tx_head;
+    const uint32_t space = SERIAL_TX_RING_SIZE - (head - __atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE));
+    if (len > space) {
+        __atomic_fetch_add(&tx_dropped, len - space, __ATOMIC_RELAXED);
+        len = space;
+    }
+
+    const uint32_t offset = head & (SERIAL_TX_RING_SIZE - 1);
+    const size_t first = len < SERIAL_TX_RING_SIZE - offset ? len : SERIAL_TX_RING_SIZE - offset;
+    memcpy(tx_ring + offset, buf, first);
+    memcpy(tx_ring, buf + first, len - first);
+    __atomic_store_n(&tx_head, head + (uint32_t)len, __ATOMIC_RELEASE);
+
+    serial_tx_kick();
+}
+
+void serial_irq_handler(unsigned int vector, struct regs *regs)
+{
+    (void)vector;
+    (void)regs;
+    if (!serial_port) {
+        return;
+    }
+
+    /* bounded, so a UART stuck asserting something cannot wedge the CPU */
+    for (int n = 0; n < 16; n++) {
+        const uint8_t iir = inportb(serial_port + UART_IIR);
+        if (iir & UART_IIR_NO_INT) {
+            break;
+        }
+        if ((iir & UART_IIR_ID_MASK) == UART_IIR_THRI) {
+            serial_tx_kick();
+        } else {
+            /* receive, line and modem status are not used; reading the registers acknowledges them */
+            inportb(serial_port + UART_LSR);
+            inportb(serial_port + UART_RBR);
+            inportb(serial_port + UART_MSR);
+        }
+    }
+}
+
+bool serial_flush(void)
+{
+    if (!serial_port) {
+        return false;
+    }
+    serial_tx_kick();
+    return tx_tail != __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE);
+}
+
+uint64_t serial_tx_dropped(void)
+{
+    return __atomic_load_n(&tx_dropped, __ATOMIC_RELAXED);
+}
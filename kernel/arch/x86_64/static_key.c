@@ -0,0 +1,75 @@
+#include <kernel/static_key.h>
+#include <kernel/spinlock.h>
+#include <kernel/string.h>
+#include <cpu.h>
+
+static const uint8_t nop5[5] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+/* make this CPU refetch the instructions we just rewrote */
+static inline void sync_core(void)
+{
+    unsigned int eax = 0, ebx, ecx = 0, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx) : : "memory");
+}
+
+/* serializes the patching, whoever the key belongs to */
+static spin_lock_t static_key_lock = SPIN_LOCK_INIT;
+static bool static_key_frozen;
+
+/*
+ * The sites are rewritten with plain stores, which only the patching CPU is
+ * guaranteed to see whole and in order. Another CPU fetching a site halfway
+ * through could run a torn instruction, so no patching once it may run.
+ */
+static bool static_key_update(static_key_t *key, int enabled)
+{
+    bool done = true;
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&static_key_lock);
+
+    if (key->enabled == enabled) {
+        /* nothing to rewrite */
+    } else if (static_key_frozen) {
+        done = false;
+    } else {
+        for (struct jump_entry *entry = __start___jump_table; entry < __stop___jump_table; entry++) {
+            if (entry->key != key) {
+                continue;
+            }
+            uint8_t insn[5];
+            if (enabled) {
+                const int32_t rel = (int32_t)(entry->target - (entry->code + sizeof(insn)));
+                insn[0] = 0xe9;
+                memcpy(&insn[1], &rel, sizeof(rel));
+            } else {
+                memcpy(insn, nop5, sizeof(insn));
+            }
+            memcpy((void *)(uintptr_t)entry->code, insn, sizeof(insn));
+        }
+        __atomic_store_n(&key->enabled, enabled, __ATOMIC_RELEASE);
+        sync_core();
+    }
+
+    spin_unlock(&static_key_lock);
+    arch_irq_restore(flags);
+    return done;
+}
+
+bool static_key_enable(static_key_t *key)
+{
+    return static_key_update(key, 1);
+}
+
+bool static_key_disable(static_key_t *key)
+{
+    return static_key_update(key, 0);
+}
+
+void static_key_freeze(void)
+{
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&static_key_lock);
+    static_key_frozen = true;
+    spin_unlock(&static_key_lock);
+    arch_irq_restore(flags);
+}
@@ -0,0 +1,180 @@
+#include <kernel/arch/x86_64/cmos.h>
+#include <kernel/arch/x86_64/tsc_sync.h>
+#include <kernel/clocksource.h>
+#include <cpu.h>
+#include <klog.h>
+#include <cpuid.h>
+#include <stdbool.h>
+
+static const char *TAG = "tsc_sync";
+
+#define TSC_SYNC_ROUNDS 64
+
+/* the line the two CPUs bounce between them */
+static struct {
+    volatile uint64_t seq;        /* odd: the source pinged, even: the target answered */
+    volatile uint64_t target_tsc; /* the target's TSC when it saw the ping */
+} tsc_sync_line __attribute__((aligned(64)));
+
+/* handshake around the measurements, on a line of its own so that it does not disturb them */
+static struct {
+    volatile int64_t correction; /* cycles the target has to take off its TSC */
+    volatile int phase;
+} tsc_sync_control __attribute__((aligned(64)));
+
+enum TSC_SYNC_PHASES {
+    TSC_SYNC_IDLE,
+    TSC_SYNC_TARGET_READY, /* the target answers the first round */
+    TSC_SYNC_CORRECT,      /* the source has set the correction */
+    TSC_SYNC_CORRECTED,    /* the target answers the second round */
+};
+
+/* rdtsc is not ordered against loads and stores by itself */
+static inline uint64_t tsc_sync_read(void)
+{
+    asm volatile("lfence" : : : "memory");
+    const uint64_t tsc = arch_tsc_read();
+    asm volatile("lfence" : : : "memory");
+    return tsc;
+}
+
+static bool tsc_has_adjust(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 1));
+}
+
+static bool tsc_sync_wait_phase(int phase, uint64_t timeout)
+{
+    const uint64_t start = tsc_sync_read();
+    while (__atomic_load_n(&tsc_sync_control.phase, __ATOMIC_ACQUIRE) != phase) {
+        if (tsc_sync_read() - start > timeout) {
+            return false;
+        }
+        __builtin_ia32_pause();
+    }
+    return true;
+}
+
+/**
+ * @brief Measure the target's TSC against ours
+ * @param skew  set to target minus source, from the tightest round trip
+ * @param error set to half of that round trip, the uncertainty of @p skew
+ */
+static bool tsc_sync_ping(int64_t *skew, uint64_t *error, uint64_t timeout)
+{
+    uint64_t best_rtt = UINT64_MAX;
+
+    for (int i = 0; i < TSC_SYNC_ROUNDS; i++) {
+        const uint64_t seq = tsc_sync_line.seq + 1;
+        const uint64_t t0 = tsc_sync_read();
+        __atomic_store_n(&tsc_sync_line.seq, seq, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&tsc_sync_line.seq, __ATOMIC_ACQUIRE) == seq) {
+            if (tsc_sync_read() - t0 > timeout) {
+                return false;
+            }
+            __builtin_ia32_pause();
+        }
+        const uint64_t t2 = tsc_sync_read();
+        const uint64_t t1 = tsc_sync_line.target_tsc;
+
+        if (t2 - t0 < best_rtt) {
+            best_rtt = t2 - t0;
+            *skew = (int64_t)(t1 - (t0 + best_rtt / 2));
+        }
+    }
+    *error = best_rtt / 2;
+    return true;
+}
+
+/* false if the source gave up, or stopped pinging for @p timeout cycles */
+static bool tsc_sync_pong(uint64_t timeout)
+{
+    for (int i = 0; i < TSC_SYNC_ROUNDS; i++) {
+        const uint64_t start = tsc_sync_read();
+        uint64_t seq;
+        while (!((seq = __atomic_load_n(&tsc_sync_line.seq, __ATOMIC_ACQUIRE)) & 1)) {
+            if (__atomic_load_n(&tsc_sync_control.phase, __ATOMIC_ACQUIRE) == TSC_SYNC_IDLE ||
+                tsc_sync_read() - start > timeout) {
+                return false;
+            }
+            __builtin_ia32_pause();
+        }
+        tsc_sync_line.target_tsc = tsc_sync_read();
+        __atomic_store_n(&tsc_sync_line.seq, seq + 1, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+void tsc_sync_initialize(void)
+{
+    if (!tsc_has_adjust()) {
+        return;
+    }
+
+    const int64_t adjust = arch_rdmsr(IA32_TSC_ADJUST);
+    if (adjust) {
+        KLOGW(TAG, "cpu %d: IA32_TSC_ADJUST was %ld, reset to 0", arch_cpu_id(), adjust);
+        arch_wrmsr(IA32_TSC_ADJUST, 0);
+    }
+}
+
+int64_t tsc_sync_source(int cpu)
+{
+    const uint64_t timeout = arch_tsc_frequency(); /* a second */
+    int64_t skew = 0, residual = 0;
+    uint64_t error = 0, residual_error = 0;
+
+    if (!tsc_sync_wait_phase(TSC_SYNC_TARGET_READY, timeout) || !tsc_sync_ping(&skew, &error, timeout)) {
+        KLOGW(TAG, "cpu %d did not answer", cpu);
+        __atomic_store_n(&tsc_sync_control.phase, TSC_SYNC_IDLE, __ATOMIC_RELEASE);
+        return INT64_MAX;
+    }
+
+    tsc_sync_control.correction = skew;
+    __atomic_store_n(&tsc_sync_control.phase, TSC_SYNC_CORRECT, __ATOMIC_RELEASE);
+    if (!tsc_sync_wait_phase(TSC_SYNC_CORRECTED, timeout) || !tsc_sync_ping(&residual, &residual_error, timeout)) {
+        KLOGW(TAG, "cpu %d did not answer", cpu);
+        __atomic_store_n(&tsc_sync_control.phase, TSC_SYNC_IDLE, __ATOMIC_RELEASE);
+        return INT64_MAX;
+    }
+    __atomic_store_n(&tsc_sync_control.phase, TSC_SYNC_IDLE, __ATOMIC_RELEASE);
+
+    const uint64_t bound = arch_tsc_frequency() * TSC_SYNC_MAX_SKEW_NS / NSEC_PER_SEC;
+    const uint64_t magnitude = residual < 0 ? -(uint64_t)residual : (uint64_t)residual;
+    KLOGI(TAG, "cpu %d: skew %ld +-%lu cycles, %ld +-%lu after correction", cpu, skew, error, residual,
+          residual_error);
+    /* only if it is over the bound even at the favourable end of the uncertainty */
+    if (magnitude > residual_error && magnitude - residual_error > bound) {
+        arch_tsc_mark_unstable("TSCs of different CPUs cannot be synchronized");
+    }
+    return residual;
+}
+
+void tsc_sync_target(void)
+{
+    const uint64_t timeout = arch_tsc_frequency(); /* a second */
+
+    __atomic_store_n(&tsc_sync_control.phase, TSC_SYNC_TARGET_READY, __ATOMIC_RELEASE);
+    if (!tsc_sync_pong(timeout)) {
+        return;
+    }
+
+    const uint64_t start = tsc_sync_read();
+    while (__atomic_load_n(&tsc_sync_control.phase, __ATOMIC_ACQUIRE) != TSC_SYNC_CORRECT) {
+        if (tsc_sync_control.phase == TSC_SYNC_IDLE || tsc_sync_read() - start > timeout) {
+            return; /* the source gave up */
+        }
+        __builtin_ia32_pause();
+    }
+
+    const int64_t correction = tsc_sync_control.correction;
+    if (tsc_has_adjust()) {
+        arch_wrmsr(IA32_TSC_ADJUST, arch_rdmsr(IA32_TSC_ADJUST) - correction);
+    } else {
+        arch_this_cpu()->tsc_offset -= correction;
+    }
+
+    __atomic_store_n(&tsc_sync_control.phase, TSC_SYNC_CORRECTED, __ATOMIC_RELEASE);
+    tsc_sync_pong(timeout);
+}
@@ -0,0 +1,231 @@
+#include <kernel/arch/x86_64/virtio_console.h>
+#include <kernel/arch/x86_64/ports.h>
+#include <kernel/pci.h>
+#include <kernel/string.h>
+#include <stdbool.h>
+
+enum
+{
+    VIRTIO_VENDOR_ID = 0x1AF4,
+    VIRTIO_CONSOLE_DEVICE_ID = 0x1003, // transitional (legacy) virtio-console
+};
+
+/* legacy virtio header in BAR0 I/O space */
+enum
+{
+    VIRTIO_PCI_HOST_FEATURES = 0x00, // 4
+    VIRTIO_PCI_GUEST_FEATURES = 0x04, // 4
+    VIRTIO_PCI_QUEUE_PFN = 0x08,     // 4
+    VIRTIO_PCI_QUEUE_SIZE = 0x0C,    // 2
+    VIRTIO_PCI_QUEUE_SELECT = 0x0E,  // 2
+    VIRTIO_PCI_QUEUE_NOTIFY = 0x10,  // 2
+    VIRTIO_PCI_STATUS = 0x12,        // 1
+    VIRTIO_PCI_ISR = 0x13,           // 1
+};
+
+enum
+{
+    VIRTIO_STATUS_ACKNOWLEDGE = 1,
+    VIRTIO_STATUS_DRIVER = 2,
+    VIRTIO_STATUS_DRIVER_OK = 4,
+    VIRTIO_STATUS_FAILED = 128,
+};
+
+enum
+{
+    VIRTIO_CONSOLE_RECEIVEQ0 = 0,
+    VIRTIO_CONSOLE_TRANSMITQ0 = 1,
+};
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
+#define VRING_ALIGN                4096
+#define VRING_MAX_SIZE             256
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+#define VRING_ROUND(x)       (((x) + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1))
+#define VRING_USED_OFFSET(num) VRING_ROUND((num) * sizeof(struct vring_desc) + (3 + (num)) * sizeof(uint16_t))
+#define VRING_SIZE(num)      (VRING_USED_OFFSET(num) + VRING_ROUND(3 * sizeof(uint16_t) + (num) * sizeof(struct vring_used_elem)))
+
+/* the kernel is identity mapped, so these addresses are also what the device sees */
+static uint8_t tx_vring[VRING_SIZE(VRING_MAX_SIZE)] __attribute__((aligned(VRING_ALIGN)));
+static char tx_buffers[VIRTIO_CONSOLE_TX_BUFFERS][VIRTIO_CONSOLE_TX_BUFFER_SIZE] __attribute__((aligned(4096)));
+
+static unsigned short io_base;
+static uint16_t queue_size;
+static struct vring_desc *tx_desc;
+static struct vring_avail *tx_avail;
+static struct vring_used *tx_used;
+static uint16_t avail_idx;
+static uint16_t used_seen;
+
+static unsigned int buffer_count;
+static bool buffer_in_flight[VIRTIO_CONSOLE_TX_BUFFERS];
+static unsigned int in_flight;
+static int current = -1;        /* buffer being filled, or -1 */
+static size_t current_len;
+static uint64_t dropped;
+
+static void virtio_console_find(uint32_t device, uint16_t vendor_id, uint16_t device_id, void *extra)
+{
+    uint32_t *found = extra;
+    if (*found == (uint32_t)-1 && vendor_id == VIRTIO_VENDOR_ID && device_id == VIRTIO_CONSOLE_DEVICE_ID) {
+        *found = device;
+    }
+}
+
+int virtio_console_initialize(void)
+{
+    uint32_t device = (uint32_t)-1;
+    pci_scan(virtio_console_find, &device);
+    if (device == (uint32_t)-1) {
+        return -1;
+    }
+
+    const uint32_t bar0 = pci_read_field(device, PCI_BAR0, 4);
+    if (!(bar0 & PCI_BAR_IO)) {
+        return -1;
+    }
+    io_base = bar0 & 0xFFFC;
+    pci_write_field(device, PCI_COMMAND, 2,
+                    pci_read_field(device, PCI_COMMAND, 2) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    outportb(io_base + VIRTIO_PCI_STATUS, 0); /* reset */
+    outportb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outportb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    outportl(io_base + VIRTIO_PCI_GUEST_FEATURES, 0); /* port 0 only, no event index */
+
+    outports(io_base + VIRTIO_PCI_QUEUE_SELECT, VIRTIO_CONSOLE_TRANSMITQ0);
+    queue_size = inports(io_base + VIRTIO_PCI_QUEUE_SIZE);
+    if (!queue_size || queue_size > VRING_MAX_SIZE) {
+        outportb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        io_base = 0;
+        return -1;
+    }
+
+    memset(tx_vring, 0, sizeof(tx_vring));
+    tx_desc = (struct vring_desc *)tx_vring;
+    tx_avail = (struct vring_avail *)(tx_vring + queue_size * sizeof(struct vring_desc));
+    tx_used = (struct vring_used *)(tx_vring + VRING_USED_OFFSET(queue_size));
+    tx_avail->flags = VRING_AVAIL_F_NO_INTERRUPT; /* completions are reaped on the next write */
+    buffer_count = queue_size < VIRTIO_CONSOLE_TX_BUFFERS ? queue_size : VIRTIO_CONSOLE_TX_BUFFERS;
+    outportl(io_base + VIRTIO_PCI_QUEUE_PFN, (uint32_t)((uintptr_t)tx_vring / VRING_ALIGN));
+
+    outportb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+/* take back the buffers the device has finished with */
+static void virtio_console_reclaim(void)
+{
+    const uint16_t used_idx = __atomic_load_n(&tx_used->idx, __ATOMIC_ACQUIRE);
+
+    while (used_seen != used_idx) {
+        const uint32_t id = tx_used->ring[used_seen % queue_size].id;
+        if (id < buffer_count && buffer_in_flight[id]) {
+            buffer_in_flight[id] = false;
+            in_flight--;
+        }
+        used_seen++;
+    }
+}
+
+static void virtio_console_submit(void)
+{
+    const int i = current;
+
+    /* descriptor i always describes buffer i */
+    tx_desc[i].addr = (uint64_t)(uintptr_t)tx_buffers[i];
+    tx_desc[i].len = (uint32_t)current_len;
+    tx_desc[i].flags = 0;
+    tx_desc[i].next = 0;
+    tx_avail->ring[avail_idx % queue_size] = (uint16_t)i;
+    buffer_in_flight[i] = true;
+    in_flight++;
+    current = -1;
+    current_len = 0;
+
+    __atomic_store_n(&tx_avail->idx, ++avail_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); /* publish idx before looking at the device's flags */
+    if (!(__atomic_load_n(&tx_used->flags, __ATOMIC_RELAXED) & VRING_USED_F_NO_NOTIFY)) {
+        outports(io_base + VIRTIO_PCI_QUEUE_NOTIFY, VIRTIO_CONSOLE_TRANSMITQ0);
+    }
+}
+
+void virtio_console_write(const char *buf, size_t len)
+{
+    if (!io_base) {
+        return;
+    }
+    virtio_console_reclaim();
+
+    while (len) {
+        if (current < 0) {
+            for (unsigned int i = 0; i < buffer_count; i++) {
+                if (!buffer_in_flight[i]) {
+                    current = i;
+                    break;
+                }
+            }
+            if (current < 0) {
+                dropped += len;
+                return;
+            }
+        }
+
+        size_t n = VIRTIO_CONSOLE_TX_BUFFER_SIZE - current_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(tx_buffers[current] + current_len, buf, n);
+        current_len += n;
+        buf += n;
+        len -= n;
+
+        if (current_len == VIRTIO_CONSOLE_TX_BUFFER_SIZE) {
+            virtio_console_submit();
+        }
+    }
+    /* a partial buffer waits for virtio_console_flush(), so one notify carries a whole drain pass */
+}
+
+bool virtio_console_flush(void)
+{
+    if (!io_base) {
+        return false;
+    }
+    virtio_console_reclaim();
+    if (current >= 0 && current_len) {
+        virtio_console_submit();
+    }
+    /* the device reads the buffers by itself, even after the CPU has stopped */
+    return false;
+}
+
+uint64_t virtio_console_dropped(void)
+{
+    return dropped;
+}
@@ -0,0 +1,151 @@
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <kernel/spinlock.h>
+#include <cpu.h>
+#include <klog.h>
+
+static const char *TAG = "clockevent";
+
+#define CLOCKEVENT_PROGRAM_RETRIES 3
+
+static spin_lock_t clockevent_lock = SPIN_LOCK_INIT;
+static struct clock_event_device *clockevent_list; /* sorted by rating, best first */
+
+void clockevent_register(struct clock_event_device *dev)
+{
+    clocksource_calc_mult_shift(&dev->mult, &dev->shift, NSEC_PER_SEC, dev->frequency);
+    dev->claimed = 0;
+    dev->event_handler = NULL;
+
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&clockevent_lock);
+    struct clock_event_device **link = &clockevent_list;
+    while (*link && (*link)->rating >= dev->rating) {
+        link = &(*link)->next;
+    }
+    dev->next = *link;
+    *link = dev;
+    spin_unlock(&clockevent_lock);
+    arch_irq_restore(flags);
+
+    KLOGI(TAG, "%s: %lu Hz, rating %d, cpu %d, %lu-%lu ticks", dev->name, dev->frequency, dev->rating,
+          dev->cpu, dev->min_delta_ticks, dev->max_delta_ticks);
+}
+
+struct clock_event_device *clockevent_claim(int cpu, unsigned int features,
+                                            void (*handler)(struct clock_event_device *dev))
+{
+    struct clock_event_device *dev;
+
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&clockevent_lock);
+    for (dev = clockevent_list; dev; dev = dev->next) {
+        if (!dev->claimed && (dev->cpu == cpu || dev->cpu < 0) && (dev->features & features) == features) {
+            dev->claimed = 1;
+            dev->event_handler = handler;
+            break;
+        }
+    }
+    spin_unlock(&clockevent_lock);
+    arch_irq_restore(flags);
+    return dev;
+}
+
+void clockevent_release(struct clock_event_device *dev)
+{
+    dev->shutdown(dev);
+
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&clockevent_lock);
+    dev->event_handler = NULL;
+    dev->claimed = 0;
+    spin_unlock(&clockevent_lock);
+    arch_irq_restore(flags);
+}
+
+int clockevent_program_ns(struct clock_event_device *dev, uint64_t delta_ns)
+{
+    const unsigned __int128 scaled = (unsigned __int128)delta_ns * dev->mult >> dev->shift;
+    uint64_t ticks = scaled > dev->max_delta_ticks ? dev->max_delta_ticks : (uint64_t)scaled;
+    if (ticks < dev->min_delta_ticks) {
+        ticks = dev->min_delta_ticks;
+    }
+
+    for (int i = 0; i < CLOCKEVENT_PROGRAM_RETRIES; i++) {
+        if (dev->set_next_event(dev, ticks) == 0) {
+            return 0;
+        }
+        /* too close to arm in time: the event is already due, so fire it as soon as possible */
+        ticks = dev->min_delta_ticks << (i + 1);
+        if (ticks > dev->max_delta_ticks) {
+            ticks = dev->max_delta_ticks;
+        }
+    }
+    KLOGW(TAG, "%s: could not arm", dev->name);
+    return -1;
+}
+
+static struct clockevent_cpu {
+    struct clock_event_device *dev;
+    void (*handler)(void);
+    uint64_t next_event_ns; /* UINT64_MAX when nothing is programmed */
+} __attribute__((aligned(64))) clockevent_cpus[MAX_CPUS];
+
+static void clockevent_cpu_event(struct clock_event_device *dev)
+{
+    struct clockevent_cpu *cpu = &clockevent_cpus[arch_cpu_id()];
+    (void)dev;
+
+    cpu->next_event_ns = UINT64_MAX;
+    if (cpu->handler) {
+        cpu->handler();
+    }
+}
+
+int clockevent_cpu_initialize(void (*handler)(void))
+{
+    const int id = arch_cpu_id();
+    struct clockevent_cpu *cpu = &clockevent_cpus[id];
+
+    cpu->handler = handler;
+    cpu->next_event_ns = UINT64_MAX;
+    cpu->dev = clockevent_claim(id, CLOCKEVENT_FEATURE_ONESHOT, clockevent_cpu_event);
+    if (!cpu->dev) {
+        KLOGW(TAG, "no event device for cpu %d", id);
+        return -1;
+    }
+    KLOGI(TAG, "cpu %d: %s", id, cpu->dev->name);
+    return 0;
+}
+
+void clockevent_cpu_set_next(uint64_t expires_ns)
+{
+    const unsigned long flags = arch_irq_save();
+    struct clockevent_cpu *cpu = &clockevent_cpus[arch_cpu_id()];
+
+    if (cpu->dev && expires_ns != cpu->next_event_ns) {
+        if (expires_ns == UINT64_MAX) {
+            cpu->dev->shutdown(cpu->dev);
+            cpu->next_event_ns = UINT64_MAX;
+        } else {
+            const uint64_t now = clock_monotonic_ns();
+            /* if the device could not be armed, nothing is pending and the next call tries again */
+            const int armed = clockevent_program_ns(cpu->dev, expires_ns > now ? expires_ns - now : 0) == 0;
+            cpu->next_event_ns = armed ? expires_ns : UINT64_MAX;
+        }
+    }
+    arch_irq_restore(flags);
+}
+
+uint64_t clockevent_cpu_next(void)
+{
+    return clockevent_cpus[arch_cpu_id()].next_event_ns;
+}
+
+uint64_t clockevent_cpu_next_of(int cpu)
+{
+    if (cpu < 0 || cpu >= MAX_CPUS) {
+        return UINT64_MAX;
+    }
+    return __atomic_load_n(&clockevent_cpus[cpu].next_event_ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,313 @@
+#include <kernel/clocksource.h>
+#include <kernel/seqlock.h>
+#include <kernel/timer.h>
+#include <cpu.h>
+#include <klog.h>
+
+/*
+ * The clock is kept as a base time plus the cycles counted since the base
+ * was taken. Readers take a snapshot of the base under the seqlock and
+ * retry if a writer changed it meanwhile; they never wait for a lock.
+ * Writers (registration, frequency and real-time adjustments, folding
+ * cycles into the base) take the seqlock with interrupts disabled, so a
+ * reader in an interrupt handler cannot spin on a write it interrupted.
+ *
+ * Cycles are converted with one 64x32 bit multiplication and a shift.
+ * The bits shifted out are carried in base_frac so that folding cycles
+ * into the base never rounds the clock backwards.
+ */
+
+static const char *TAG = "clocksource";
+
+/* how often the counter is folded into the base at most, for counters that take ages to wrap */
+#define CLOCK_UPDATE_MAX_PERIOD_NS (3600 * NSEC_PER_SEC)
+
+static struct clocksource *clocksource_list; /* sorted by rating, best first; written under tk.lock */
+
+/* everything a reader needs, on a cache line of its own */
+static struct {
+    seqlock_t lock;
+    struct clocksource *cs;
+    uint32_t mult;               /* cs->mult and cs->shift, as of the last switch */
+    uint32_t shift;
+    uint64_t cycle_last;         /* counter value at base_ns */
+    uint64_t base_ns;            /* monotonic time at cycle_last */
+    uint64_t base_frac;          /* fraction of a ns at cycle_last, in units of 2^-shift */
+    int64_t realtime_offset_ns;  /* real time minus monotonic time */
+} tk __attribute__((aligned(64))) = { .lock = SEQLOCK_INIT };
+
+/* (delta * mult + frac) in units of 2^-shift ns */
+static inline unsigned __int128 cycles_to_scaled_ns(uint64_t delta, uint32_t mult, uint64_t frac)
+{
+    return (unsigned __int128)delta * mult + frac;
+}
+
+void clocksource_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from_hz, uint64_t to_hz)
+{
+    uint32_t sft = 32;
+    uint64_t tmp;
+
+    /* keep to_hz << sft in 64 bits: a 128-bit division would need libgcc, which the kernel does not link */
+    while (sft && to_hz > (UINT64_MAX - from_hz / 2) >> sft) {
+        sft--;
+    }
+    for (;; sft--) {
+        tmp = ((to_hz << sft) + from_hz / 2) / from_hz;
+        if (tmp <= UINT32_MAX || sft == 0) {
+            break;
+        }
+    }
+    *mult = (uint32_t)tmp;
+    *shift = sft;
+}
+
+/* move the base up to @p now on the current clock source; called inside a write section */
+static void tk_accumulate(uint64_t now)
+{
+    const uint64_t delta = (now - tk.cycle_last) & tk.cs->mask;
+    const unsigned __int128 scaled = cycles_to_scaled_ns(delta, tk.mult, tk.base_frac);
+
+    tk.base_ns += (uint64_t)(scaled >> tk.shift);
+    tk.base_frac = (uint64_t)scaled & ((1ULL << tk.shift) - 1);
+    tk.cycle_last = now;
+}
+
+/* go on counting with @p cs at its current mult/shift; called inside a write section */
+static void tk_switch(struct clocksource *cs)
+{
+    /* one read if the source stays, else the new one right after the old, so that no cycles fall in between */
+    const uint64_t old_now = tk.cs ? tk.cs->read() : 0;
+    const uint64_t now = tk.cs == cs ? old_now : cs->read();
+
+    if (tk.cs) {
+        tk_accumulate(old_now);
+        /* the fraction is in units of the old shift; round up so time cannot step back */
+        if (tk.base_frac) {
+            tk.base_ns++;
+        }
+    }
+    tk.cs = cs;
+    tk.mult = cs->mult;
+    tk.shift = cs->shift;
+    tk.base_frac = 0;
+    tk.cycle_last = now;
+}
+
+static void clock_update_timer_fire(void *arg);
+
+static struct timer clock_update_timer = TIMER_INIT(clock_update_timer_fire, NULL, 0);
+static bool clock_update_started;
+
+/* next fold in half a wrap period of the current counter, well before tk_read() could miss a wrap */
+static void clock_update_arm(void)
+{
+    const struct clocksource *cs = clocksource_current();
+    uint64_t period = CLOCK_UPDATE_MAX_PERIOD_NS;
+    if (cs) {
+        const unsigned __int128 half_wrap_ns = cycles_to_scaled_ns(cs->mask >> 1, cs->mult, 0) >> cs->shift;
+        if (half_wrap_ns < period) {
+            period = (uint64_t)half_wrap_ns;
+        }
+    }
+    timer_add(&clock_update_timer, clock_monotonic_ns() + period);
+}
+
+static void clock_update_timer_fire(void *arg)
+{
+    (void)arg;
+    clock_update();
+    clock_update_arm();
+}
+
+void clock_update_start(void)
+{
+    __atomic_store_n(&clock_update_started, true, __ATOMIC_RELEASE);
+    clock_update_arm();
+}
+
+void clocksource_register(struct clocksource *cs)
+{
+    uint32_t mult, shift;
+    clocksource_calc_mult_shift(&mult, &shift, cs->frequency, NSEC_PER_SEC);
+
+    const unsigned long flags = arch_irq_save();
+    write_seqlock(&tk.lock);
+    cs->mult = mult; /* under the lock for clock_realtime_ns_at() */
+    cs->shift = shift;
+    struct clocksource **link = &clocksource_list;
+    while (*link && (*link)->rating >= cs->rating) {
+        link = &(*link)->next;
+    }
+    cs->next = *link;
+    *link = cs;
+
+    const int switched = clocksource_list == cs;
+    if (switched) {
+        tk_switch(cs);
+    }
+    write_sequnlock(&tk.lock);
+    arch_irq_restore(flags);
+
+    /* the new counter may wrap sooner */
+    if (switched && __atomic_load_n(&clock_update_started, __ATOMIC_ACQUIRE)) {
+        clock_update_arm();
+    }
+    KLOGI(TAG, "%s: %lu Hz, rating %d, mult %u shift %u%s", cs->name, cs->frequency, cs->rating,
+          cs->mult, cs->shift, switched ? " (selected)" : "");
+}
+
+void clocksource_set_frequency(struct clocksource *cs, uint64_t frequency)
+{
+    uint32_t mult, shift;
+    clocksource_calc_mult_shift(&mult, &shift, frequency, NSEC_PER_SEC);
+
+    const unsigned long flags = arch_irq_save();
+    write_seqlock(&tk.lock);
+    cs->frequency = frequency;
+    cs->mult = mult;
+    cs->shift = shift;
+    if (tk.cs == cs) {
+        /* the cycles so far count at the old rate, the rest at the new one */
+        tk_switch(cs);
+    }
+    write_sequnlock(&tk.lock);
+    arch_irq_restore(flags);
+}
+
+void clocksource_set_rating(struct clocksource *cs, int rating)
+{
+    const unsigned long flags = arch_irq_save();
+    write_seqlock(&tk.lock);
+    struct clocksource **link = &clocksource_list;
+    while (*link && *link != cs) {
+        link = &(*link)->next;
+    }
+    cs->rating = rating;
+    if (!*link) { /* not registered (yet) */
+        write_sequnlock(&tk.lock);
+        arch_irq_restore(flags);
+        return;
+    }
+    *link = cs->next;
+    link = &clocksource_list;
+    while (*link && (*link)->rating >= cs->rating) {
+        link = &(*link)->next;
+    }
+    cs->next = *link;
+    *link = cs;
+
+    struct clocksource *best = clocksource_list;
+    const int switched = best != tk.cs;
+    if (switched) {
+        tk_switch(best);
+    }
+    write_sequnlock(&tk.lock);
+    arch_irq_restore(flags);
+
+    if (switched && __atomic_load_n(&clock_update_started, __ATOMIC_ACQUIRE)) {
+        clock_update_arm();
+    }
+    KLOGI(TAG, "%s: rating %d%s%s", cs->name, rating, switched ? ", switched to " : "",
+          switched ? best->name : "");
+}
+
+const struct clocksource *clocksource_current(void)
+{
+    return __atomic_load_n(&tk.cs, __ATOMIC_ACQUIRE);
+}
+
+void clock_update(void)
+{
+    const unsigned long flags = arch_irq_save();
+    if (write_tryseqlock(&tk.lock)) { /* otherwise whoever holds it updates the base */
+        if (tk.cs) {
+            tk_accumulate(tk.cs->read());
+        }
+        write_sequnlock(&tk.lock);
+    }
+    arch_irq_restore(flags);
+}
+
+/* monotonic time at counter value @p now of the current source; called inside a read section */
+static inline uint64_t tk_ns_at(uint64_t now)
+{
+    const uint64_t delta = (now - tk.cycle_last) & tk.cs->mask;
+    return tk.base_ns + (uint64_t)(cycles_to_scaled_ns(delta, tk.mult, tk.base_frac) >> tk.shift);
+}
+
+static uint64_t tk_read(int64_t *realtime_offset_ns)
+{
+    const struct clocksource *cs;
+    uint64_t ns, delta;
+    uint32_t seq;
+
+    do {
+        seq = read_seqbegin(&tk.lock);
+        cs = tk.cs;
+        if (!cs) {
+            *realtime_offset_ns = tk.realtime_offset_ns;
+            return 0;
+        }
+        const uint64_t now = cs->read();
+        delta = (now - tk.cycle_last) & cs->mask;
+        ns = tk_ns_at(now);
+        *realtime_offset_ns = tk.realtime_offset_ns;
+    } while (read_seqretry(&tk.lock, seq));
+
+    if (delta > cs->mask >> 1) {
+        clock_update();
+    }
+    return ns;
+}
+
+uint64_t clock_monotonic_ns(void)
+{
+    int64_t offset;
+    return tk_read(&offset);
+}
+
+uint64_t clock_realtime_ns(void)
+{
+    int64_t offset;
+    const uint64_t ns = tk_read(&offset);
+    return ns + offset;
+}
+
+uint64_t clock_realtime_ns_at(const struct clocksource *cs, uint64_t cycles)
+{
+    uint64_t ns, age, mask;
+    uint32_t mult, shift, seq;
+
+    do {
+        seq = read_seqbegin(&tk.lock);
+        const uint64_t now = cs->read();
+        if (!tk.cs) {
+            ns = 0;
+        } else {
+            ns = tk_ns_at(tk.cs == cs ? now : tk.cs->read());
+        }
+        ns += tk.realtime_offset_ns;
+        age = now - cycles;
+        mask = cs->mask;
+        mult = cs->mult;
+        shift = cs->shift;
+    } while (read_seqretry(&tk.lock, seq));
+
+    /* @p cycles may be a little ahead of now, e.g. when it was read on another CPU */
+    if ((age & mask) > mask >> 1) {
+        return ns + (uint64_t)(cycles_to_scaled_ns(-age & mask, mult, 0) >> shift);
+    }
+    return ns - (uint64_t)(cycles_to_scaled_ns(age & mask, mult, 0) >> shift);
+}
+
+void clock_set_realtime(uint64_t epoch_ns)
+{
+    const unsigned long flags = arch_irq_save();
+    write_seqlock(&tk.lock);
+    if (tk.cs) {
+        tk_accumulate(tk.cs->read());
+    }
+    tk.realtime_offset_ns = (int64_t)(epoch_ns - tk.base_ns);
+    write_sequnlock(&tk.lock);
+    arch_irq_restore(flags);
+}
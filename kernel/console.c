@@ -0,0 +1,67 @@
+#include <console.h>
+#include <cpu.h>
+#include <kernel/string.h>
+
+struct console_buffer {
+    size_t len;
+    char data[CONSOLE_BUFFER_SIZE];
+};
+
+static struct console_buffer console_buffers[MAX_CPUS];
+
+static void console_null_output(const char *buf, size_t len)
+{
+    (void)buf;
+    (void)len;
+}
+
+static write_like_t console_output = console_null_output;
+
+write_like_t console_set_output(write_like_t fn)
+{
+    write_like_t orig_fn = console_output;
+    console_output = fn;
+    return orig_fn;
+}
+
+static void console_buffer_flush(struct console_buffer *cb)
+{
+    if (cb->len) {
+        console_output(cb->data, cb->len);
+        cb->len = 0;
+    }
+}
+
+void console_write(const char *buf, size_t len)
+{
+    const unsigned long flags = arch_irq_save();
+    struct console_buffer *cb = &console_buffers[arch_cpu_id()];
+
+    while (len) {
+        size_t n = CONSOLE_BUFFER_SIZE - cb->len;
+        if (n > len) {
+            n = len;
+        }
+        const char *newline = memchr(buf, '\n', n);
+        if (newline) {
+            n = (size_t)(newline - buf) + 1;
+        }
+
+        memcpy(cb->data + cb->len, buf, n);
+        cb->len += n;
+        buf += n;
+        len -= n;
+
+        if (newline || cb->len == CONSOLE_BUFFER_SIZE) {
+            console_buffer_flush(cb);
+        }
+    }
+    arch_irq_restore(flags);
+}
+
+void console_flush(void)
+{
+    const unsigned long flags = arch_irq_save();
+    console_buffer_flush(&console_buffers[arch_cpu_id()]);
+    arch_irq_restore(flags);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <misc/kprintf.h>
+
+/**
+ * @brief Buffered console between kprintf and the output device.
+ *
+ * Each CPU collects output in its own line buffer, which is handed to the
+ * device in one write when a newline is seen, when the buffer fills up, or
+ * on console_flush(). A device write can then cover a whole line with a
+ * single string I/O instruction instead of one port write per character.
+ */
+
+#define CONSOLE_BUFFER_SIZE 256
+
+/**
+ * @brief Set the device the line buffers are flushed to.
+ * @return the previous device
+ */
+write_like_t console_set_output(write_like_t fn);
+
+/**
+ * @brief Append @p len bytes to the calling CPU's line buffer.
+ *
+ * Safe to call with interrupts enabled; the buffer is updated with
+ * interrupts disabled on the local CPU.
+ */
+void console_write(const char *buf, size_t len);
+
+/**
+ * @brief Hand whatever is buffered on the calling CPU to the device.
+ */
+void console_flush(void);
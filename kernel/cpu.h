@@ -1,5 +1,99 @@
 #pragma once
 
+#include <kernel/types.h>
+
+#define MAX_CPUS 32
+
+/**
+ * @brief Per-CPU data, reached through the GS base of each processor.
+ *
+ * Subsystems keep their own per-CPU state in arrays of MAX_CPUS entries
+ * indexed by arch_cpu_id().
+ */
+struct processor_local {
+    struct processor_local *self; /* must stay first, read through %gs:0 */
+    int cpu_id;
+    int64_t tsc_offset; /* added to this CPU's TSC to put it on the common timeline, see tsc_sync.h */
+};
+
+extern struct processor_local processor_local_data[MAX_CPUS];
 
 extern void fpu_initialize(void);
-void arch_hcf(void);
\ No newline at end of file
+void arch_hcf(void);
+
+/**
+ * @brief Idle loop of a CPU with nothing else to do: writes out the asynchronous
+ *        log sinks and otherwise halts with interrupts enabled until the next one. Never returns.
+ */
+void arch_idle(void);
+
+/**
+ * @brief Point the GS base of the calling processor at its processor_local_data entry.
+ *
+ * Has to run on every processor before anything that uses arch_cpu_id().
+ */
+void arch_cpu_local_initialize(int cpu_id);
+
+static inline struct processor_local *arch_this_cpu(void)
+{
+    struct processor_local *local;
+    asm volatile("mov %%gs:0, %0" : "=r"(local));
+    return local;
+}
+
+static inline int arch_cpu_id(void)
+{
+    int id;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(struct processor_local, cpu_id)));
+    return id;
+}
+
+/**
+ * @brief TSC of the calling CPU on the timeline shared by all CPUs
+ *
+ * Use this for anything compared across CPUs, such as log timestamps;
+ * plain rdtsc is fine for intervals measured on one CPU.
+ */
+static inline uint64_t arch_tsc_read(void)
+{
+    uint32_t lo, hi;
+    int64_t offset;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    asm volatile("movq %%gs:%c1, %0" : "=r"(offset) : "i"(offsetof(struct processor_local, tsc_offset)));
+    return ((uint64_t)hi << 32 | lo) + offset;
+}
+
+static inline uint64_t arch_rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return (uint64_t)hi << 32 | lo;
+}
+
+static inline void arch_wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+/**
+ * @brief Disable interrupts on this CPU, returning the previous RFLAGS for arch_irq_restore().
+ */
+static inline unsigned long arch_irq_save(void)
+{
+    unsigned long flags;
+    asm volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void arch_irq_restore(unsigned long flags)
+{
+    asm volatile("pushq %0\n\tpopfq" : : "r"(flags) : "memory", "cc");
+}
+
+/**
+ * @brief Enable interrupts on this CPU, once its IDT and interrupt controllers are set up.
+ */
+static inline void arch_irq_enable(void)
+{
+    asm volatile("sti" : : : "memory");
+}
@@ -0,0 +1,401 @@
+/*
+ * Hosted benchmark of kernel/misc/string.c and kernel/misc/kprintf.c.
+ *
+ * Built and run on the build machine with "make bench" from kernel/.
+ * Every routine is first checked against the host libc on random inputs,
+ * then timed against it across sizes, alignments and printf format mixes.
+ * Times are wall-clock ns per call; bytes/cycle uses TSC (reference) cycles.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "kfuncs.h"
+
+#define BENCH_MIN_NS   20000000ULL /* run each case for at least 20ms */
+#define BUFFER_SIZE    (1 << 20)
+
+static unsigned char *src_buf;
+static unsigned char *dst_buf;
+static int failures;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(const char *what, const char *detail)
+{
+    failures++;
+    if (failures <= 20)
+        fprintf(stderr, "MISMATCH %s: %s\n", what, detail);
+}
+
+/* ------------------------------------------------------------------------- */
+/* string routines                                                           */
+/* ------------------------------------------------------------------------- */
+
+struct string_impl {
+    void *(*memcpy)(void *restrict, const void *restrict, size_t);
+    void *(*memset)(void *, int, size_t);
+    void *(*memmove)(void *, const void *, size_t);
+    void *(*memchr)(const void *, int, size_t);
+    int (*memcmp)(const void *, const void *, size_t);
+    size_t (*strlen)(const char *);
+    char *(*strchr)(const char *, int);
+    int (*strcmp)(const char *, const char *);
+};
+
+static const struct string_impl libc_impl = {
+    memcpy, memset, memmove, memchr, memcmp, strlen, strchr, strcmp,
+};
+
+static const struct string_impl kernel_impl = {
+    k_memcpy, k_memset, k_memmove, k_memchr, k_memcmp, k_strlen, k_strchr, k_strcmp,
+};
+
+static int sign(int v)
+{
+    return (v > 0) - (v < 0);
+}
+
+/* prepare the buffers so that string searches stop exactly at @p size */
+static void setup_strings(size_t size, size_t align)
+{
+    memset(src_buf, 'a', BUFFER_SIZE);
+    memset(dst_buf, 'a', BUFFER_SIZE);
+    src_buf[align + size] = 'z';
+    src_buf[align + size + 1] = '\0';
+    dst_buf[align + size] = 'y';
+    dst_buf[align + size + 1] = '\0';
+}
+
+static void check_strings(void)
+{
+    char detail[128];
+
+    for (int iter = 0; iter < 20000; iter++) {
+        const size_t size = (size_t)rand() % 300;
+        const size_t sa = (size_t)rand() % 16, da = (size_t)rand() % 16;
+        unsigned char a[640], b[640], c[640];
+
+        for (size_t i = 0; i < sizeof(a); i++)
+            a[i] = (unsigned char)(rand() % 4 + 'a');
+        memcpy(b, a, sizeof(a));
+        memcpy(c, a, sizeof(a));
+        snprintf(detail, sizeof(detail), "size=%zu src_align=%zu dst_align=%zu", size, sa, da);
+
+        /* memcpy / memmove / memset into two copies and compare */
+        memcpy(b + 256 + da, a + sa, size);
+        k_memcpy(c + 256 + da, a + sa, size);
+        if (memcmp(b, c, sizeof(b)))
+            fail("memcpy", detail);
+        memmove(b + da, b + sa, size);
+        k_memmove(c + da, c + sa, size);
+        if (memcmp(b, c, sizeof(b)))
+            fail("memmove", detail);
+        memset(b + da, (int)sa, size);
+        k_memset(c + da, (int)sa, size);
+        if (memcmp(b, c, sizeof(b)))
+            fail("memset", detail);
+
+        /* compare / search on strings with a random terminator */
+        b[sa + size] = '\0';
+        c[da + size] = '\0';
+        if (rand() & 1)
+            memcpy(c + da, b + sa, size);
+        if (sign(memcmp(b + sa, c + da, size)) != sign(k_memcmp(b + sa, c + da, size)))
+            fail("memcmp", detail);
+        if (sign(strcmp((char *)b + sa, (char *)c + da)) != sign(k_strcmp((char *)b + sa, (char *)c + da)))
+            fail("strcmp", detail);
+        if (strlen((char *)b + sa) != k_strlen((char *)b + sa))
+            fail("strlen", detail);
+        const int ch = rand() % 5 + 'a';
+        if (memchr(b + sa, ch, size) != k_memchr(b + sa, ch, size))
+            fail("memchr", detail);
+        if (strchr((char *)b + sa, ch) != k_strchr((char *)b + sa, ch))
+            fail("strchr", detail);
+        if (strchr((char *)b + sa, 0) != k_strchr((char *)b + sa, 0))
+            fail("strchr(0)", detail);
+    }
+}
+
+static size_t op_memcpy(const struct string_impl *impl, size_t size, size_t align)
+{
+    impl->memcpy(dst_buf + align, src_buf + align, size);
+    return size;
+}
+
+static size_t op_memcpy_misaligned(const struct string_impl *impl, size_t size, size_t align)
+{
+    impl->memcpy(dst_buf + align, src_buf + align + 3, size);
+    return size;
+}
+
+static size_t op_memmove(const struct string_impl *impl, size_t size, size_t align)
+{
+    impl->memmove(dst_buf + align + 1, dst_buf + align, size);
+    return size;
+}
+
+static size_t op_memset(const struct string_impl *impl, size_t size, size_t align)
+{
+    impl->memset(dst_buf + align, 0x5a, size);
+    return size;
+}
+
+static size_t op_memcmp(const struct string_impl *impl, size_t size, size_t align)
+{
+    return (size_t)impl->memcmp(src_buf + align, dst_buf + align, size + 1) ? size : 0;
+}
+
+static size_t op_memchr(const struct string_impl *impl, size_t size, size_t align)
+{
+    return impl->memchr(src_buf + align, 'z', size + 1) ? size : 0;
+}
+
+static size_t op_strlen(const struct string_impl *impl, size_t size, size_t align)
+{
+    (void)size;
+    return impl->strlen((char *)src_buf + align) - 1;
+}
+
+static size_t op_strchr(const struct string_impl *impl, size_t size, size_t align)
+{
+    return impl->strchr((char *)src_buf + align, 'z') ? size : 0;
+}
+
+static size_t op_strcmp(const struct string_impl *impl, size_t size, size_t align)
+{
+    return impl->strcmp((char *)src_buf + align, (char *)dst_buf + align) ? size : 0;
+}
+
+struct string_case {
+    const char *name;
+    size_t (*op)(const struct string_impl *impl, size_t size, size_t align);
+};
+
+static const struct string_case string_cases[] = {
+    { "memcpy",      op_memcpy },
+    { "memcpy+3",    op_memcpy_misaligned },
+    { "memmove",     op_memmove },
+    { "memset",      op_memset },
+    { "memcmp",      op_memcmp },
+    { "memchr",      op_memchr },
+    { "strlen",      op_strlen },
+    { "strchr",      op_strchr },
+    { "strcmp",      op_strcmp },
+};
+
+struct result {
+    double ns_per_op;
+    double bytes_per_cycle;
+};
+
+static struct result time_string(const struct string_case *c, const struct string_impl *impl,
+                                 size_t size, size_t align)
+{
+    uint64_t iters = 1, elapsed, cycles;
+    size_t bytes;
+
+    setup_strings(size, align);
+    for (;;) {
+        bytes = 0;
+        const uint64_t t0 = now_ns();
+        const uint64_t c0 = __rdtsc();
+        for (uint64_t i = 0; i < iters; i++)
+            bytes += c->op(impl, size, align);
+        cycles = __rdtsc() - c0;
+        elapsed = now_ns() - t0;
+        if (elapsed >= BENCH_MIN_NS)
+            break;
+        iters *= elapsed ? (BENCH_MIN_NS * 2 / elapsed + 1) : 16;
+    }
+    return (struct result){
+        .ns_per_op = (double)elapsed / (double)iters,
+        .bytes_per_cycle = cycles ? (double)bytes / (double)cycles : 0.0,
+    };
+}
+
+static void bench_strings(void)
+{
+    static const size_t sizes[] = { 8, 31, 64, 256, 1024, 4096, 65536 };
+    static const size_t aligns[] = { 0, 1, 7 };
+
+    printf("%-10s %7s %5s | %10s %8s | %10s %8s | %6s\n",
+           "routine", "size", "align", "kernel ns", "B/cyc", "libc ns", "B/cyc", "ratio");
+    for (size_t c = 0; c < sizeof(string_cases) / sizeof(string_cases[0]); c++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (size_t a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++) {
+                const struct result k = time_string(&string_cases[c], &kernel_impl, sizes[s], aligns[a]);
+                const struct result l = time_string(&string_cases[c], &libc_impl, sizes[s], aligns[a]);
+                printf("%-10s %7zu %5zu | %10.2f %8.2f | %10.2f %8.2f | %6.2f\n",
+                       string_cases[c].name, sizes[s], aligns[a],
+                       k.ns_per_op, k.bytes_per_cycle, l.ns_per_op, l.bytes_per_cycle,
+                       k.ns_per_op / l.ns_per_op);
+            }
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* printf                                                                    */
+/* ------------------------------------------------------------------------- */
+
+typedef int (*snprintf_t)(char *, size_t, const char *, ...);
+
+struct format_case {
+    const char *name;
+    int (*run)(snprintf_t fn, char *buf, size_t len, unsigned seed);
+};
+
+static int fmt_literal(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    (void)seed;
+    return fn(buf, len, "Started with a Multiboot 2 loader, parsing the memory map now\n");
+}
+
+static int fmt_decimal(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    return fn(buf, len, "%d %u %ld %llu", (int)seed - 5000, seed * 2654435761U,
+              -(long)seed * 7919L, (unsigned long long)seed * 0x9E3779B97F4A7C15ULL);
+}
+
+static int fmt_hex(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    /* no %p: the kernel prints pointers as bare upper-case hex, unlike glibc */
+    return fn(buf, len, "0x%08x %#lx %X %016llX", seed, (unsigned long)seed << 20, seed ^ 0xdeadU,
+              0xffff800000000000ULL + seed);
+}
+
+static int fmt_padding(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    return fn(buf, len, "[%8d] [%-8u] [%08x] [%+5d] [%.5u] [%*d]", (int)seed, seed % 1000, seed,
+              (int)(seed % 77), seed % 100, 6, (int)seed % 10);
+}
+
+static int fmt_strings(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    static const char *tags[] = { "Kernel", "multiboot", "mmap", "TSC" };
+    return fn(buf, len, "%s: %-10s|%10s|%.3s %c", tags[seed & 3], tags[(seed >> 2) & 3],
+              tags[(seed >> 4) & 3], tags[(seed >> 6) & 3], 'a' + (int)(seed % 26));
+}
+
+static int fmt_klog(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    return fn(buf, len, "\033[0;32mI (%02u:%02u:%02u) %s: base_addr = 0x%x%08x, length = 0x%x%08x, type = 0x%x\033[0m\n",
+              seed % 24, seed % 60, (seed >> 3) % 60, "mmap", seed >> 16, seed * 4096U, 0U, seed * 17U, seed & 3);
+}
+
+static int fmt_float(snprintf_t fn, char *buf, size_t len, unsigned seed)
+{
+    /* stay below PRINTF_MAX_FLOAT and away from -0.0, where the kernel deliberately differs */
+    const double v = (double)(seed % 100000000U + 1U);
+    return fn(buf, len, "%f %.2f %10.3f", v / 7.0, v / 1000.0, -v / 3.0);
+}
+
+static const struct format_case format_cases[] = {
+    { "literal",  fmt_literal },
+    { "decimal",  fmt_decimal },
+    { "hex",      fmt_hex },
+    { "padding",  fmt_padding },
+    { "strings",  fmt_strings },
+    { "klog",     fmt_klog },
+    { "float",    fmt_float },
+};
+
+static void check_formats(void)
+{
+    char a[256], b[256], detail[600];
+
+    for (size_t c = 0; c < sizeof(format_cases) / sizeof(format_cases[0]); c++) {
+        for (unsigned i = 0; i < 20000; i++) {
+            const unsigned seed = i * 2654435761U;
+            const int ra = format_cases[c].run(snprintf, a, sizeof(a), seed);
+            const int rb = format_cases[c].run(k_snprintf, b, sizeof(b), seed);
+            if (ra != rb || strcmp(a, b)) {
+                snprintf(detail, sizeof(detail), "%s seed=%u libc=%d \"%s\" kernel=%d \"%s\"",
+                         format_cases[c].name, seed, ra, a, rb, b);
+                fail("snprintf", detail);
+            }
+            /* truncation must agree as well */
+            const size_t cut = seed % 24;
+            memset(a, 0x7f, sizeof(a));
+            memset(b, 0x7f, sizeof(b));
+            format_cases[c].run(snprintf, a, cut, seed);
+            format_cases[c].run(k_snprintf, b, cut, seed);
+            if (memcmp(a, b, cut)) {
+                snprintf(detail, sizeof(detail), "%s seed=%u truncated to %zu", format_cases[c].name, seed, cut);
+                fail("snprintf", detail);
+            }
+        }
+    }
+}
+
+static struct result time_format(const struct format_case *c, snprintf_t fn)
+{
+    char buf[256];
+    uint64_t iters = 1, elapsed, cycles;
+    size_t bytes;
+
+    for (;;) {
+        bytes = 0;
+        const uint64_t t0 = now_ns();
+        const uint64_t c0 = __rdtsc();
+        for (uint64_t i = 0; i < iters; i++)
+            bytes += (size_t)c->run(fn, buf, sizeof(buf), (unsigned)i * 2654435761U);
+        cycles = __rdtsc() - c0;
+        elapsed = now_ns() - t0;
+        if (elapsed >= BENCH_MIN_NS)
+            break;
+        iters *= elapsed ? (BENCH_MIN_NS * 2 / elapsed + 1) : 16;
+    }
+    return (struct result){
+        .ns_per_op = (double)elapsed / (double)iters,
+        .bytes_per_cycle = cycles ? (double)bytes / (double)cycles : 0.0,
+    };
+}
+
+static void bench_formats(void)
+{
+    printf("\n%-10s | %10s %8s | %10s %8s | %6s\n",
+           "format", "kernel ns", "B/cyc", "libc ns", "B/cyc", "ratio");
+    for (size_t c = 0; c < sizeof(format_cases) / sizeof(format_cases[0]); c++) {
+        const struct result k = time_format(&format_cases[c], k_snprintf);
+        const struct result l = time_format(&format_cases[c], snprintf);
+        printf("%-10s | %10.2f %8.3f | %10.2f %8.3f | %6.2f\n", format_cases[c].name,
+               k.ns_per_op, k.bytes_per_cycle, l.ns_per_op, l.bytes_per_cycle,
+               k.ns_per_op / l.ns_per_op);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : NULL;
+
+    src_buf = aligned_alloc(4096, BUFFER_SIZE + 4096);
+    dst_buf = aligned_alloc(4096, BUFFER_SIZE + 4096);
+    if (!src_buf || !dst_buf)
+        return 1;
+    srand(1);
+
+    check_strings();
+    check_formats();
+    if (failures) {
+        fprintf(stderr, "%d mismatches against libc\n", failures);
+        return 1;
+    }
+    printf("differential check against libc: ok\n\n");
+
+    if (!only || !strcmp(only, "string"))
+        bench_strings();
+    if (!only || !strcmp(only, "printf"))
+        bench_formats();
+    return 0;
+}
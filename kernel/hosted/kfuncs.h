@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+ * Prototypes of the kernel routines as linked into hosted builds.
+ * The hosted objects are built from the sources in kernel/misc/ and have every symbol
+ * prefixed with "k_" (objcopy --prefix-symbols) so they can live next to libc.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+
+void * k_memcpy(void * restrict dest, const void * restrict src, size_t n);
+void * k_memset(void * dest, int c, size_t n);
+void * k_memmove(void * dest, const void * src, size_t n);
+void * k_memchr(const void * src, int c, size_t n);
+int    k_memcmp(const void * vl, const void * vr, size_t n);
+size_t k_strlen(const char * s);
+char * k_strchr(const char * s, int c);
+int    k_strcmp(const char * l, const char * r);
+
+int k_snprintf(char * buffer, size_t count, const char * format, ...);
+int k_vsnprintf(char * buffer, size_t count, const char * format, va_list va);
@@ -0,0 +1,312 @@
+/*
+ * Decoder for the klog binary trace (see klog_trace_dump() and klog_trace.h).
+ *
+ *   klogdecode kernel.elf debugcon.log
+ *
+ * The log is whatever the debug console captured, e.g. with
+ * "-debugcon file:debugcon.log" in QEMU. Text output before and after the
+ * dump is skipped; every dump found in the file is decoded. Format strings,
+ * tags and "%s" arguments are addresses into the kernel image and are
+ * looked up in the loadable segments of kernel.elf, which must be the exact
+ * image that produced the trace.
+ */
+#include <elf.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "klog_trace.h"
+
+struct segment {
+    uint64_t vaddr;
+    uint64_t filesz;
+    const char *data;
+};
+
+static char *elf_image;
+static struct segment segments[16];
+static size_t segment_count;
+
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(len + 1);
+    if (!data || fread(data, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(1);
+    }
+    data[len] = '\0';
+    fclose(f);
+    *size = len;
+    return data;
+}
+
+static void load_elf(const char *path)
+{
+    size_t size;
+    elf_image = read_file(path, &size);
+
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf_image;
+    if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        fprintf(stderr, "%s: not an ELF64 file\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *phdr = (const Elf64_Phdr *)(elf_image + ehdr->e_phoff + (size_t)i * ehdr->e_phentsize);
+        if (phdr->p_type != PT_LOAD || phdr->p_offset + phdr->p_filesz > size)
+            continue;
+        if (segment_count == sizeof(segments) / sizeof(segments[0]))
+            break;
+        segments[segment_count++] = (struct segment){
+            .vaddr = phdr->p_vaddr,
+            .filesz = phdr->p_filesz,
+            .data = elf_image + phdr->p_offset,
+        };
+    }
+}
+
+/* NUL-terminated string at @p addr in the kernel image, or NULL */
+static const char *kernel_string(uint64_t addr)
+{
+    for (size_t i = 0; i < segment_count; i++) {
+        const struct segment *seg = &segments[i];
+        if (addr < seg->vaddr || addr >= seg->vaddr + seg->filesz)
+            continue;
+        const char *s = seg->data + (addr - seg->vaddr);
+        if (!memchr(s, '\0', seg->filesz - (addr - seg->vaddr)))
+            return NULL;
+        return s;
+    }
+    return NULL;
+}
+
+/* integer value of @p word as the kernel would have read it with @p length ("hh", "l", ...) */
+static uint64_t convert_int(uint64_t word, const char *length, int is_signed)
+{
+    if (!strcmp(length, "hh"))
+        return is_signed ? (uint64_t)(int64_t)(int8_t)word : (uint8_t)word;
+    if (!strcmp(length, "h"))
+        return is_signed ? (uint64_t)(int64_t)(int16_t)word : (uint16_t)word;
+    if (!*length)
+        return is_signed ? (uint64_t)(int64_t)(int32_t)word : (uint32_t)word;
+    return word; /* l, ll, z, j, t are all 64 bit */
+}
+
+/* the kernel printf has %b (binary), which the host printf may not */
+static void print_binary(uint64_t value, const char *flags, int width)
+{
+    char digits[65];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + (value & 1);
+        value >>= 1;
+    } while (value);
+    int pad = width > n ? width - n : 0;
+    int left = strchr(flags, '-') != NULL;
+    char padchar = !left && strchr(flags, '0') ? '0' : ' ';
+    if (!left)
+        while (pad--) putchar(padchar);
+    while (n--)
+        putchar(digits[n]);
+    if (left)
+        while (pad-- > 0) putchar(' ');
+}
+
+/* printf @p format with the argument words of @p record */
+static void print_message(const char *format, const struct klog_trace_record *record)
+{
+    unsigned int arg = 0;
+#define NEXT_ARG() (arg < record->nargs ? record->args[arg++] : 0)
+
+    while (*format) {
+        if (*format != '%') {
+            const char *end = strchrnul(format, '%');
+            fwrite(format, 1, end - format, stdout);
+            format = end;
+            continue;
+        }
+
+        /* split the specification into flags, width, precision, length, conversion */
+        char flags[8] = "", length[3] = "", spec[64];
+        size_t nflags = 0;
+        int width = 0, precision = -1;
+        format++;
+        while (*format && strchr("-+ #0", *format) && nflags < sizeof(flags) - 1)
+            flags[nflags++] = *format++;
+        flags[nflags] = '\0';
+        if (*format == '*') {
+            width = (int)NEXT_ARG();
+            format++;
+        } else {
+            while (*format >= '0' && *format <= '9')
+                width = width * 10 + (*format++ - '0');
+        }
+        if (*format == '.') {
+            format++;
+            precision = 0;
+            if (*format == '*') {
+                precision = (int)NEXT_ARG();
+                format++;
+            } else {
+                while (*format >= '0' && *format <= '9')
+                    precision = precision * 10 + (*format++ - '0');
+            }
+        }
+        for (size_t n = 0; *format && strchr("hlzjt", *format) && n < 2; n++) {
+            length[n] = *format++;
+            length[n + 1] = '\0';
+        }
+        char conversion = *format;
+        if (!conversion)
+            break;
+        format++;
+
+        if (precision >= 0)
+            snprintf(spec, sizeof(spec), "%%%s%d.%d", flags, width, precision);
+        else
+            snprintf(spec, sizeof(spec), "%%%s%d", flags, width);
+        size_t speclen = strlen(spec);
+
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            strcpy(spec + speclen, PRId64);
+            printf(spec, (int64_t)convert_int(NEXT_ARG(), length, 1));
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            const char *fmt = conversion == 'u' ? PRIu64 : conversion == 'x' ? PRIx64 :
+                              conversion == 'X' ? PRIX64 : PRIo64;
+            strcpy(spec + speclen, fmt);
+            printf(spec, convert_int(NEXT_ARG(), length, 0));
+            break;
+        }
+        case 'b':
+            print_binary(convert_int(NEXT_ARG(), length, 0), flags, width);
+            break;
+        case 'c':
+            strcpy(spec + speclen, "c");
+            printf(spec, (int)(unsigned char)NEXT_ARG());
+            break;
+        case 'p':
+            /* the kernel prints pointers as 16 upper-case hex digits without prefix */
+            printf("%016" PRIX64, NEXT_ARG());
+            break;
+        case 's': {
+            uint64_t addr = NEXT_ARG();
+            const char *s = kernel_string(addr);
+            if (s) {
+                strcpy(spec + speclen, "s");
+                printf(spec, s);
+            } else {
+                printf("<str@%#" PRIx64 ">", addr);
+            }
+            break;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G': {
+            uint64_t word = NEXT_ARG();
+            double value;
+            memcpy(&value, &word, sizeof(value));
+            spec[speclen] = conversion;
+            spec[speclen + 1] = '\0';
+            printf(spec, value);
+            break;
+        }
+        case '%':
+            putchar('%');
+            break;
+        default:
+            putchar(conversion);
+            break;
+        }
+    }
+#undef NEXT_ARG
+}
+
+static void print_record(const struct klog_trace_header *header, const struct klog_trace_record *record)
+{
+    static const char levels[] = "NEWIDV";
+    const char *format = kernel_string(record->format);
+    const char *tag = kernel_string(record->tag);
+    uint64_t usec = header->tsc_mhz ? record->tsc / header->tsc_mhz : 0;
+
+    if (!record->seq) {
+        printf("- (lost record)\n");
+        return;
+    }
+    printf("%c (%" PRIu64 ".%06" PRIu64 ") [%u] %s: ",
+           record->level < sizeof(levels) - 1 ? levels[record->level] : '?',
+           usec / 1000000, usec % 1000000, record->cpu, tag ? tag : "?");
+    if (format)
+        print_message(format, record);
+    else
+        printf("<format@%#" PRIx64 ">", record->format);
+    if (!format || !*format || format[strlen(format) - 1] != '\n')
+        putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s kernel.elf debugcon.log\n", argv[0]);
+        return 2;
+    }
+    load_elf(argv[1]);
+
+    size_t size;
+    const char *log = read_file(argv[2], &size);
+    const char *end = log + size;
+    const char *p = log;
+    int dumps = 0;
+
+    while ((p = memmem(p, end - p, KLOG_TRACE_MAGIC, 8)) != NULL) {
+        struct klog_trace_header header;
+        if ((size_t)(end - p) < sizeof(header))
+            break;
+        memcpy(&header, p, sizeof(header));
+        if (header.record_size != sizeof(struct klog_trace_record)) {
+            fprintf(stderr, "trace at offset %zu: record size %u, expected %zu\n",
+                    (size_t)(p - log), header.record_size, sizeof(struct klog_trace_record));
+            p += 8;
+            continue;
+        }
+        p += sizeof(header);
+
+        if (dumps++)
+            putchar('\n');
+        if (header.lost)
+            printf("- (%" PRIu64 " older records overwritten)\n", header.lost);
+        for (uint32_t i = 0; i < header.record_count; i++) {
+            struct klog_trace_record record;
+            if ((size_t)(end - p) < sizeof(record)) {
+                fprintf(stderr, "trace truncated after %u of %u records\n", i, header.record_count);
+                return 1;
+            }
+            memcpy(&record, p, sizeof(record));
+            p += sizeof(record);
+            print_record(&header, &record);
+        }
+    }
+    if (!dumps) {
+        fprintf(stderr, "%s: no klog trace found\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -1,10 +1,25 @@
+#include <console.h>
 #include <cpu.h>
+#include <kernel/arch/x86_64/acpi.h>
 #include <kernel/arch/x86_64/cmos.h>
 #include <kernel/arch/x86_64/debug_console.h>
+#include <kernel/arch/x86_64/gdt.h>
+#include <kernel/arch/x86_64/hpet.h>
+#include <kernel/arch/x86_64/ioapic.h>
+#include <kernel/arch/x86_64/irq.h>
+#include <kernel/arch/x86_64/lapic.h>
 #include <kernel/arch/x86_64/ports.h>
+#include <kernel/arch/x86_64/serial.h>
+#include <kernel/arch/x86_64/tsc_sync.h>
+#include <kernel/arch/x86_64/virtio_console.h>
+#include <kernel/checksum.h>
+#include <kernel/clocksource.h>
 #include <kernel/misc.h>
+#include <kernel/mmu.h>
 #include <kernel/string.h>
+#include <kernel/timer.h>
 #include <kernel/version.h>
+#include <kernel/video.h>
 #include <klog.h>
 #include <misc/kprintf.h>
 #include <multiboot.h>
@@ -15,6 +30,18 @@ static uintptr_t highest_valid_address = 0;
 extern uintptr_t kernel_end;
 static uintptr_t highest_kernel_address = (uintptr_t)&kernel_end;
 
+/* framebuffer set up by the loader, if any */
+static struct {
+  uintptr_t addr;
+  uint32_t pitch;
+  uint32_t width;
+  uint32_t height;
+  uint8_t bpp;
+} boot_framebuffer;
+
+/* ACPI RSDP copied by a multiboot2 loader, if any */
+static const void *boot_rsdp;
+
 static void parse_multiboot2(void *mboot) {
   // mboot_is_2 = 1;
   KLOGV("multiboot", "Started with a Multiboot 2 loader");
@@ -33,6 +60,20 @@ static void parse_multiboot2(void *mboot) {
       uintptr_t addr = (uintptr_t)module->mod_end;
       if (addr > highest_kernel_address)
         highest_kernel_address = addr;
+    } else if (tag->type == MULTIBOOT2_TAG_TYPE_FRAMEBUFFER) {
+      struct multiboot2_tag_framebuffer_common *fb =
+          (struct multiboot2_tag_framebuffer_common *)tag;
+      if (fb->framebuffer_type == MULTIBOOT2_FRAMEBUFFER_TYPE_RGB) {
+        boot_framebuffer.addr = fb->framebuffer_addr;
+        boot_framebuffer.pitch = fb->framebuffer_pitch;
+        boot_framebuffer.width = fb->framebuffer_width;
+        boot_framebuffer.height = fb->framebuffer_height;
+        boot_framebuffer.bpp = fb->framebuffer_bpp;
+      }
+    } else if (tag->type == MULTIBOOT2_TAG_TYPE_ACPI_NEW) {
+      boot_rsdp = ((struct multiboot2_tag_new_acpi *)tag)->rsdp;
+    } else if (tag->type == MULTIBOOT2_TAG_TYPE_ACPI_OLD && !boot_rsdp) {
+      boot_rsdp = ((struct multiboot2_tag_old_acpi *)tag)->rsdp;
     }
   }
 
@@ -120,6 +161,15 @@ static void parse_multiboot(multiboot_info_t *mboot) {
     }
   }
 
+  if ((mboot->flags & MULTIBOOT_INFO_FRAMEBUFFER_INFO) &&
+      mboot->framebuffer_type == MULTIBOOT_FRAMEBUFFER_TYPE_RGB) {
+    boot_framebuffer.addr = mboot->framebuffer_addr;
+    boot_framebuffer.pitch = mboot->framebuffer_pitch;
+    boot_framebuffer.width = mboot->framebuffer_width;
+    boot_framebuffer.height = mboot->framebuffer_height;
+    boot_framebuffer.bpp = mboot->framebuffer_bpp;
+  }
+
   /* Round the max address up a page */
   highest_kernel_address =
       (highest_kernel_address + 0xFFF) & 0xFFFFFFFFFFFFF000;
@@ -140,12 +190,71 @@ void multiboot_initialize(void *mboot, uint32_t mboot_magic_number) {
  * Called by the x86-64 longmode bootstrap.
  */
 void kmain(void *mboot, uint32_t mboot_magic_number/*, void *esp*/) {
+  arch_cpu_local_initialize(0);
+  gdt_initialize();
+  idt_initialize();
   fpu_initialize();
+  mmu_init();
+  checksum_initialize();
+  blit_initialize();
   debugcon_init();
+  tsc_sync_initialize();
   arch_clock_initialize();
+  const bool have_serial =
+      serial_initialize(SERIAL_PORT_COM1, SERIAL_DEFAULT_BAUD) == 0;
+  if (have_serial) {
+    const int sink =
+        klog_sink_add("serial", serial_write, KLOG_LEVEL_INFO, 0, true);
+    klog_sink_set_flush(sink, serial_flush);
+  }
+  if (virtio_console_initialize() == 0) {
+    const int sink = klog_sink_add("virtio-console", virtio_console_write,
+                                   KLOG_LEVEL_VERBOSE, 0, true);
+    klog_sink_set_flush(sink, virtio_console_flush);
+  }
   /* Parse multiboot data so we can get memory map, modules, command line, etc.
    */
   multiboot_initialize(mboot, mboot_magic_number);
+  if (acpi_initialize(boot_rsdp) == 0) {
+    if (hpet_initialize() == 0) {
+      arch_tsc_calibrate(hpet_clocksource_get());
+    }
+    acpi_pm_timer_initialize();
+  }
+  if (lapic_initialize() == 0) {
+    lapic_timer_initialize();
+  }
+  if (ioapic_initialize() == 0) {
+    if (have_serial) {
+      ioapic_route_isa_irq(SERIAL_IRQ_COM1, serial_irq_handler);
+    }
+    hpet_route_comparators();
+  }
+  if (timer_initialize() == 0) {
+    clock_update_start();
+  }
+  arch_irq_enable();
+  if (boot_framebuffer.addr &&
+      lfb_initialize(boot_framebuffer.addr, boot_framebuffer.pitch,
+                     boot_framebuffer.width, boot_framebuffer.height,
+                     boot_framebuffer.bpp) == 0) {
+#ifdef CONFIG_BLIT_BENCHMARK
+    /* nothing is allocated yet, so the memory after the kernel is free */
+    const uintptr_t identity_mapped_end = 0x40000000;
+    const uintptr_t scratch_end = highest_valid_address + 1 < identity_mapped_end
+                                      ? highest_valid_address + 1
+                                      : identity_mapped_end;
+    blit_benchmark((void *)highest_kernel_address,
+                   scratch_end > highest_kernel_address
+                       ? scratch_end - highest_kernel_address
+                       : 0);
+#endif
+    if (fbterm_initialize() == 0) {
+      const int sink =
+          klog_sink_add("fbterm", fbterm_write, KLOG_LEVEL_INFO, 0, true);
+      klog_sink_set_flush(sink, fbterm_flush);
+    }
+  }
 
   // kprintf("\e[1;1H\e[2J"); // clear screen
   kprintf("Welcome to \x1B[33m%s\x1B[37m v", __kernel_name);
@@ -153,7 +262,7 @@ void kmain(void *mboot, uint32_t mboot_magic_number/*, void *esp*/) {
           __kernel_version_minor, __kernel_version_patch,
           __kernel_version_suffix);
   kprintf("\nbuild_date: %s %s\n", __kernel_build_date, __kernel_build_time);
-  date_t date = read_rtc();
+  date_t date = read_date();
   uint64_t epoch_time = read_epoch_time();
   kprintf("date: %d-%d-%d %d:%d\n", date.year, date.month, date.day, date.hour,
           date.minute);
@@ -166,5 +275,6 @@ void kmain(void *mboot, uint32_t mboot_magic_number/*, void *esp*/) {
   KLOGW(TAG, "Some warning from kernel!");
   KLOGE(TAG, "Some Error from kernel!!");
 
-  arch_hcf();
+  /* nothing left to set up: take interrupts and write out the log from now on */
+  arch_idle();
 }
@@ -1,9 +1,114 @@
 
 #include <klog.h>
+#include <cpu.h>
 #include <misc/kprintf.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
 #include <kernel/arch/x86_64/cmos.h>
+#include <x86intrin.h>
 
-vprintf_like_t s_log_print_func = vprintf; // imported from <kprintf.h>
+/*
+ * Every CPU owns a ring of fixed-size records. Producers only ever touch the
+ * ring of the CPU they run on; an interrupt handler that logs on top of a
+ * half-written record simply reserves the next slot, so reservation is a
+ * compare-and-swap on the ring head and publishing a record is a release
+ * store of its sequence number. Nothing spins and nothing disables
+ * interrupts, so KLOGx is usable from any context.
+ *
+ * A single reader (whoever wins the drain flag) repeatedly takes the oldest
+ * committed record across all rings, by TSC, and routes it to the sinks.
+ * Producers that lose the race for the flag return at once: a slow output
+ * only ever holds up the CPU that happens to be draining, and a full ring
+ * drops the new record (counted in klog_dropped()) instead of waiting.
+ */
+
+struct klog_record {
+    uint64_t seq;                   /* slot sequence + 1 once committed */
+    uint64_t tsc;
+    const char *tag;
+    uint16_t len;
+    uint8_t level;
+    char payload[KLOG_PAYLOAD_SIZE];
+};
+
+struct klog_ring {
+    uint64_t head;                  /* next slot to reserve, written by the owning CPU */
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64))); /* next slot to read, written by the reader */
+    struct klog_record records[KLOG_RING_RECORDS];
+} __attribute__((aligned(64)));
+
+static struct klog_ring klog_rings[MAX_CPUS];
+static int klog_draining;
+
+/*
+ * Runtime levels. klog_tag_levels holds what klog_level_set() was given, by
+ * name; klog_tag_hash maps tag addresses to their resolved level so the
+ * string compares happen once per address. Hash entries are only ever added
+ * (level first, then the tag with release semantics) or have their level
+ * rewritten, which lets readers probe the table without the lock.
+ */
+#define KLOG_TAG_HASH_SIZE  256 /* power of two */
+#define KLOG_TAG_LEVELS_MAX 32
+#define KLOG_TAG_NAME_MAX   32
+
+struct klog_tag_entry {
+    const char *tag;
+    uint8_t level;
+};
+
+struct klog_tag_level {
+    char name[KLOG_TAG_NAME_MAX];
+    klog_level_t level;
+};
+
+static struct klog_tag_entry klog_tag_hash[KLOG_TAG_HASH_SIZE];
+static struct klog_tag_level klog_tag_levels[KLOG_TAG_LEVELS_MAX];
+static size_t klog_tag_level_count;
+static klog_level_t klog_default_level = KLOG_LEVEL_VERBOSE;
+static spin_lock_t klog_level_lock = SPIN_LOCK_INIT;
+
+static_key_t klog_level_keys[KLOG_LEVEL_VERBOSE + 1] = {
+    STATIC_KEY_INIT_TRUE, STATIC_KEY_INIT_TRUE, STATIC_KEY_INIT_TRUE,
+    STATIC_KEY_INIT_TRUE, STATIC_KEY_INIT_TRUE, STATIC_KEY_INIT_TRUE,
+};
+
+uint32_t klog_level_generation = 1; /* zeroed call site caches start out stale */
+
+/*
+ * Sinks. Each FIFO has exactly one producer, the ring reader in klog_flush(),
+ * and one consumer, whoever holds the sink's draining flag. A record is
+ * stored as a 16-bit length followed by its bytes, wrapping around the end.
+ */
+struct klog_sink {
+    const char *name;
+    write_like_t write;
+    bool (*flush)(void);            /* see klog_sink_set_flush() */
+    uint8_t level;
+    bool async;
+    uint32_t rate_limit;
+    uint64_t tokens;                /* records that may pass the rate limit now */
+    uint64_t refill_tsc;            /* TSC the tokens were last topped up at */
+    uint64_t enqueued;
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t rate_limited;
+    uint64_t head;                  /* FIFO write position, only grows */
+    uint64_t tail __attribute__((aligned(64))); /* FIFO read position, only grows */
+    int draining;
+    char fifo[KLOG_SINK_FIFO_SIZE];
+};
+
+static void klog_console_write(const char *buf, size_t len)
+{
+    _write(buf, len);
+}
+
+static struct klog_sink klog_sinks[KLOG_MAX_SINKS] = {
+    { .name = "console", .write = klog_console_write, .level = KLOG_LEVEL_VERBOSE },
+};
+static int klog_sink_count = 1;
+static spin_lock_t klog_sink_lock = SPIN_LOCK_INIT;
 
 void klog_write(klog_level_t level,
                    const char *tag,
@@ -20,33 +125,446 @@ void klog_writev(klog_level_t level,
                    const char *format,
                    va_list args)
 {
-    (void)level;
-    (void)tag;
-    // spinlock.lock
+    struct klog_ring *ring = &klog_rings[arch_cpu_id()];
+    uint64_t seq = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    do {
+        if (seq - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= KLOG_RING_RECORDS) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->head, &seq, seq + 1, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    struct klog_record *record = &ring->records[seq % KLOG_RING_RECORDS];
+    record->tsc = arch_tsc_read();
+    record->tag = tag;
+    record->level = (uint8_t)level;
+
+    int len = vsnprintf(record->payload, sizeof(record->payload), format, args);
+    if (len < 0) {
+        len = 0;
+    } else if ((size_t)len >= sizeof(record->payload)) {
+        /* keep the line terminated (and the colour reset) when cutting it short */
+        static const char cut[] = "~" LOG_RESET_COLOR "\n";
+        len = sizeof(record->payload) - 1;
+        memcpy(record->payload + len - (sizeof(cut) - 1), cut, sizeof(cut) - 1);
+    }
+    record->len = (uint16_t)len;
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+
+    klog_flush();
+}
+
+/* oldest committed record of @p ring, or NULL */
+static struct klog_record *klog_ring_peek(struct klog_ring *ring)
+{
+    const uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    struct klog_record *record = &ring->records[tail % KLOG_RING_RECORDS];
+
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+        return NULL;
+    }
+    return record;
+}
+
+static bool klog_pending(void)
+{
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (klog_ring_peek(&klog_rings[cpu])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void klog_fifo_copy_in(struct klog_sink *sink, uint64_t pos, const void *data, size_t len)
+{
+    const size_t offset = pos & (KLOG_SINK_FIFO_SIZE - 1);
+    const size_t first = len < KLOG_SINK_FIFO_SIZE - offset ? len : KLOG_SINK_FIFO_SIZE - offset;
+
+    memcpy(sink->fifo + offset, data, first);
+    memcpy(sink->fifo, (const char *)data + first, len - first);
+}
+
+/* whether the rate limit of @p sink lets one more record through now */
+static bool klog_sink_admit(struct klog_sink *sink, uint64_t tsc)
+{
+    if (!sink->rate_limit) {
+        return true;
+    }
+
+    const uint64_t tsc_per_record = arch_cpu_mhz() * 1000000 / sink->rate_limit;
+    if (!tsc_per_record) {
+        return true;
+    }
+    const uint64_t refill = (tsc - sink->refill_tsc) / tsc_per_record;
+    if (refill) {
+        sink->tokens = sink->tokens + refill < sink->rate_limit ? sink->tokens + refill : sink->rate_limit;
+        sink->refill_tsc += refill * tsc_per_record;
+    }
+    if (!sink->tokens) {
+        return false;
+    }
+    sink->tokens--;
+    return true;
+}
+
+/* copy @p record into the FIFO of every sink that wants it; called by the ring reader only */
+static void klog_route(const struct klog_record *record)
+{
+    const int count = __atomic_load_n(&klog_sink_count, __ATOMIC_ACQUIRE);
+    const uint16_t len = record->len;
+
+    for (int i = 0; i < count; i++) {
+        struct klog_sink *sink = &klog_sinks[i];
+
+        if (record->level > __atomic_load_n(&sink->level, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (!klog_sink_admit(sink, record->tsc)) {
+            __atomic_fetch_add(&sink->rate_limited, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        const uint64_t tail = __atomic_load_n(&sink->tail, __ATOMIC_ACQUIRE);
+        if (sink->head + sizeof(len) + len - tail > KLOG_SINK_FIFO_SIZE) {
+            __atomic_fetch_add(&sink->dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        klog_fifo_copy_in(sink, sink->head, &len, sizeof(len));
+        klog_fifo_copy_in(sink, sink->head + sizeof(len), record->payload, len);
+        __atomic_fetch_add(&sink->enqueued, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&sink->head, sink->head + sizeof(len) + len, __ATOMIC_RELEASE);
+    }
+}
+
+/* write out everything queued for @p sink, unless another CPU is already at it */
+static void klog_sink_drain(struct klog_sink *sink)
+{
+    do {
+        if (__atomic_exchange_n(&sink->draining, 1, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+
+        uint64_t tail = sink->tail;
+        while (tail != __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE)) {
+            uint16_t len;
+            size_t offset = tail & (KLOG_SINK_FIFO_SIZE - 1);
+            if (offset + sizeof(len) <= KLOG_SINK_FIFO_SIZE) {
+                memcpy(&len, sink->fifo + offset, sizeof(len));
+            } else {
+                ((char *)&len)[0] = sink->fifo[KLOG_SINK_FIFO_SIZE - 1];
+                ((char *)&len)[1] = sink->fifo[0];
+            }
+
+            offset = (tail + sizeof(len)) & (KLOG_SINK_FIFO_SIZE - 1);
+            const size_t first = len < KLOG_SINK_FIFO_SIZE - offset ? len : KLOG_SINK_FIFO_SIZE - offset;
+            sink->write(sink->fifo + offset, first);
+            if (first < len) {
+                sink->write(sink->fifo, len - first);
+            }
+
+            tail += sizeof(len) + len;
+            __atomic_store_n(&sink->tail, tail, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&sink->written, 1, __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&sink->draining, 0, __ATOMIC_RELEASE);
+    } while (sink->tail != __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE));
+}
+
+void klog_flush(void)
+{
+    do {
+        if (__atomic_exchange_n(&klog_draining, 1, __ATOMIC_ACQUIRE)) {
+            return; /* the current reader will pick our records up */
+        }
+
+        for (;;) {
+            struct klog_ring *oldest_ring = NULL;
+            struct klog_record *oldest = NULL;
+
+            for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+                struct klog_record *record = klog_ring_peek(&klog_rings[cpu]);
+                if (record && (!oldest || (int64_t)(record->tsc - oldest->tsc) < 0)) {
+                    oldest = record;
+                    oldest_ring = &klog_rings[cpu];
+                }
+            }
+            if (!oldest) {
+                break;
+            }
+
+            klog_route(oldest);
+            __atomic_store_n(&oldest_ring->tail, oldest_ring->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        __atomic_store_n(&klog_draining, 0, __ATOMIC_RELEASE);
+
+        const int count = __atomic_load_n(&klog_sink_count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < count; i++) {
+            if (!klog_sinks[i].async) {
+                klog_sink_drain(&klog_sinks[i]);
+            }
+        }
+        /* a record committed after our last scan but before the release would be stranded */
+    } while (klog_pending());
+}
+
+static inline size_t klog_tag_hash_index(const char *tag)
+{
+    return (size_t)(((uintptr_t)tag * 0x9E3779B97F4A7C15ULL) >> 56) & (KLOG_TAG_HASH_SIZE - 1);
+}
+
+/* level of @p tag by name; called with klog_level_lock held */
+static klog_level_t klog_level_resolve(const char *tag)
+{
+    for (size_t i = 0; i < klog_tag_level_count; i++) {
+        if (!strcmp(klog_tag_levels[i].name, tag)) {
+            return klog_tag_levels[i].level;
+        }
+    }
+    return klog_default_level;
+}
+
+int klog_level_set(const char *tag, klog_level_t level)
+{
+    const bool is_default = !strcmp(tag, "*");
+    int ret = 0;
+
+    if (strlen(tag) >= KLOG_TAG_NAME_MAX) {
+        return -1;
+    }
+
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&klog_level_lock);
+
+    if (is_default) {
+        klog_default_level = level;
+    } else {
+        size_t i;
+        for (i = 0; i < klog_tag_level_count; i++) {
+            if (!strcmp(klog_tag_levels[i].name, tag)) {
+                break;
+            }
+        }
+        if (i == klog_tag_level_count) {
+            if (i == KLOG_TAG_LEVELS_MAX) {
+                ret = -1;
+                goto out;
+            }
+            memcpy(klog_tag_levels[i].name, tag, strlen(tag) + 1);
+            klog_tag_level_count++;
+        }
+        klog_tag_levels[i].level = level;
+    }
+
+    for (size_t i = 0; i < KLOG_TAG_HASH_SIZE; i++) {
+        if (klog_tag_hash[i].tag) {
+            __atomic_store_n(&klog_tag_hash[i].level, (uint8_t)klog_level_resolve(klog_tag_hash[i].tag), __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&klog_level_generation, 1, __ATOMIC_RELEASE);
+
+    klog_level_t max_level = klog_default_level;
+    for (size_t i = 0; i < klog_tag_level_count; i++) {
+        if (klog_tag_levels[i].level > max_level) {
+            max_level = klog_tag_levels[i].level;
+        }
+    }
+    for (int l = KLOG_LEVEL_ERROR; l <= KLOG_LEVEL_VERBOSE; l++) {
+        if (l <= (int)max_level) {
+            if (!static_key_enable(&klog_level_keys[l])) {
+                ret = -1; /* the sites of level l stay off */
+            }
+        } else {
+            /* a key left on only costs the call site cache lookup */
+            static_key_disable(&klog_level_keys[l]);
+        }
+    }
+
+out:
+    spin_unlock(&klog_level_lock);
+    arch_irq_restore(flags);
+    return ret;
+}
+
+klog_level_t klog_level_get(const char *tag)
+{
+    const size_t start = klog_tag_hash_index(tag);
+    size_t i = start;
+
+    do {
+        const char *entry = __atomic_load_n(&klog_tag_hash[i].tag, __ATOMIC_ACQUIRE);
+        if (entry == tag) {
+            return (klog_level_t)__atomic_load_n(&klog_tag_hash[i].level, __ATOMIC_RELAXED);
+        }
+        if (!entry) {
+            break;
+        }
+        i = (i + 1) & (KLOG_TAG_HASH_SIZE - 1);
+    } while (i != start);
+
+    /* first time this address is seen (or the table is full) */
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&klog_level_lock);
+
+    const klog_level_t level = klog_level_resolve(tag);
+    i = start;
+    do {
+        if (klog_tag_hash[i].tag == tag) {
+            break;
+        }
+        if (!klog_tag_hash[i].tag) {
+            klog_tag_hash[i].level = (uint8_t)level;
+            __atomic_store_n(&klog_tag_hash[i].tag, tag, __ATOMIC_RELEASE);
+            break;
+        }
+        i = (i + 1) & (KLOG_TAG_HASH_SIZE - 1);
+    } while (i != start);
+
+    spin_unlock(&klog_level_lock);
+    arch_irq_restore(flags);
+    return level;
+}
+
+klog_level_t klog_level_cache_fill(struct klog_level_cache *cache, const char *tag)
+{
+    const uint32_t generation = __atomic_load_n(&klog_level_generation, __ATOMIC_ACQUIRE);
+    const klog_level_t level = klog_level_get(tag);
+
+    /* invalidate before the tag changes, publish after; a klog_level_set() in between
+     * leaves a stale generation, which makes the next call fill again */
+    __atomic_store_n(&cache->state, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->tag, tag, __ATOMIC_RELEASE);
+    __atomic_store_n(&cache->state, (uint64_t)generation << 8 | (uint8_t)level, __ATOMIC_RELEASE);
+    return level;
+}
+
+uint64_t klog_dropped(void)
+{
+    uint64_t dropped = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        dropped += __atomic_load_n(&klog_rings[cpu].dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+int klog_sink_add(const char *name, write_like_t write, klog_level_t level, uint32_t rate_limit, bool async)
+{
+    int sink = -1;
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&klog_sink_lock);
+
+    if (klog_sink_count < KLOG_MAX_SINKS) {
+        sink = klog_sink_count;
+        klog_sinks[sink] = (struct klog_sink){
+            .name = name,
+            .write = write,
+            .level = (uint8_t)level,
+            .async = async,
+            .rate_limit = rate_limit,
+            .tokens = rate_limit,
+            .refill_tsc = arch_tsc_read(),
+        };
+        __atomic_store_n(&klog_sink_count, sink + 1, __ATOMIC_RELEASE);
+    }
+
+    spin_unlock(&klog_sink_lock);
+    arch_irq_restore(flags);
+    return sink;
+}
+
+void klog_sink_set_level(int sink, klog_level_t level)
+{
+    if (sink >= 0 && sink < __atomic_load_n(&klog_sink_count, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&klog_sinks[sink].level, (uint8_t)level, __ATOMIC_RELAXED);
+    }
+}
 
-    // klog_level_t level_for_tag = s_log_level_get_and_unlock(tag);
-    // if (!should_output(level, level_for_tag)) {
-    //     return;
-    // }
+int klog_sink_stats(int sink, klog_sink_stats_t *stats)
+{
+    if (sink < 0 || sink >= __atomic_load_n(&klog_sink_count, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    const struct klog_sink *s = &klog_sinks[sink];
+    stats->written = __atomic_load_n(&s->written, __ATOMIC_RELAXED);
+    stats->queued = __atomic_load_n(&s->enqueued, __ATOMIC_RELAXED) - stats->written;
+    stats->dropped = __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+    stats->rate_limited = __atomic_load_n(&s->rate_limited, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    (*s_log_print_func)(format, args);
-    // spinlock.unlock
+void klog_sink_set_flush(int sink, bool (*flush)(void))
+{
+    if (sink >= 0 && sink < __atomic_load_n(&klog_sink_count, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&klog_sinks[sink].flush, flush, __ATOMIC_RELEASE);
+    }
+}
 
+/* push out what the device behind @p sink holds; whether it still has something */
+static bool klog_sink_flush(struct klog_sink *sink)
+{
+    bool (*flush)(void) = __atomic_load_n(&sink->flush, __ATOMIC_ACQUIRE);
+    if (!flush) {
+        return false;
+    }
+    /* the flush hook is serialized with the write function, by the same flag */
+    if (__atomic_exchange_n(&sink->draining, 1, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    const bool pending = flush();
+    __atomic_store_n(&sink->draining, 0, __ATOMIC_RELEASE);
+    return pending;
 }
 
-vprintf_like_t klog_set_vprintf(vprintf_like_t func)
+bool klog_poll(void)
 {
-    // spinlock.lock
-    vprintf_like_t orig_func = s_log_print_func;
-    s_log_print_func = func;
-    // spinlock.unlock
-    return orig_func;
+    klog_flush();
+
+    bool pending = false;
+    const int count = __atomic_load_n(&klog_sink_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        struct klog_sink *sink = &klog_sinks[i];
+        if (sink->async) {
+            klog_sink_drain(sink);
+        }
+        if (klog_sink_flush(sink) ||
+            __atomic_load_n(&sink->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&sink->head, __ATOMIC_ACQUIRE)) {
+            pending = true;
+        }
+    }
+    return pending || klog_pending();
 }
 
+void klog_sync(void)
+{
+    /* give up after about a second: the sink may be gone, or its drain interrupted on this CPU */
+    const uint64_t timeout = arch_cpu_mhz() * 1000000;
+    const uint64_t start = __rdtsc();
+    while (klog_poll() && __rdtsc() - start < timeout) {
+        _mm_pause();
+    }
+}
+
+#define KLOG_TIMESTAMP_NESTING 4 /* power of two, so the uint8_t counter wraps cleanly */
+
 char *klog_system_timestamp(void)
 {
-    static char buffer[32] = {0};
-    date_t date = read_rtc();
-    snprintf(buffer,sizeof(buffer),"%02d:%02d:%02d",date.hour,date.minute,date.second);
-    return buffer; // not thread safe yet
-}
\ No newline at end of file
+    /* a few buffers per CPU, so an interrupt that logs does not clobber the
+     * timestamp of the message it interrupted before that got formatted */
+    static char buffers[MAX_CPUS][KLOG_TIMESTAMP_NESTING][sizeof("HH:MM:SS.uuuuuu")];
+    static uint8_t next_buffer[MAX_CPUS];
+    const int cpu = arch_cpu_id();
+    const uint8_t slot = __atomic_fetch_add(&next_buffer[cpu], 1, __ATOMIC_RELAXED) % KLOG_TIMESTAMP_NESTING;
+    char *buffer = buffers[cpu][slot];
+    uint64_t seconds, subseconds;
+
+    arch_tsc_to_time(arch_tsc_read(), &seconds, &subseconds);
+    seconds %= 86400;
+    snprintf(buffer, sizeof(buffers[0][0]), "%02u:%02u:%02u.%06u",
+             (unsigned int)(seconds / 3600), (unsigned int)(seconds / 60 % 60),
+             (unsigned int)(seconds % 60), (unsigned int)subseconds);
+    return buffer;
+}
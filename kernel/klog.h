@@ -1,5 +1,10 @@
 
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <misc/kprintf.h>
+#include <klog_trace.h>
+#include <kernel/static_key.h>
 
 /**
  * @brief Log level
@@ -13,7 +18,6 @@ typedef enum {
     KLOG_LEVEL_DEBUG,      /*!< Extra information which is not necessary for normal use (values, pointers, sizes, etc). */
     KLOG_LEVEL_VERBOSE     /*!< Bigger chunks of debugging information, or frequent messages which can potentially flood the output. */
 } klog_level_t;
-typedef int (*vprintf_like_t)(const char*, va_list);
 
 
 
@@ -21,9 +25,11 @@ typedef int (*vprintf_like_t)(const char*, va_list);
  * @brief Function which returns system timestamp to be used in log output
  *
  * This function is used in expansion of KLOGx macros to print
- * the system time as "HH:MM:SS.sss".
+ * the system time as "HH:MM:SS.uuuuuu". The time comes from the TSC,
+ * the CMOS clock is only read once at boot (arch_clock_initialize()).
  *
- * @return timestamp, in "HH:MM:SS.sss"
+ * @return timestamp, in "HH:MM:SS.uuuuuu", in a per-CPU buffer that is
+ *         reused by a later call on the same CPU
  */
 char* klog_system_timestamp(void);
 
@@ -33,7 +39,8 @@ char* klog_system_timestamp(void);
  * This function is not intended to be used directly. Instead, use one of
  * KLOGE, KLOGW, KLOGI, KLOGD, KLOGV macros.
  *
- * This function or these macros should not be used from an interrupt.
+ * The message is formatted into a record of the calling CPU's log ring and
+ * printed by klog_flush(). Lock-free, so it can be used from interrupts.
  */
 void klog_write(klog_level_t level, const char* tag, const char* format, ...) __attribute__((format(printf, 3, 4)));
 
@@ -46,7 +53,194 @@ void klog_write(klog_level_t level, const char* tag, const char* format, ...) __
  */
 void klog_writev(klog_level_t level, const char* tag, const char* format, va_list args);
 
-vprintf_like_t klog_set_vprintf(vprintf_like_t func);
+/**
+ * @brief Log output registered with klog_sink_add()
+ *
+ * Records that pass the tag level filter are copied, in timestamp order,
+ * into a FIFO of every sink whose level admits them. Synchronous sinks are
+ * written from klog_flush(); asynchronous ones only from klog_poll(), so a
+ * slow device (framebuffer, serial without a FIFO) never holds up a CPU
+ * that is just logging. A full FIFO drops the record for that sink only.
+ */
+typedef struct {
+    uint64_t queued;        /*!< records waiting in the sink FIFO */
+    uint64_t written;       /*!< records handed to the sink's write function */
+    uint64_t dropped;       /*!< records lost because the FIFO was full */
+    uint64_t rate_limited;  /*!< records suppressed by the rate limit */
+} klog_sink_stats_t;
+
+#define KLOG_MAX_SINKS      4
+#define KLOG_SINK_FIFO_SIZE 4096    /* bytes, power of two */
+
+/**
+ * @brief Register an output for log records
+ *
+ * The kprintf output (see kprintf_set_write()) is always registered as sink 0,
+ * "console", synchronous, at KLOG_LEVEL_VERBOSE.
+ *
+ * @param name       name for diagnostics
+ * @param write      called with one whole record (a formatted line) at a time
+ * @param level      most verbose level this sink receives
+ * @param rate_limit records per second, with a burst of as many; 0 for no limit
+ * @param async      only write from klog_poll()
+ * @return the sink number, or -1 if KLOG_MAX_SINKS are registered already
+ */
+int klog_sink_add(const char* name, write_like_t write, klog_level_t level, uint32_t rate_limit, bool async);
+
+void klog_sink_set_level(int sink, klog_level_t level);
+
+/**
+ * @brief Copy the counters of @p sink into @p stats
+ * @return 0, or -1 if there is no such sink
+ */
+int klog_sink_stats(int sink, klog_sink_stats_t* stats);
+
+/**
+ * @brief Have @p flush called after each drain of @p sink
+ *
+ * For sinks whose write function only queues: @p flush pushes out what the
+ * device still holds and returns whether anything is left. It is never
+ * called concurrently with the sink's write function.
+ */
+void klog_sink_set_flush(int sink, bool (*flush)(void));
+
+/**
+ * @brief Write out what the asynchronous sinks have queued
+ *
+ * Call it from wherever the CPU has time to spare (idle loop, timer tick).
+ * Like klog_flush() it skips sinks that another CPU is draining.
+ *
+ * @return whether output is still on its way, in a FIFO, a sink's device
+ *         or a sink being drained elsewhere
+ */
+bool klog_poll(void);
+
+/**
+ * @brief Poll until every record has left through the sinks, for at most about a second
+ *
+ * Works with interrupts disabled, for the last words before the system halts.
+ */
+void klog_sync(void);
+
+/**
+ * @brief Move all committed records of all CPUs to the sinks, oldest first,
+ *        and write out the synchronous sinks
+ *
+ * Called after every log message. Returns at once if another CPU is already
+ * draining the rings; that CPU will write our records too.
+ */
+void klog_flush(void);
+
+/**
+ * @brief Number of records dropped so far because a CPU's ring was full
+ */
+uint64_t klog_dropped(void);
+
+#define KLOG_RING_RECORDS 32    /* records per CPU ring */
+#define KLOG_PAYLOAD_SIZE 224   /* longest formatted message, including the NUL */
+
+
+/**
+ * @brief Set the runtime log level for @p tag
+ *
+ * Messages from @p tag with a level above @p level are suppressed. Tags are
+ * compared by content, so this also applies to identical tag strings at
+ * different addresses. "*" sets the level of all tags without their own
+ * setting; it defaults to KLOG_LEVEL_VERBOSE. KLOG_LOCAL_LEVEL still caps
+ * everything at compile time.
+ *
+ * @return 0 on success, -1 if @p tag is too long, too many tags have a level set,
+ *         or a level no tag had before would be needed after static_key_freeze()
+ */
+int klog_level_set(const char* tag, klog_level_t level);
+
+/**
+ * @brief Runtime log level of @p tag
+ *
+ * Looks the tag up by address in a hash table, falling back to comparing it
+ * against the tags passed to klog_level_set() the first time an address is seen.
+ */
+klog_level_t klog_level_get(const char* tag);
+
+/**
+ * @brief One key per level, enabled while any tag (or the "*" default) is at
+ *        that level or above
+ *
+ * KLOGx sites test them with static_key_true(), so a level no tag wants
+ * costs a single NOP. Maintained by klog_level_set().
+ */
+extern static_key_t klog_level_keys[KLOG_LEVEL_VERBOSE + 1];
+
+/**
+ * @brief Level of one tag as last seen by a single KLOGx call site
+ *
+ * Valid while the generation in state equals klog_level_generation, which
+ * every klog_level_set() call advances. Generation and level share one word,
+ * so a reader never pairs the level of one fill with the generation of another.
+ */
+struct klog_level_cache {
+    uint64_t state;      /* generation << 8 | level; 0 while being filled */
+    const char* tag;
+};
+
+extern uint32_t klog_level_generation;
+
+klog_level_t klog_level_cache_fill(struct klog_level_cache* cache, const char* tag);
+
+/**
+ * @brief Whether a message of @p level from @p tag passes the runtime filter
+ *
+ * Four loads and three compares while the call site cache is valid. Like a
+ * seqcount read, state is loaded again after the tag: if a fill for another
+ * tag ran in between, the level might not belong to the tag that was read.
+ */
+static inline bool klog_level_enabled(struct klog_level_cache* cache, const char* tag, klog_level_t level)
+{
+    const uint64_t state = __atomic_load_n(&cache->state, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(state >> 8 == __atomic_load_n(&klog_level_generation, __ATOMIC_RELAXED) &&
+                         __atomic_load_n(&cache->tag, __ATOMIC_ACQUIRE) == tag &&
+                         __atomic_load_n(&cache->state, __ATOMIC_RELAXED) == state, 1)) {
+        return level <= (klog_level_t)(uint8_t)state;
+    }
+    return level <= klog_level_cache_fill(cache, tag);
+}
+
+
+/**
+ * @brief Binary trace mode
+ *
+ * While enabled, KLOGx calls do not format anything. They record the format
+ * string address, the tag address, the raw argument words and a TSC stamp
+ * into a ring buffer, which klog_trace_dump() writes out for the host-side
+ * decoder (make -C kernel klogdecode). This only works because format
+ * strings and tags are literals that live in the kernel image.
+ *
+ * Limitations: "%s" arguments must point into the kernel image as well, and
+ * at most KLOG_TRACE_MAX_ARGS arguments are supported.
+ */
+extern static_key_t klog_trace_key;
+
+/**
+ * @brief Switch trace mode on or off
+ * @return 0, or -1 if the mode would have to change after static_key_freeze()
+ */
+int klog_trace_set_mode(bool enable);
+
+/**
+ * @brief Record one message in the trace ring
+ *
+ * Not intended to be used directly, the KLOGx macros call it in trace mode.
+ * Every variadic argument must be a uint64_t (see KLOG_TRACE_ARG).
+ * Lock-free, can be used from any context.
+ */
+void klog_trace(klog_level_t level, const char* tag, const char* format, unsigned int nargs, ...);
+
+/**
+ * @brief Write the trace ring (header followed by the records, oldest first) to @p out
+ *
+ * The output is binary; hosted/klogdecode.c turns it back into text.
+ */
+void klog_trace_dump(write_like_t out);
 
 
 #define CONFIG_LOG_COLORS 1
@@ -80,8 +274,48 @@ vprintf_like_t klog_set_vprintf(vprintf_like_t func);
 
 
 
+/* bytes of a promoted argument (floats become doubles) in one 64-bit trace word */
+#define KLOG_TRACE_ARG(x) ({                                                              \
+        __typeof__((x) + 0) _klog_v = (x);                                                \
+        uint64_t _klog_w = 0;                                                             \
+        if (__builtin_types_compatible_p(__typeof__(_klog_v), float)) {                  \
+            float _klog_f;                                                                \
+            __builtin_memcpy(&_klog_f, &_klog_v, sizeof(_klog_f));                        \
+            double _klog_d = _klog_f;                                                     \
+            __builtin_memcpy(&_klog_w, &_klog_d, sizeof(_klog_w));                        \
+        } else {                                                                          \
+            __builtin_memcpy(&_klog_w, &_klog_v, sizeof(_klog_v) < sizeof(_klog_w) ? sizeof(_klog_v) : sizeof(_klog_w)); \
+        }                                                                                 \
+        _klog_w;                                                                          \
+    })
+
+#define KLOG_NARGS(...) KLOG_NARGS_(0, ##__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define KLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, N, ...) N
+#define KLOG_CONCAT(a, b) KLOG_CONCAT_(a, b)
+#define KLOG_CONCAT_(a, b) a ## b
+
+/* expands to ", KLOG_TRACE_ARG(a1), KLOG_TRACE_ARG(a2), ..." */
+#define KLOG_TRACE_ARGS(...) KLOG_CONCAT(KLOG_TRACE_ARGS_, KLOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_0()
+#define KLOG_TRACE_ARGS_1(a)       , KLOG_TRACE_ARG(a)
+#define KLOG_TRACE_ARGS_2(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_1(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_3(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_2(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_4(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_3(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_5(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_4(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_6(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_5(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_7(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_6(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_8(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_7(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_9(a, ...)  , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_8(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_10(a, ...) , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_9(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_11(a, ...) , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_10(__VA_ARGS__)
+#define KLOG_TRACE_ARGS_12(a, ...) , KLOG_TRACE_ARG(a) KLOG_TRACE_ARGS_11(__VA_ARGS__)
+
 #define KLOG_LEVEL(level, tag, format, ...) do {                     \
-        if (level== KLOG_LEVEL_ERROR )          { klog_write(KLOG_LEVEL_ERROR,      tag, LOG_SYSTEM_TIME_FORMAT(E, format), klog_system_timestamp(), tag, ##__VA_ARGS__); } \
+        static struct klog_level_cache _klog_level_cache;            \
+        if (!static_key_true(&klog_level_keys[level]))               break; \
+        if (!klog_level_enabled(&_klog_level_cache, tag, level))     break; \
+        if (static_key_false(&klog_trace_key))  { klog_trace(level, tag, format, KLOG_NARGS(__VA_ARGS__) KLOG_TRACE_ARGS(__VA_ARGS__)); } \
+        else if (level== KLOG_LEVEL_ERROR )          { klog_write(KLOG_LEVEL_ERROR,      tag, LOG_SYSTEM_TIME_FORMAT(E, format), klog_system_timestamp(), tag, ##__VA_ARGS__); } \
         else if (level== KLOG_LEVEL_WARN )      { klog_write(KLOG_LEVEL_WARN,       tag, LOG_SYSTEM_TIME_FORMAT(W, format), klog_system_timestamp(), tag, ##__VA_ARGS__); } \
         else if (level== KLOG_LEVEL_DEBUG )     { klog_write(KLOG_LEVEL_DEBUG,      tag, LOG_SYSTEM_TIME_FORMAT(D, format), klog_system_timestamp(), tag, ##__VA_ARGS__); } \
         else if (level== KLOG_LEVEL_VERBOSE )   { klog_write(KLOG_LEVEL_VERBOSE,    tag, LOG_SYSTEM_TIME_FORMAT(V, format), klog_system_timestamp(), tag, ##__VA_ARGS__); } \
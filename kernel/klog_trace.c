@@ -0,0 +1,82 @@
+#include <klog.h>
+#include <klog_trace.h>
+#include <cpu.h>
+#include <kernel/arch/x86_64/cmos.h>
+#include <x86intrin.h>
+
+#define KLOG_TRACE_RECORDS 1024 /* must be a power of two */
+
+static_key_t klog_trace_key = STATIC_KEY_INIT_FALSE;
+
+static struct klog_trace_record trace_ring[KLOG_TRACE_RECORDS];
+static uint64_t trace_head; /* next sequence number to hand out */
+
+int klog_trace_set_mode(bool enable)
+{
+    const bool done = enable ? static_key_enable(&klog_trace_key) : static_key_disable(&klog_trace_key);
+    return done ? 0 : -1;
+}
+
+void klog_trace(klog_level_t level, const char *tag, const char *format, unsigned int nargs, ...)
+{
+    const uint64_t tsc = arch_tsc_read();
+    const uint64_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct klog_trace_record *record = &trace_ring[seq & (KLOG_TRACE_RECORDS - 1)];
+    va_list args;
+
+    /* mark the slot as in progress, so a concurrent dump skips it */
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->tsc = tsc;
+    record->format = (uintptr_t)format;
+    record->tag = (uintptr_t)tag;
+    record->level = (uint8_t)level;
+    record->nargs = (uint8_t)(nargs < KLOG_TRACE_MAX_ARGS ? nargs : KLOG_TRACE_MAX_ARGS);
+    record->cpu = (uint8_t)arch_cpu_id();
+
+    va_start(args, nargs);
+    for (unsigned int i = 0; i < record->nargs; i++) {
+        record->args[i] = va_arg(args, uint64_t);
+    }
+    va_end(args);
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void klog_trace_dump(write_like_t out)
+{
+    const uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    const uint64_t first = head > KLOG_TRACE_RECORDS ? head - KLOG_TRACE_RECORDS : 0;
+    uint32_t complete = 0;
+
+    for (uint64_t seq = first; seq < head; seq++) {
+        if (__atomic_load_n(&trace_ring[seq & (KLOG_TRACE_RECORDS - 1)].seq, __ATOMIC_ACQUIRE) == seq + 1) {
+            complete++;
+        }
+    }
+
+    struct klog_trace_header header = {
+        .magic = KLOG_TRACE_MAGIC,
+        .record_size = sizeof(struct klog_trace_record),
+        .record_count = complete,
+        .tsc_mhz = arch_cpu_mhz(),
+        .lost = first,
+    };
+    out((const char *)&header, sizeof(header));
+
+    /* oldest first; records that were rewritten meanwhile are skipped, so
+     * fewer than record_count may follow if producers are still running */
+    for (uint64_t seq = first; seq < head && complete; seq++) {
+        const struct klog_trace_record *record = &trace_ring[seq & (KLOG_TRACE_RECORDS - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) == seq + 1) {
+            out((const char *)record, sizeof(*record));
+            complete--;
+        }
+    }
+    /* keep the stream well formed if records went missing during the dump */
+    static const struct klog_trace_record empty;
+    while (complete--) {
+        out((const char *)&empty, sizeof(empty));
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * On-the-wire layout of the klog binary trace, shared by the kernel and the
+ * host-side decoder (hosted/klogdecode.c). Keep this header free of kernel
+ * dependencies.
+ */
+
+#include <stdint.h>
+
+#define KLOG_TRACE_MAGIC    "KLOGTRC1"
+#define KLOG_TRACE_MAX_ARGS 12
+
+/**
+ * @brief Header written in front of the records by klog_trace_dump()
+ */
+struct klog_trace_header {
+    char     magic[8];      /*!< KLOG_TRACE_MAGIC, not NUL terminated */
+    uint32_t record_size;   /*!< sizeof(struct klog_trace_record) */
+    uint32_t record_count;  /*!< number of records following the header */
+    uint64_t tsc_mhz;       /*!< TSC rate, to turn record timestamps into time */
+    uint64_t lost;          /*!< records overwritten before they were dumped */
+} __attribute__((packed));
+
+/**
+ * @brief One deferred KLOGx call
+ *
+ * The format string and the tag are not copied; they are stored as addresses
+ * into the kernel image and resolved by the decoder against kernel.elf.
+ * Each argument is stored in one 64-bit word holding the bytes of the
+ * (promoted) argument value.
+ */
+struct klog_trace_record {
+    uint64_t seq;       /*!< sequence number + 1 once complete, anything else while being written */
+    uint64_t tsc;       /*!< TSC when the call was made */
+    uint64_t format;    /*!< address of the format string */
+    uint64_t tag;       /*!< address of the tag string */
+    uint8_t  level;     /*!< klog_level_t */
+    uint8_t  nargs;     /*!< number of valid entries in args */
+    uint8_t  cpu;       /*!< CPU that made the call */
+    uint8_t  _reserved[5];
+    uint64_t args[KLOG_TRACE_MAX_ARGS];
+} __attribute__((packed));
@@ -0,0 +1,250 @@
+#include <kernel/checksum.h>
+#include <cpuid.h>
+#include <stdbool.h>
+#include <x86intrin.h>
+
+#define CRC32C_POLY 0x82f63b78U /* reflected Castagnoli polynomial */
+
+/*
+ * The hardware CRC runs three independent crc32 streams over consecutive
+ * blocks so the 3-cycle latency of the instruction is hidden, then folds
+ * the partial CRCs together with the "append N zero bytes" operator below.
+ */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];      /* slicing-by-8 tables */
+static uint32_t crc32c_long[4][256];       /* shift a crc over CRC32C_LONG zero bytes */
+static uint32_t crc32c_short[4][256];      /* shift a crc over CRC32C_SHORT zero bytes */
+
+static bool crc32c_tables_ready;
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *data, size_t len) = crc32c_sw;
+
+/* multiply the 32x32 GF(2) matrix @p mat by the vector @p vec */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* build the operator matrix that appends @p len zero bytes to a crc */
+static void crc32c_zeros_op(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+    uint32_t row = 1;
+
+    odd[0] = CRC32C_POLY; /* operator for one zero bit */
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2_matrix_square(even, odd); /* two zero bits */
+    gf2_matrix_square(odd, even); /* four zero bits */
+
+    /* each square doubles the zero count, starting at one byte */
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+
+    for (int n = 0; n < 32; n++)
+        even[n] = odd[n];
+}
+
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+    uint32_t op[32];
+
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_build_tables(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    __atomic_store_n(&crc32c_tables_ready, true, __ATOMIC_RELEASE);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *next = data;
+
+    /* a caller from before checksum_initialize() would otherwise get a CRC over all-zero tables */
+    if (__builtin_expect(!__atomic_load_n(&crc32c_tables_ready, __ATOMIC_ACQUIRE), 0))
+        crc32c_build_tables();
+
+    crc = ~crc;
+    while (len && ((uintptr_t)next & 7)) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *next++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word = *(const uint64_t *)next ^ crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *next++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *next = data;
+    const uint8_t *end;
+    uint64_t crc0, crc1, crc2;
+
+    crc0 = (uint32_t)~crc;
+    while (len && ((uintptr_t)next & 7)) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+
+    /* three interleaved streams over CRC32C_LONG-sized blocks */
+    while (len >= CRC32C_LONG * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + CRC32C_LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + CRC32C_LONG));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + 2 * CRC32C_LONG));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+        next += CRC32C_LONG * 2;
+        len -= CRC32C_LONG * 3;
+    }
+
+    /* same again with smaller blocks for what is left */
+    while (len >= CRC32C_SHORT * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + CRC32C_SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + CRC32C_SHORT));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + 2 * CRC32C_SHORT));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        next += CRC32C_SHORT * 2;
+        len -= CRC32C_SHORT * 3;
+    }
+
+    while (len >= 8) {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+    return ~(uint32_t)crc0;
+}
+
+void checksum_initialize(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    crc32c_build_tables();
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        crc32c_impl = crc32c_hw;
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return crc32c_impl(crc, data, len);
+}
+
+uint8_t checksum8(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t sum = 0;
+
+    while (len && ((uintptr_t)p & 15)) {
+        sum += *p++;
+        len--;
+    }
+
+    /* psadbw against zero adds each 8-byte half into a 64-bit lane */
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    while (len >= 64) {
+        const __m128i *v = (const __m128i *)p;
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128(v + 0), zero));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128(v + 1), zero));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128(v + 2), zero));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128(v + 3), zero));
+        p += 64;
+        len -= 64;
+    }
+    while (len >= 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128((const __m128i *)p), zero));
+        p += 16;
+        len -= 16;
+    }
+    sum += (uint64_t)_mm_cvtsi128_si64(acc) +
+           (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+
+    while (len--)
+        sum += *p++;
+    return (uint8_t)sum;
+}
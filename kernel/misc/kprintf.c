@@ -1,14 +1,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <kernel/string.h>
 #include <misc/kprintf.h>
 
-void kprintf_default_putchar(char){}
-putchar_like_t _putchar = kprintf_default_putchar;
+void kprintf_default_write(const char*, size_t){}
+write_like_t _write = kprintf_default_write;
 
-void kprintf_set_putchar(putchar_like_t fn)
+void kprintf_set_write(write_like_t fn)
 {
-    _putchar = fn;
+    _write = fn;
 }
 
 
@@ -94,51 +95,73 @@ void kprintf_set_putchar(putchar_like_t fn)
 #endif
 
 
-// output function type
-typedef void (*out_fct_type)(char character, void* buffer, size_t idx, size_t maxlen);
+// output function type, receives 'len' characters that belong at position 'idx'
+typedef void (*out_fct_type)(const char* str, size_t len, void* buffer, size_t idx, size_t maxlen);
 
 
 // wrapper (used as buffer) for output function type
 typedef struct {
-  void  (*fct)(char character, void* arg);
+  void  (*fct)(const char* str, size_t len, void* arg);
   void* arg;
 } out_fct_wrap_type;
 
 
 // internal buffer output
-static inline void _out_buffer(char character, void* buffer, size_t idx, size_t maxlen)
+static void _out_buffer(const char* str, size_t len, void* buffer, size_t idx, size_t maxlen)
 {
   if (idx < maxlen) {
-    ((char*)buffer)[idx] = character;
+    memcpy((char*)buffer + idx, str, len < maxlen - idx ? len : maxlen - idx);
   }
 }
 
 
 // internal null output
-static inline void _out_null(char character, void* buffer, size_t idx, size_t maxlen)
+static void _out_null(const char* str, size_t len, void* buffer, size_t idx, size_t maxlen)
 {
-  (void)character; (void)buffer; (void)idx; (void)maxlen;
+  (void)str; (void)len; (void)buffer; (void)idx; (void)maxlen;
 }
 
 
-// internal _putchar wrapper
-static inline void _out_char(char character, void* buffer, size_t idx, size_t maxlen)
+// internal _write wrapper
+static void _out_char(const char* str, size_t len, void* buffer, size_t idx, size_t maxlen)
 {
   (void)buffer; (void)idx; (void)maxlen;
-  if (character) {
-    _putchar(character);
-  }
+  _write(str, len);
 }
 
 
 // internal output function wrapper
-static inline void _out_fct(char character, void* buffer, size_t idx, size_t maxlen)
+static void _out_fct(const char* str, size_t len, void* buffer, size_t idx, size_t maxlen)
 {
   (void)idx; (void)maxlen;
-  if (character) {
-    // buffer is the output fct pointer
-    ((out_fct_wrap_type*)buffer)->fct(character, ((out_fct_wrap_type*)buffer)->arg);
+  // buffer is the output fct pointer
+  ((out_fct_wrap_type*)buffer)->fct(str, len, ((out_fct_wrap_type*)buffer)->arg);
+}
+
+
+// output a span of characters
+static inline size_t _out_str(out_fct_type out, char* buffer, size_t idx, size_t maxlen, const char* str, size_t len)
+{
+  if (len) {
+    out(str, len, buffer, idx, maxlen);
   }
+  return idx + len;
+}
+
+
+// output 'count' copies of the padding character 'ch' (' ' or '0')
+static size_t _out_pad(out_fct_type out, char* buffer, size_t idx, size_t maxlen, char ch, size_t count)
+{
+  static const char spaces[] = "                                ";
+  static const char zeros[]  = "00000000000000000000000000000000";
+  const char* pad = (ch == '0') ? zeros : spaces;
+
+  while (count) {
+    const size_t n = count < sizeof(spaces) - 1U ? count : sizeof(spaces) - 1U;
+    idx = _out_str(out, buffer, idx, maxlen, pad, n);
+    count -= n;
+  }
+  return idx;
 }
 
 
@@ -171,90 +194,178 @@ static unsigned int _atoi(const char** str)
 }
 
 
-// output the specified string in reverse, taking care of any zero-padding
-static size_t _out_rev(out_fct_type out, char* buffer, size_t idx, size_t maxlen, const char* buf, size_t len, unsigned int width, unsigned int flags)
+// output the specified string, padded with spaces up to the given width
+static size_t _out_padded(out_fct_type out, char* buffer, size_t idx, size_t maxlen, const char* buf, size_t len, unsigned int width, unsigned int flags)
 {
   const size_t start_idx = idx;
 
   // pad spaces up to given width
-  if (!(flags & FLAGS_LEFT) && !(flags & FLAGS_ZEROPAD)) {
-    for (size_t i = len; i < width; i++) {
-      out(' ', buffer, idx++, maxlen);
-    }
+  if (!(flags & FLAGS_LEFT) && !(flags & FLAGS_ZEROPAD) && (len < width)) {
+    idx = _out_pad(out, buffer, idx, maxlen, ' ', width - len);
   }
 
-  // reverse string
-  while (len) {
-    out(buf[--len], buffer, idx++, maxlen);
-  }
+  idx = _out_str(out, buffer, idx, maxlen, buf, len);
 
   // append pad spaces up to given width
-  if (flags & FLAGS_LEFT) {
-    while (idx - start_idx < width) {
-      out(' ', buffer, idx++, maxlen);
-    }
+  if ((flags & FLAGS_LEFT) && (idx - start_idx < width)) {
+    idx = _out_pad(out, buffer, idx, maxlen, ' ', width - (idx - start_idx));
   }
 
   return idx;
 }
 
 
+// output the specified string in reverse, taking care of any zero-padding
+static size_t _out_rev(out_fct_type out, char* buffer, size_t idx, size_t maxlen, const char* buf, size_t len, unsigned int width, unsigned int flags)
+{
+  char fwd[PRINTF_FTOA_BUFFER_SIZE];
+
+  for (size_t i = 0U; i < len; i++) {
+    fwd[i] = buf[len - 1U - i];
+  }
+  return _out_padded(out, buffer, idx, maxlen, fwd, len, width, flags);
+}
+
+
+// two-digit lookup table for decimal conversion
+static const char _dec_digits[200] = {
+  '0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+  '1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+  '2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+  '3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+  '4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+  '5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+  '6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+  '7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+  '8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+  '9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9'
+};
+
+
+// internal digit conversion
+// writes the digits of 'value' right-aligned so they end just before 'end', which
+// puts them in their final order without a reversal pass
+// \return The number of digits written (at most PRINTF_NTOA_BUFFER_SIZE)
+static inline size_t _ntoa_digits(char* end, unsigned long long value, unsigned int base, unsigned int flags)
+{
+  char* p = end;
+
+  if (base == 10U) {
+    // two digits per step; 64-bit divisions by the constant compile to a multiply-shift
+    while (value > UINT32_MAX) {
+      const unsigned long long q = value / 100U;
+      const unsigned int r = 2U * (unsigned int)(value - q * 100U);
+      p -= 2;
+      p[0] = _dec_digits[r];
+      p[1] = _dec_digits[r + 1U];
+      value = q;
+    }
+    // below 2^32 the quotient is (v * ceil(2^37 / 100)) >> 37, exact for all 32-bit v
+    uint32_t v = (uint32_t)value;
+    while (v >= 100U) {
+      const uint32_t q = (uint32_t)(((uint64_t)v * 0x51EB851FU) >> 37U);
+      const uint32_t r = 2U * (v - q * 100U);
+      p -= 2;
+      p[0] = _dec_digits[r];
+      p[1] = _dec_digits[r + 1U];
+      v = q;
+    }
+    if (v >= 10U) {
+      p -= 2;
+      p[0] = _dec_digits[2U * v];
+      p[1] = _dec_digits[2U * v + 1U];
+    }
+    else {
+      *--p = (char)('0' + v);
+    }
+  }
+  else {
+    // power of two bases: mask and shift, one digit per step
+    const char* xdigits = (flags & FLAGS_UPPERCASE) ? "0123456789ABCDEF" : "0123456789abcdef";
+    const unsigned int shift = (base == 16U) ? 4U : (base == 8U) ? 3U : 1U;
+    do {
+      *--p = xdigits[value & (base - 1U)];
+      value >>= shift;
+    } while (value && ((size_t)(end - p) < PRINTF_NTOA_BUFFER_SIZE));
+  }
+
+  return (size_t)(end - p);
+}
+
+
 // internal itoa format
+// 'buf' holds 'len' digits right-aligned in PRINTF_NTOA_BUFFER_SIZE bytes; padding,
+// prefix and sign are prepended in place
 static size_t _ntoa_format(out_fct_type out, char* buffer, size_t idx, size_t maxlen, char* buf, size_t len, bool negative, unsigned int base, unsigned int prec, unsigned int width, unsigned int flags)
 {
+  char* p = buf + PRINTF_NTOA_BUFFER_SIZE - len;
+
   // pad leading zeros
   if (!(flags & FLAGS_LEFT)) {
     if (width && (flags & FLAGS_ZEROPAD) && (negative || (flags & (FLAGS_PLUS | FLAGS_SPACE)))) {
       width--;
     }
-    while ((len < prec) && (len < PRINTF_NTOA_BUFFER_SIZE)) {
-      buf[len++] = '0';
+    size_t target = len;
+    if (target < prec) {
+      target = prec;
     }
-    while ((flags & FLAGS_ZEROPAD) && (len < width) && (len < PRINTF_NTOA_BUFFER_SIZE)) {
-      buf[len++] = '0';
+    if ((flags & FLAGS_ZEROPAD) && (target < width)) {
+      target = width;
+    }
+    if (target > PRINTF_NTOA_BUFFER_SIZE) {
+      target = PRINTF_NTOA_BUFFER_SIZE;
+    }
+    while (len < target) {
+      *--p = '0';
+      len++;
     }
   }
 
   // handle hash
   if (flags & FLAGS_HASH) {
     if (!(flags & FLAGS_PRECISION) && len && ((len == prec) || (len == width))) {
+      p++;
       len--;
       if (len && (base == 16U)) {
+        p++;
         len--;
       }
     }
-    if ((base == 16U) && !(flags & FLAGS_UPPERCASE) && (len < PRINTF_NTOA_BUFFER_SIZE)) {
-      buf[len++] = 'x';
-    }
-    else if ((base == 16U) && (flags & FLAGS_UPPERCASE) && (len < PRINTF_NTOA_BUFFER_SIZE)) {
-      buf[len++] = 'X';
+    if ((base == 16U) && (len < PRINTF_NTOA_BUFFER_SIZE)) {
+      *--p = (flags & FLAGS_UPPERCASE) ? 'X' : 'x';
+      len++;
     }
     else if ((base == 2U) && (len < PRINTF_NTOA_BUFFER_SIZE)) {
-      buf[len++] = 'b';
+      *--p = 'b';
+      len++;
     }
     if (len < PRINTF_NTOA_BUFFER_SIZE) {
-      buf[len++] = '0';
+      *--p = '0';
+      len++;
     }
   }
 
   if (len < PRINTF_NTOA_BUFFER_SIZE) {
     if (negative) {
-      buf[len++] = '-';
+      *--p = '-';
+      len++;
     }
     else if (flags & FLAGS_PLUS) {
-      buf[len++] = '+';  // ignore the space if the '+' exists
+      *--p = '+';  // ignore the space if the '+' exists
+      len++;
     }
     else if (flags & FLAGS_SPACE) {
-      buf[len++] = ' ';
+      *--p = ' ';
+      len++;
     }
   }
 
-  return _out_rev(out, buffer, idx, maxlen, buf, len, width, flags);
+  return _out_padded(out, buffer, idx, maxlen, p, len, width, flags);
 }
 
 
-// internal itoa for 'long' type
-static size_t _ntoa_long(out_fct_type out, char* buffer, size_t idx, size_t maxlen, unsigned long value, bool negative, unsigned long base, unsigned int prec, unsigned int width, unsigned int flags)
+// internal itoa, used for all integer sizes
+static size_t _ntoa(out_fct_type out, char* buffer, size_t idx, size_t maxlen, unsigned long long value, bool negative, unsigned int base, unsigned int prec, unsigned int width, unsigned int flags)
 {
   char buf[PRINTF_NTOA_BUFFER_SIZE];
   size_t len = 0U;
@@ -266,39 +377,25 @@ static size_t _ntoa_long(out_fct_type out, char* buffer, size_t idx, size_t maxl
 
   // write if precision != 0 and value is != 0
   if (!(flags & FLAGS_PRECISION) || value) {
-    do {
-      const char digit = (char)(value % base);
-      buf[len++] = digit < 10 ? '0' + digit : (flags & FLAGS_UPPERCASE ? 'A' : 'a') + digit - 10;
-      value /= base;
-    } while (value && (len < PRINTF_NTOA_BUFFER_SIZE));
+    len = _ntoa_digits(buf + PRINTF_NTOA_BUFFER_SIZE, value, base, flags);
   }
 
-  return _ntoa_format(out, buffer, idx, maxlen, buf, len, negative, (unsigned int)base, prec, width, flags);
+  return _ntoa_format(out, buffer, idx, maxlen, buf, len, negative, base, prec, width, flags);
 }
 
 
-// internal itoa for 'long long' type
-#if defined(PRINTF_SUPPORT_LONG_LONG)
-static size_t _ntoa_long_long(out_fct_type out, char* buffer, size_t idx, size_t maxlen, unsigned long long value, bool negative, unsigned long long base, unsigned int prec, unsigned int width, unsigned int flags)
+// internal itoa for 'long' type
+static inline size_t _ntoa_long(out_fct_type out, char* buffer, size_t idx, size_t maxlen, unsigned long value, bool negative, unsigned long base, unsigned int prec, unsigned int width, unsigned int flags)
 {
-  char buf[PRINTF_NTOA_BUFFER_SIZE];
-  size_t len = 0U;
-
-  // no hash for 0 values
-  if (!value) {
-    flags &= ~FLAGS_HASH;
-  }
+  return _ntoa(out, buffer, idx, maxlen, value, negative, (unsigned int)base, prec, width, flags);
+}
 
-  // write if precision != 0 and value is != 0
-  if (!(flags & FLAGS_PRECISION) || value) {
-    do {
-      const char digit = (char)(value % base);
-      buf[len++] = digit < 10 ? '0' + digit : (flags & FLAGS_UPPERCASE ? 'A' : 'a') + digit - 10;
-      value /= base;
-    } while (value && (len < PRINTF_NTOA_BUFFER_SIZE));
-  }
 
-  return _ntoa_format(out, buffer, idx, maxlen, buf, len, negative, (unsigned int)base, prec, width, flags);
+// internal itoa for 'long long' type
+#if defined(PRINTF_SUPPORT_LONG_LONG)
+static inline size_t _ntoa_long_long(out_fct_type out, char* buffer, size_t idx, size_t maxlen, unsigned long long value, bool negative, unsigned long long base, unsigned int prec, unsigned int width, unsigned int flags)
+{
+  return _ntoa(out, buffer, idx, maxlen, value, negative, (unsigned int)base, prec, width, flags);
 }
 #endif  // PRINTF_SUPPORT_LONG_LONG
 
@@ -535,12 +632,12 @@ static size_t _etoa(out_fct_type out, char* buffer, size_t idx, size_t maxlen, d
   // output the exponent part
   if (minwidth) {
     // output the exponential symbol
-    out((flags & FLAGS_UPPERCASE) ? 'E' : 'e', buffer, idx++, maxlen);
+    idx = _out_str(out, buffer, idx, maxlen, (flags & FLAGS_UPPERCASE) ? "E" : "e", 1U);
     // output the exponent value
     idx = _ntoa_long(out, buffer, idx, maxlen, (expval < 0) ? -expval : expval, expval < 0, 10, 0, minwidth-1, FLAGS_ZEROPAD | FLAGS_PLUS);
     // might need to right-pad spaces
-    if (flags & FLAGS_LEFT) {
-      while (idx - start_idx < width) out(' ', buffer, idx++, maxlen);
+    if ((flags & FLAGS_LEFT) && (idx - start_idx < width)) {
+      idx = _out_pad(out, buffer, idx, maxlen, ' ', width - (idx - start_idx));
     }
   }
   return idx;
@@ -564,9 +661,10 @@ static int _vsnprintf(out_fct_type out, char* buffer, const size_t maxlen, const
   {
     // format specifier?  %[flags][width][.precision][length]
     if (*format != '%') {
-      // no
-      out(*format, buffer, idx++, maxlen);
-      format++;
+      // no, output the whole literal run up to the next specifier at once
+      const char* literal = format;
+      format = strchrnul(format, '%');
+      idx = _out_str(out, buffer, idx, maxlen, literal, (size_t)(format - literal));
       continue;
     }
     else {
@@ -750,20 +848,16 @@ static int _vsnprintf(out_fct_type out, char* buffer, const size_t maxlen, const
 #endif  // PRINTF_SUPPORT_EXPONENTIAL
 #endif  // PRINTF_SUPPORT_FLOAT
       case 'c' : {
-        unsigned int l = 1U;
+        const char c = (char)va_arg(va, int);
         // pre padding
-        if (!(flags & FLAGS_LEFT)) {
-          while (l++ < width) {
-            out(' ', buffer, idx++, maxlen);
-          }
+        if (!(flags & FLAGS_LEFT) && (width > 1U)) {
+          idx = _out_pad(out, buffer, idx, maxlen, ' ', width - 1U);
         }
         // char output
-        out((char)va_arg(va, int), buffer, idx++, maxlen);
+        idx = _out_str(out, buffer, idx, maxlen, &c, 1U);
         // post padding
-        if (flags & FLAGS_LEFT) {
-          while (l++ < width) {
-            out(' ', buffer, idx++, maxlen);
-          }
+        if ((flags & FLAGS_LEFT) && (width > 1U)) {
+          idx = _out_pad(out, buffer, idx, maxlen, ' ', width - 1U);
         }
         format++;
         break;
@@ -776,20 +870,14 @@ static int _vsnprintf(out_fct_type out, char* buffer, const size_t maxlen, const
         if (flags & FLAGS_PRECISION) {
           l = (l < precision ? l : precision);
         }
-        if (!(flags & FLAGS_LEFT)) {
-          while (l++ < width) {
-            out(' ', buffer, idx++, maxlen);
-          }
+        if (!(flags & FLAGS_LEFT) && (l < width)) {
+          idx = _out_pad(out, buffer, idx, maxlen, ' ', width - l);
         }
         // string output
-        while ((*p != 0) && (!(flags & FLAGS_PRECISION) || precision--)) {
-          out(*(p++), buffer, idx++, maxlen);
-        }
+        idx = _out_str(out, buffer, idx, maxlen, p, l);
         // post padding
-        if (flags & FLAGS_LEFT) {
-          while (l++ < width) {
-            out(' ', buffer, idx++, maxlen);
-          }
+        if ((flags & FLAGS_LEFT) && (l < width)) {
+          idx = _out_pad(out, buffer, idx, maxlen, ' ', width - l);
         }
         format++;
         break;
@@ -814,19 +902,21 @@ static int _vsnprintf(out_fct_type out, char* buffer, const size_t maxlen, const
       }
 
       case '%' :
-        out('%', buffer, idx++, maxlen);
+        idx = _out_str(out, buffer, idx, maxlen, "%", 1U);
         format++;
         break;
 
       default :
-        out(*format, buffer, idx++, maxlen);
+        idx = _out_str(out, buffer, idx, maxlen, format, 1U);
         format++;
         break;
     }
   }
 
-  // termination
-  out((char)0, buffer, idx < maxlen ? idx : maxlen - 1U, maxlen);
+  // termination, only buffer outputs get a terminating \0
+  if ((out == _out_buffer) && maxlen) {
+    buffer[idx < maxlen ? idx : maxlen - 1U] = '\0';
+  }
 
   // return written chars without terminating \0
   return (int)idx;
@@ -879,7 +969,7 @@ int vsnprintf(char* buffer, size_t count, const char* format, va_list va)
 }
 
 
-int fctprintf(void (*out)(char character, void* arg), void* arg, const char* format, ...)
+int fctprintf(void (*out)(const char* buf, size_t len, void* arg), void* arg, const char* format, ...)
 {
   va_list va;
   va_start(va, format);
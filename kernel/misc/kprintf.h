@@ -8,22 +8,23 @@
 extern "C" {
 #endif
 
-typedef void (*putchar_like_t)(char);
+typedef void (*write_like_t)(const char* buf, size_t len);
 
 /**
- * Output a character to a custom device like UART, used by the printf() function
- * This function is declared here only. You have to write your custom implementation somewhere
- * \param character Character to output
+ * Output characters to a custom device like UART, used by the printf() function
+ * Set it with kprintf_set_write(); output is discarded until then
+ * \param buf Characters to output
+ * \param len Number of characters in buf
  */
-extern putchar_like_t _putchar;
+extern write_like_t _write;
 
 
-void kprintf_set_putchar(putchar_like_t fn);
+void kprintf_set_write(write_like_t fn);
 
 
 /**
  * Tiny printf implementation
- * You have to implement _putchar if you use printf()
+ * Output goes to the _write sink, see kprintf_set_write()
  * To avoid conflicts with the regular printf() API it is overridden by macro defines
  * and internal underscore-appended functions like printf_() are used
  * \param format A string that specifies the format of the output
@@ -67,13 +68,13 @@ int vprintf(const char* format, va_list va);
 
 /**
  * printf with output function
- * You may use this as dynamic alternative to printf() with its fixed _putchar() output
- * \param out An output function which takes one character and an argument pointer
+ * You may use this as dynamic alternative to printf() with its fixed _write() output
+ * \param out An output function which takes a run of characters, its length and an argument pointer
  * \param arg An argument pointer for user data passed to output function
  * \param format A string that specifies the format of the output
  * \return The number of characters that are sent to the output function, not counting the terminating null character
  */
-int fctprintf(void (*out)(char character, void* arg), void* arg, const char* format, ...);
+int fctprintf(void (*out)(const char* buf, size_t len, void* arg), void* arg, const char* format, ...);
 
 
 #ifdef __cplusplus
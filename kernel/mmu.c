@@ -1,5 +1,7 @@
 
 #include <kernel/types.h>
+#include <kernel/mmu.h>
+#include <cpuid.h>
 
 typedef union {
     struct {
@@ -24,4 +26,72 @@ typedef union {
 #define PAGE_SIZE 4096
 #define _pagemap __attribute__((aligned(PAGE_SIZE))) = {0}
 page_t paging_pml4t[512] _pagemap;
-page_t paging_pdpt[512] _pagemap;
\ No newline at end of file
+page_t paging_pdpt[512] _pagemap;
+
+/* page directories for the 2nd to 4th GiB, filled in by mmu_map_mmio() */
+page_t paging_high_pd[3][512] _pagemap;
+
+enum
+{
+    PAGE_PRESENT = (1 << 0),
+    PAGE_WRITABLE = (1 << 1),
+    PAGE_WRITETHROUGH = (1 << 3), // PWT, selects PAT entry 1 with PCD=0
+    PAGE_NOCACHE = (1 << 4),      // PCD
+    PAGE_SIZE_BIT = (1 << 7),
+};
+
+#define LARGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define GIB             (1024UL * 1024 * 1024)
+
+void mmu_init(void)
+{
+    enum
+    {
+        IA32_PAT = 0x277,
+        PAT_TYPE_WC = 0x01,
+    };
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 16))) {
+        return; /* no PAT */
+    }
+
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(IA32_PAT));
+    lo = (lo & ~0xFF00U) | (PAT_TYPE_WC << 8);
+
+    /* nothing is mapped through entry 1 yet, but the SDM asks for flushed caches and TLBs */
+    asm volatile("wbinvd" ::: "memory");
+    asm volatile("wrmsr" : : "c"(IA32_PAT), "a"(lo), "d"(hi));
+    asm volatile("mov %%cr3, %%rax\n\tmov %%rax, %%cr3" ::: "rax", "memory");
+}
+
+void *mmu_map_mmio(uintptr_t phys, size_t size, int cache)
+{
+    if (!size || phys + size > 4 * GIB || phys + size < phys) {
+        return NULL;
+    }
+    if (phys < GIB) {
+        /* covered by the boot mapping, which is write-back */
+        return (phys + size <= GIB && cache == MMU_CACHE_WB) ? (void *)phys : NULL;
+    }
+
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_SIZE_BIT;
+    if (cache == MMU_CACHE_WC) {
+        flags |= PAGE_WRITETHROUGH;
+    } else if (cache == MMU_CACHE_UC) {
+        flags |= PAGE_WRITETHROUGH | PAGE_NOCACHE;
+    }
+
+    for (uintptr_t addr = phys & ~(LARGE_PAGE_SIZE - 1); addr < phys + size; addr += LARGE_PAGE_SIZE) {
+        const size_t gib = addr / GIB;
+        page_t *pd = paging_high_pd[gib - 1];
+
+        if (!paging_pdpt[gib].bits.present) {
+            paging_pdpt[gib].raw = (uintptr_t)pd | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+        pd[(addr % GIB) / LARGE_PAGE_SIZE].raw = addr | flags;
+        asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+    }
+    return (void *)phys;
+}
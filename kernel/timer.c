@@ -0,0 +1,435 @@
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <cpu.h>
+#include <klog.h>
+
+/*
+ * The wheel clock counts units of TIMER_WHEEL_UNIT_NS and is the next
+ * unit to be processed. A timer is filed by how far in the future it
+ * expires: less than 64 units ahead on level 0, less than 64^2 on level 1
+ * and so on, in the slot its expiry falls into on that level. When
+ * level 0 wraps around, the current slot of level 1 is cascaded: each of
+ * its timers is filed again and lands on level 0. Level 2 cascades when
+ * level 1 wraps, etc.
+ *
+ * Only non-empty slots matter, so the clock jumps straight to the next
+ * unit that has a level 0 slot to expire or an upper slot to cascade,
+ * found from per-level bitmaps; an idle CPU is woken for that and
+ * nothing else.
+ */
+
+static const char *TAG = "timer";
+
+#define WHEEL_LEVELS 5
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE  (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) /* in units, about 13 days */
+
+#define TIMER_HRES_MAX 64 /* per CPU; deadlines beyond that go on the wheel */
+
+struct timer_base {
+    spin_lock_t lock;
+    uint64_t clock;                       /* next unit to process */
+    uint64_t occupied[WHEEL_LEVELS];      /* bit n set if slot n is not empty */
+    struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct timer *hres[TIMER_HRES_MAX];   /* min-heap on expires */
+    unsigned int hres_count;
+    unsigned int pending;
+    bool initialized;
+    bool idle;
+} __attribute__((aligned(64)));
+
+static struct timer_base timer_bases[MAX_CPUS];
+
+static inline uint64_t timer_units(uint64_t ns)
+{
+    /* rounded up, so that a timer never fires early */
+    return (ns >> TIMER_WHEEL_UNIT_SHIFT) + !!(ns & (TIMER_WHEEL_UNIT_NS - 1));
+}
+
+static void wheel_enqueue(struct timer_base *base, struct timer *timer)
+{
+    uint64_t expires = timer_units(timer->expires);
+    if (expires < base->clock) {
+        expires = base->clock;
+    } else if (expires - base->clock >= WHEEL_RANGE) {
+        expires = base->clock + WHEEL_RANGE - 1; /* filed again when it comes up */
+    }
+
+    const uint64_t delta = expires - base->clock;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1ULL << ((level + 1) * WHEEL_BITS)) {
+        level++;
+    }
+    const unsigned int slot = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+
+    struct timer **head = &base->wheel[level][slot];
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+    base->occupied[level] |= 1ULL << slot;
+}
+
+static void wheel_dequeue(struct timer_base *base, struct timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    /* the last one out of a slot clears its bit; expired lists being run are not slots */
+    if (!*timer->pprev && timer->pprev >= &base->wheel[0][0] &&
+        timer->pprev < &base->wheel[0][0] + WHEEL_LEVELS * WHEEL_SLOTS) {
+        const size_t index = timer->pprev - &base->wheel[0][0];
+        base->occupied[index / WHEEL_SLOTS] &= ~(1ULL << (index % WHEEL_SLOTS));
+    }
+}
+
+/* take the whole list out of a slot */
+static struct timer *wheel_take_slot(struct timer_base *base, int level, unsigned int slot)
+{
+    struct timer *list = base->wheel[level][slot];
+    base->wheel[level][slot] = NULL;
+    base->occupied[level] &= ~(1ULL << slot);
+    return list;
+}
+
+/* the first unit at or after the clock where a slot expires or cascades, UINT64_MAX if none */
+static uint64_t wheel_next_unit(const struct timer_base *base)
+{
+    const uint64_t clock = base->clock;
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        const uint64_t occupied = base->occupied[level];
+        if (!occupied) {
+            continue;
+        }
+        const unsigned int shift = level * WHEEL_BITS;
+        const uint64_t rotation = clock >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+        unsigned int first = (clock >> shift) & WHEEL_MASK;
+        /* an upper slot is cascaded on its first unit, so the current one is done unless that is now */
+        if (level > 0 && (clock & ((1ULL << shift) - 1))) {
+            first++;
+        }
+
+        const uint64_t later = first < WHEEL_SLOTS ? occupied & (~0ULL << first) : 0;
+        const uint64_t unit = later ? rotation + ((uint64_t)__builtin_ctzll(later) << shift)
+                                    : rotation + ((uint64_t)(WHEEL_SLOTS + __builtin_ctzll(occupied)) << shift);
+        if (unit < next) {
+            next = unit;
+        }
+    }
+    return next;
+}
+
+static void hres_swap(struct timer_base *base, unsigned int a, unsigned int b)
+{
+    struct timer *timer = base->hres[a];
+    base->hres[a] = base->hres[b];
+    base->hres[b] = timer;
+    base->hres[a]->hres_index = a;
+    base->hres[b]->hres_index = b;
+}
+
+static void hres_sift_up(struct timer_base *base, unsigned int i)
+{
+    while (i && base->hres[(i - 1) / 2]->expires > base->hres[i]->expires) {
+        hres_swap(base, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void hres_sift_down(struct timer_base *base, unsigned int i)
+{
+    for (;;) {
+        unsigned int smallest = i;
+        const unsigned int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < base->hres_count && base->hres[left]->expires < base->hres[smallest]->expires) {
+            smallest = left;
+        }
+        if (right < base->hres_count && base->hres[right]->expires < base->hres[smallest]->expires) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        hres_swap(base, i, smallest);
+        i = smallest;
+    }
+}
+
+static void hres_remove(struct timer_base *base, struct timer *timer)
+{
+    const unsigned int i = timer->hres_index;
+    const unsigned int last = --base->hres_count;
+    if (i != last) {
+        hres_swap(base, i, last);
+        hres_sift_up(base, i);
+        hres_sift_down(base, i);
+    }
+    timer->hres_index = -1;
+}
+
+/* called with the base locked */
+static void timer_enqueue(struct timer_base *base, struct timer *timer, int cpu, uint64_t now)
+{
+    if (timer->expires < now + TIMER_HRES_NS && base->hres_count < TIMER_HRES_MAX) {
+        timer->hres_index = base->hres_count;
+        base->hres[base->hres_count++] = timer;
+        hres_sift_up(base, timer->hres_index);
+    } else {
+        timer->hres_index = -1;
+        wheel_enqueue(base, timer);
+    }
+    base->pending++;
+    __atomic_store_n(&timer->cpu, cpu, __ATOMIC_RELAXED);
+}
+
+/* called with the base locked */
+static void timer_dequeue(struct timer_base *base, struct timer *timer)
+{
+    if (timer->hres_index >= 0) {
+        hres_remove(base, timer);
+    } else {
+        wheel_dequeue(base, timer);
+    }
+    base->pending--;
+    __atomic_store_n(&timer->cpu, -1, __ATOMIC_RELAXED);
+}
+
+/* earliest time anything on @p base needs the CPU, UINT64_MAX if never; called with the base locked */
+static uint64_t timer_base_next_event(const struct timer_base *base)
+{
+    const uint64_t unit = wheel_next_unit(base);
+    uint64_t next = unit == UINT64_MAX ? UINT64_MAX : unit << TIMER_WHEEL_UNIT_SHIFT;
+    if (base->hres_count && base->hres[0]->expires < next) {
+        next = base->hres[0]->expires;
+    }
+    return next;
+}
+
+/* lock the base @p timer is queued on; returns NULL, unlocked, if it is not pending */
+static struct timer_base *timer_lock_base(struct timer *timer)
+{
+    for (;;) {
+        const int cpu = __atomic_load_n(&timer->cpu, __ATOMIC_RELAXED);
+        if (cpu < 0) {
+            return NULL;
+        }
+        struct timer_base *base = &timer_bases[cpu];
+        spin_lock(&base->lock);
+        if (timer->cpu == cpu) {
+            return base;
+        }
+        spin_unlock(&base->lock); /* migrated or fired meanwhile */
+    }
+}
+
+static void timer_run(struct timer_base *base, struct timer *timer)
+{
+    timer_dequeue(base, timer);
+    spin_unlock(&base->lock);
+    timer->function(timer->arg);
+    spin_lock(&base->lock);
+}
+
+static void timer_interrupt(void)
+{
+    const int cpu = arch_cpu_id();
+    struct timer_base *base = &timer_bases[cpu];
+
+    spin_lock(&base->lock);
+    uint64_t now = clock_monotonic_ns();
+    const uint64_t now_unit = now >> TIMER_WHEEL_UNIT_SHIFT;
+
+    while (base->clock <= now_unit) {
+        const uint64_t unit = wheel_next_unit(base);
+        if (unit > now_unit) {
+            base->clock = now_unit + 1;
+            break;
+        }
+        base->clock = unit;
+
+        /* cascade every level whose slot starts at this unit, lowest first */
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            const unsigned int shift = level * WHEEL_BITS;
+            if (unit & ((1ULL << shift) - 1)) {
+                break;
+            }
+            struct timer *timer = wheel_take_slot(base, level, (unit >> shift) & WHEEL_MASK);
+            while (timer) {
+                struct timer *next = timer->next;
+                wheel_enqueue(base, timer);
+                timer = next;
+            }
+        }
+
+        struct timer *expired = wheel_take_slot(base, 0, unit & WHEEL_MASK);
+        base->clock = unit + 1;
+        while (expired) {
+            struct timer *timer = expired;
+            expired = timer->next;
+            if (expired) {
+                expired->pprev = &expired;
+            }
+            timer->pprev = &timer->next; /* detached; timer_dequeue() unlinks nothing */
+            timer->next = NULL;
+            timer_run(base, timer);
+        }
+    }
+
+    while (base->hres_count && base->hres[0]->expires <= now) {
+        timer_run(base, base->hres[0]);
+        now = clock_monotonic_ns();
+    }
+
+    const uint64_t next = timer_base_next_event(base);
+    spin_unlock(&base->lock);
+    clockevent_cpu_set_next(next);
+}
+
+int timer_initialize(void)
+{
+    const int cpu = arch_cpu_id();
+    struct timer_base *base = &timer_bases[cpu];
+
+    if (clockevent_cpu_initialize(timer_interrupt) != 0) {
+        return -1;
+    }
+    const unsigned long flags = arch_irq_save();
+    spin_lock(&base->lock);
+    base->clock = clock_monotonic_ns() >> TIMER_WHEEL_UNIT_SHIFT;
+    base->initialized = true;
+    spin_unlock(&base->lock);
+    arch_irq_restore(flags);
+    KLOGI(TAG, "cpu %d: %lu ns wheel unit, %d levels of %d slots", cpu, (uint64_t)TIMER_WHEEL_UNIT_NS, WHEEL_LEVELS,
+          WHEEL_SLOTS);
+    return 0;
+}
+
+void timer_add(struct timer *timer, uint64_t expires_ns)
+{
+    const unsigned long flags = arch_irq_save();
+    const int cpu = arch_cpu_id();
+    struct timer_base *base = timer_lock_base(timer);
+
+    if (base) {
+        timer_dequeue(base, timer);
+        if (base != &timer_bases[cpu]) {
+            spin_unlock(&base->lock);
+            base = NULL;
+        }
+    }
+    if (!base) {
+        base = &timer_bases[cpu];
+        spin_lock(&base->lock);
+    }
+
+    timer->expires = expires_ns;
+    timer_enqueue(base, timer, cpu, clock_monotonic_ns());
+    const uint64_t next = timer_base_next_event(base);
+    spin_unlock(&base->lock);
+
+    if (next < clockevent_cpu_next()) {
+        clockevent_cpu_set_next(next);
+    }
+    arch_irq_restore(flags);
+}
+
+bool timer_cancel(struct timer *timer)
+{
+    const unsigned long flags = arch_irq_save();
+    struct timer_base *base = timer_lock_base(timer);
+    if (base) {
+        timer_dequeue(base, timer);
+        spin_unlock(&base->lock);
+    }
+    arch_irq_restore(flags);
+    /* the device stays programmed; an early interrupt finds nothing to do and reprograms it */
+    return base != NULL;
+}
+
+void timer_cpu_set_idle(bool idle)
+{
+    __atomic_store_n(&timer_bases[arch_cpu_id()].idle, idle, __ATOMIC_RELAXED);
+}
+
+/*
+ * There is no IPI to wake an idle CPU yet: it only comes out of idle for
+ * the event its device is programmed for, and reprograms the device from
+ * its timers then. So timers only go to a CPU programmed no later than
+ * they expire; earlier ones stay where they are.
+ */
+int timer_migrate(int cpu)
+{
+    int target = -1;
+    uint64_t target_next = UINT64_MAX;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (i == cpu || !timer_bases[i].initialized || !__atomic_load_n(&timer_bases[i].idle, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        const uint64_t next = clockevent_cpu_next_of(i);
+        if (next < target_next) {
+            target = i;
+            target_next = next;
+        }
+    }
+    if (target < 0) {
+        return -1;
+    }
+
+    struct timer_base *from = &timer_bases[cpu];
+    struct timer_base *to = &timer_bases[target];
+    const unsigned long flags = arch_irq_save();
+    /* always in CPU order, so two migrations cannot deadlock */
+    spin_lock(cpu < target ? &from->lock : &to->lock);
+    spin_lock(cpu < target ? &to->lock : &from->lock);
+
+    /*
+     * Again under the target's lock: if its interrupt has run meanwhile,
+     * this is either UINT64_MAX or an expiry it is about to program, both
+     * no earlier than what it will pick up of the timers moved now.
+     */
+    target_next = clockevent_cpu_next_of(target);
+    const uint64_t now = clock_monotonic_ns();
+    unsigned int moved = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (unsigned int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            struct timer *timer = from->wheel[level][slot];
+            while (timer) {
+                struct timer *next = timer->next;
+                if (!(timer->flags & TIMER_PINNED) && timer->expires >= target_next) {
+                    timer_dequeue(from, timer);
+                    timer_enqueue(to, timer, target, now);
+                    moved++;
+                }
+                timer = next;
+            }
+        }
+    }
+    for (unsigned int i = 0; i < from->hres_count;) {
+        struct timer *timer = from->hres[i];
+        if ((timer->flags & TIMER_PINNED) || timer->expires < target_next) {
+            i++;
+            continue;
+        }
+        timer_dequeue(from, timer);
+        timer_enqueue(to, timer, target, now);
+        moved++;
+    }
+
+    spin_unlock(&to->lock);
+    spin_unlock(&from->lock);
+    arch_irq_restore(flags);
+    if (!moved) {
+        return -1;
+    }
+    KLOGD(TAG, "moved %u timers from cpu %d to cpu %d", moved, cpu, target);
+    return target;
+}
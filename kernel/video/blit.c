@@ -0,0 +1,504 @@
+#include <kernel/video.h>
+#include <kernel/arch/x86_64/cmos.h>
+#include <kernel/string.h>
+#include <klog.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+
+/*
+ * Every operation is split into rows, each handed to a row routine; there is
+ * an SSE2 and an AVX2 version of every row routine.
+ *
+ * Rows going to video memory are written front to back with non-temporal
+ * stores starting at an aligned address, so each 64-byte write-combining
+ * buffer is filled completely before it goes out on the bus. Rows in system
+ * memory use ordinary stores so they stay in the cache for the next reader.
+ */
+
+struct blit_ops {
+    const char *name;
+    void (*fill_row)(uint32_t *dst, size_t n, uint32_t color, bool stream);
+    void (*copy_row)(uint32_t *dst, const uint32_t *src, size_t n, bool stream);
+    void (*blend_row)(uint32_t *dst, const uint32_t *src, size_t n);
+};
+
+/* src over dst for one channel of one pixel, rounded: x / 255 == (x + 128 + ((x + 128) >> 8)) >> 8 */
+static inline uint32_t blend_pixel(uint32_t s, uint32_t d)
+{
+    const uint32_t a = s >> 24;
+    uint32_t out = 0;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t x = ((s >> shift) & 0xFF) * a + ((d >> shift) & 0xFF) * (255 - a) + 128;
+        out |= ((x + (x >> 8)) >> 8) << shift;
+    }
+    return out;
+}
+
+static void fill_row_sse2(uint32_t *dst, size_t n, uint32_t color, bool stream)
+{
+    while (n && ((uintptr_t)dst & 15)) {
+        *dst++ = color;
+        n--;
+    }
+
+    const __m128i v = _mm_set1_epi32(color);
+    __m128i *d = (__m128i *)dst;
+    size_t vectors = n / 4;
+    if (stream) {
+        for (; vectors >= 4; vectors -= 4, d += 4) {
+            _mm_stream_si128(d + 0, v);
+            _mm_stream_si128(d + 1, v);
+            _mm_stream_si128(d + 2, v);
+            _mm_stream_si128(d + 3, v);
+        }
+        for (; vectors; vectors--) {
+            _mm_stream_si128(d++, v);
+        }
+    } else {
+        for (; vectors; vectors--) {
+            _mm_store_si128(d++, v);
+        }
+    }
+
+    dst = (uint32_t *)d;
+    for (n &= 3; n; n--) {
+        *dst++ = color;
+    }
+}
+
+static void copy_row_sse2(uint32_t *dst, const uint32_t *src, size_t n, bool stream)
+{
+    while (n && ((uintptr_t)dst & 15)) {
+        *dst++ = *src++;
+        n--;
+    }
+
+    __m128i *d = (__m128i *)dst;
+    const __m128i *s = (const __m128i *)src;
+    size_t vectors = n / 4;
+    if (stream) {
+        for (; vectors >= 4; vectors -= 4, d += 4, s += 4) {
+            const __m128i v0 = _mm_loadu_si128(s + 0);
+            const __m128i v1 = _mm_loadu_si128(s + 1);
+            const __m128i v2 = _mm_loadu_si128(s + 2);
+            const __m128i v3 = _mm_loadu_si128(s + 3);
+            _mm_stream_si128(d + 0, v0);
+            _mm_stream_si128(d + 1, v1);
+            _mm_stream_si128(d + 2, v2);
+            _mm_stream_si128(d + 3, v3);
+        }
+        for (; vectors; vectors--) {
+            _mm_stream_si128(d++, _mm_loadu_si128(s++));
+        }
+    } else {
+        for (; vectors; vectors--) {
+            _mm_store_si128(d++, _mm_loadu_si128(s++));
+        }
+    }
+
+    dst = (uint32_t *)d;
+    src = (const uint32_t *)s;
+    for (n &= 3; n; n--) {
+        *dst++ = *src++;
+    }
+}
+
+static inline __m128i blend4_sse2(__m128i s, __m128i d)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c128 = _mm_set1_epi16(128);
+
+    const __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+    const __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+    const __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+    const __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo),
+                               _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(c255, a_lo)));
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi),
+                               _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(c255, a_hi)));
+    lo = _mm_add_epi16(lo, c128);
+    hi = _mm_add_epi16(hi, c128);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static void blend_row_sse2(uint32_t *dst, const uint32_t *src, size_t n)
+{
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; n >= 4; n -= 4, dst += 4, src += 4) {
+        const __m128i s = _mm_loadu_si128((const __m128i *)src);
+        const __m128i a = _mm_and_si128(s, alpha);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha)) == 0xFFFF) {
+            _mm_storeu_si128((__m128i *)dst, s);
+        } else if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) != 0xFFFF) {
+            _mm_storeu_si128((__m128i *)dst, blend4_sse2(s, _mm_loadu_si128((const __m128i *)dst)));
+        }
+    }
+    for (; n; n--, dst++, src++) {
+        *dst = blend_pixel(*src, *dst);
+    }
+}
+
+__attribute__((target("avx2")))
+static void fill_row_avx2(uint32_t *dst, size_t n, uint32_t color, bool stream)
+{
+    while (n && ((uintptr_t)dst & 31)) {
+        *dst++ = color;
+        n--;
+    }
+
+    const __m256i v = _mm256_set1_epi32(color);
+    __m256i *d = (__m256i *)dst;
+    size_t vectors = n / 8;
+    if (stream) {
+        for (; vectors >= 2; vectors -= 2, d += 2) {
+            _mm256_stream_si256(d + 0, v);
+            _mm256_stream_si256(d + 1, v);
+        }
+        for (; vectors; vectors--) {
+            _mm256_stream_si256(d++, v);
+        }
+    } else {
+        for (; vectors; vectors--) {
+            _mm256_store_si256(d++, v);
+        }
+    }
+
+    dst = (uint32_t *)d;
+    for (n &= 7; n; n--) {
+        *dst++ = color;
+    }
+}
+
+__attribute__((target("avx2")))
+static void copy_row_avx2(uint32_t *dst, const uint32_t *src, size_t n, bool stream)
+{
+    while (n && ((uintptr_t)dst & 31)) {
+        *dst++ = *src++;
+        n--;
+    }
+
+    __m256i *d = (__m256i *)dst;
+    const __m256i *s = (const __m256i *)src;
+    size_t vectors = n / 8;
+    if (stream) {
+        for (; vectors >= 2; vectors -= 2, d += 2, s += 2) {
+            const __m256i v0 = _mm256_loadu_si256(s + 0);
+            const __m256i v1 = _mm256_loadu_si256(s + 1);
+            _mm256_stream_si256(d + 0, v0);
+            _mm256_stream_si256(d + 1, v1);
+        }
+        for (; vectors; vectors--) {
+            _mm256_stream_si256(d++, _mm256_loadu_si256(s++));
+        }
+    } else {
+        for (; vectors; vectors--) {
+            _mm256_store_si256(d++, _mm256_loadu_si256(s++));
+        }
+    }
+
+    dst = (uint32_t *)d;
+    src = (const uint32_t *)s;
+    for (n &= 7; n; n--) {
+        *dst++ = *src++;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend8_avx2(__m256i s, __m256i d)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i c128 = _mm256_set1_epi16(128);
+
+    /* unpack and pack both work within 128-bit lanes, so the pixel order survives */
+    const __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+    const __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+    const __m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+    const __m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+
+    __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(s_lo, a_lo),
+                                  _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(c255, a_lo)));
+    __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(s_hi, a_hi),
+                                  _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(c255, a_hi)));
+    lo = _mm256_add_epi16(lo, c128);
+    hi = _mm256_add_epi16(hi, c128);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static void blend_row_avx2(uint32_t *dst, const uint32_t *src, size_t n)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (; n >= 8; n -= 8, dst += 8, src += 8) {
+        const __m256i s = _mm256_loadu_si256((const __m256i *)src);
+        const __m256i a = _mm256_and_si256(s, alpha);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, alpha)) == -1) {
+            _mm256_storeu_si256((__m256i *)dst, s);
+        } else if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, zero)) != -1) {
+            _mm256_storeu_si256((__m256i *)dst, blend8_avx2(s, _mm256_loadu_si256((const __m256i *)dst)));
+        }
+    }
+    for (; n; n--, dst++, src++) {
+        *dst = blend_pixel(*src, *dst);
+    }
+}
+
+static const struct blit_ops blit_sse2 = {
+    .name = "sse2",
+    .fill_row = fill_row_sse2,
+    .copy_row = copy_row_sse2,
+    .blend_row = blend_row_sse2,
+};
+
+static const struct blit_ops blit_avx2 = {
+    .name = "avx2",
+    .fill_row = fill_row_avx2,
+    .copy_row = copy_row_avx2,
+    .blend_row = blend_row_avx2,
+};
+
+static const struct blit_ops *blit = &blit_sse2;
+
+/* AVX2 needs the CPU feature and the OS (fpu_initialize) having enabled the YMM state */
+static bool cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return false;
+    }
+    uint32_t xcr0_lo, xcr0_hi;
+    asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0x6) != 0x6) { /* SSE and AVX state */
+        return false;
+    }
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+}
+
+void blit_initialize(void)
+{
+    blit = cpu_has_avx2() ? &blit_avx2 : &blit_sse2;
+}
+
+int lfb_surface(lfb_surface_t *surface)
+{
+    if (!lfb_vid_memory) {
+        return -1;
+    }
+    surface->pixels = (uint32_t *)lfb_vid_memory;
+    surface->width = lfb_resolution_x;
+    surface->height = lfb_resolution_y;
+    surface->pitch = lfb_resolution_s;
+    surface->video = true;
+    return 0;
+}
+
+static inline uint32_t *surface_at(const lfb_surface_t *s, int x, int y)
+{
+    return (uint32_t *)((uint8_t *)s->pixels + (size_t)y * s->pitch) + x;
+}
+
+/* clip the rectangle at (@p x, @p y) to @p s, moving the origin (@p ox, @p oy) of a second rectangle along */
+static bool clip(const lfb_surface_t *s, int *x, int *y, int *w, int *h, int *ox, int *oy)
+{
+    if (*x < 0) {
+        *w += *x;
+        *ox -= *x;
+        *x = 0;
+    }
+    if (*y < 0) {
+        *h += *y;
+        *oy -= *y;
+        *y = 0;
+    }
+    if (*x + *w > (int)s->width) {
+        *w = (int)s->width - *x;
+    }
+    if (*y + *h > (int)s->height) {
+        *h = (int)s->height - *y;
+    }
+    return *w > 0 && *h > 0;
+}
+
+void blit_fill(lfb_surface_t *dst, int x, int y, int w, int h, uint32_t color)
+{
+    int unused_x = 0, unused_y = 0;
+    if (!clip(dst, &x, &y, &w, &h, &unused_x, &unused_y)) {
+        return;
+    }
+
+    for (int row = 0; row < h; row++) {
+        blit->fill_row(surface_at(dst, x, y + row), w, color, dst->video);
+    }
+    if (dst->video) {
+        _mm_sfence();
+    }
+}
+
+void blit_copy(lfb_surface_t *dst, int dx, int dy, const lfb_surface_t *src, int sx, int sy, int w, int h)
+{
+    if (!clip(dst, &dx, &dy, &w, &h, &sx, &sy) || !clip(src, &sx, &sy, &w, &h, &dx, &dy)) {
+        return;
+    }
+
+    for (int row = 0; row < h; row++) {
+        blit->copy_row(surface_at(dst, dx, dy + row), surface_at(src, sx, sy + row), w, dst->video);
+    }
+    if (dst->video) {
+        _mm_sfence();
+    }
+}
+
+void blit_move(lfb_surface_t *surface, int dx, int dy, int sx, int sy, int w, int h)
+{
+    if (!clip(surface, &dx, &dy, &w, &h, &sx, &sy) || !clip(surface, &sx, &sy, &w, &h, &dx, &dy)) {
+        return;
+    }
+
+    if (dy > sy) {
+        /* moving down: bottom row first so no source row is overwritten before it is read */
+        for (int row = h - 1; row >= 0; row--) {
+            blit->copy_row(surface_at(surface, dx, dy + row), surface_at(surface, sx, sy + row), w, surface->video);
+        }
+    } else if (dy < sy || dx < sx) {
+        /* a forward copy loads every vector before storing over it, which is enough when moving left */
+        for (int row = 0; row < h; row++) {
+            blit->copy_row(surface_at(surface, dx, dy + row), surface_at(surface, sx, sy + row), w, surface->video);
+        }
+    } else if (dx > sx) {
+        for (int row = 0; row < h; row++) {
+            memmove(surface_at(surface, dx, dy + row), surface_at(surface, sx, sy + row), (size_t)w * 4);
+        }
+    }
+    if (surface->video) {
+        _mm_sfence();
+    }
+}
+
+void blit_blend(lfb_surface_t *dst, int dx, int dy, const lfb_surface_t *src, int sx, int sy, int w, int h)
+{
+    if (!clip(dst, &dx, &dy, &w, &h, &sx, &sy) || !clip(src, &sx, &sy, &w, &h, &dx, &dy)) {
+        return;
+    }
+
+    for (int row = 0; row < h; row++) {
+        blit->blend_row(surface_at(dst, dx, dy + row), surface_at(src, sx, sy + row), w);
+    }
+}
+
+#define BENCH_FRAMES 16
+
+static void bench_report(const char *what, uint64_t pixels, uint64_t cycles)
+{
+    const uint64_t mhz = arch_cpu_mhz();
+    const uint64_t mpixels = cycles ? pixels * mhz / cycles : 0;
+
+    KLOGI("blit", "%-4s %-20s %6u MPixels/s", blit->name, what, (unsigned)mpixels);
+}
+
+static void bench_run(lfb_surface_t *screen, lfb_surface_t *back, lfb_surface_t *sprite)
+{
+    const uint64_t frame = (uint64_t)screen->width * screen->height;
+    const int w = screen->width, h = screen->height;
+    uint64_t start;
+
+    start = __rdtsc();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        blit_fill(screen, 0, 0, w, h, i & 1 ? 0x203040 : 0x405060);
+    }
+    bench_report("fill screen", frame * BENCH_FRAMES, __rdtsc() - start);
+
+    /* reads video memory, which is uncached */
+    start = __rdtsc();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        blit_move(screen, 0, 0, 0, 16, w, h - 16);
+    }
+    bench_report("scroll screen", (uint64_t)w * (h - 16) * BENCH_FRAMES, __rdtsc() - start);
+
+    if (!back) {
+        return;
+    }
+
+    start = __rdtsc();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        blit_fill(back, 0, 0, w, h, i & 1 ? 0x203040 : 0x405060);
+    }
+    bench_report("fill memory", frame * BENCH_FRAMES, __rdtsc() - start);
+
+    start = __rdtsc();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        blit_copy(screen, 0, 0, back, 0, 0, w, h);
+    }
+    bench_report("copy memory->screen", frame * BENCH_FRAMES, __rdtsc() - start);
+
+    start = __rdtsc();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        blit_move(back, 0, 0, 0, 16, w, h - 16);
+    }
+    bench_report("scroll memory", (uint64_t)w * (h - 16) * BENCH_FRAMES, __rdtsc() - start);
+
+    if (!sprite) {
+        return;
+    }
+
+    start = __rdtsc();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        blit_blend(back, 0, 0, sprite, 0, 0, w, h);
+    }
+    bench_report("blend memory", frame * BENCH_FRAMES, __rdtsc() - start);
+}
+
+void blit_benchmark(void *scratch, size_t scratch_size)
+{
+    lfb_surface_t screen, back, sprite;
+
+    if (lfb_surface(&screen) != 0) {
+        return;
+    }
+
+    const size_t frame_bytes = (size_t)screen.width * screen.height * 4;
+    back = (lfb_surface_t){
+        .pixels = scratch,
+        .width = screen.width,
+        .height = screen.height,
+        .pitch = screen.width * 4,
+        .video = false,
+    };
+    sprite = back;
+    sprite.pixels = (uint32_t *)((uint8_t *)scratch + frame_bytes);
+
+    /* a sprite with every alpha value, so the opaque/transparent shortcuts rarely apply */
+    const bool have_back = scratch && scratch_size >= frame_bytes;
+    const bool have_sprite = scratch && scratch_size >= 2 * frame_bytes;
+    if (have_sprite) {
+        for (uint32_t y = 0; y < sprite.height; y++) {
+            uint32_t *row = surface_at(&sprite, 0, y);
+            for (uint32_t x = 0; x < sprite.width; x++) {
+                row[x] = ((x + y) & 0xFF) << 24 | (x & 0xFF) << 16 | (y & 0xFF) << 8 | 0x80;
+            }
+        }
+    }
+
+    const struct blit_ops *best = blit;
+    KLOGI("blit", "%ux%u, %u frames per test", screen.width, screen.height, BENCH_FRAMES);
+    blit = &blit_sse2;
+    bench_run(&screen, have_back ? &back : NULL, have_sprite ? &sprite : NULL);
+    if (best == &blit_avx2) {
+        blit = &blit_avx2;
+        bench_run(&screen, have_back ? &back : NULL, have_sprite ? &sprite : NULL);
+    }
+    blit = best;
+
+    blit_fill(&screen, 0, 0, screen.width, screen.height, 0);
+}
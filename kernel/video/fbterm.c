@@ -0,0 +1,347 @@
+#include <kernel/video.h>
+#include <stdbool.h>
+#include <x86intrin.h>
+
+#include "font8x8.h"
+
+/*
+ * Text is rendered into a shadow buffer in system memory and copied to video
+ * memory afterwards, because reads from (write-combining) video memory are
+ * very slow and partial writes defeat write combining.
+ *
+ * The shadow buffer holds the text rows as a ring: scrolling moves
+ * shadow_top on by one row and clears a single row, the rows themselves
+ * never move. Only the flush puts them back in screen order.
+ *
+ * Changed cells are tracked as one dirty rectangle, in cells, and copied
+ * out with blit_copy(), which streams whole scanlines to video memory.
+ * The copy happens in fbterm_flush(), not per write: a scroll dirties the
+ * whole screen, and this way any number of lines scrolled in between cost
+ * one copy of it.
+ */
+
+#define CELL_WIDTH  8
+#define CELL_HEIGHT 16 /* the 8x8 font with every row doubled */
+#define FBTERM_MAX_WIDTH  1024
+#define FBTERM_MAX_HEIGHT 768
+#define GLYPH_COUNT (FONT8X8_LAST - FONT8X8_FIRST + 1)
+
+enum
+{
+    ANSI_NORMAL,
+    ANSI_ESCAPE,
+    ANSI_CSI,
+};
+
+#define ANSI_MAX_PARAMS 8
+
+/* VGA text mode palette, regular then bright */
+static const uint32_t fbterm_palette[16] = {
+    0x000000, 0xAA0000, 0x00AA00, 0xAA5500, 0x0000AA, 0xAA00AA, 0x00AAAA, 0xAAAAAA,
+    0x555555, 0xFF5555, 0x55FF55, 0xFFFF55, 0x5555FF, 0xFF55FF, 0x55FFFF, 0xFFFFFF,
+};
+
+/* every glyph expanded to one all-ones/all-zeroes mask per pixel */
+static uint32_t glyph_cache[GLYPH_COUNT][CELL_HEIGHT][CELL_WIDTH] __attribute__((aligned(16)));
+static uint32_t shadow[FBTERM_MAX_WIDTH * FBTERM_MAX_HEIGHT] __attribute__((aligned(64)));
+
+static unsigned int cols, rows;
+static unsigned int shadow_stride;      /* pixels per shadow scanline */
+static unsigned int shadow_top;         /* shadow text row shown at the top of the screen */
+static unsigned int cursor_x, cursor_y;
+static unsigned int dirty_x0 = 1, dirty_y0, dirty_x1, dirty_y1; /* inclusive; empty while x0 > x1 */
+
+static int fg_index = 7, bg_index = 0;
+static bool bold;
+static int ansi_state = ANSI_NORMAL;
+static int ansi_params[ANSI_MAX_PARAMS];
+static int ansi_param_count;
+static bool ansi_private;               /* a private parameter byte (< = > ?) was seen */
+
+static inline uint32_t *shadow_cell(unsigned int x, unsigned int y)
+{
+    const unsigned int row = (shadow_top + y) % rows;
+    return shadow + (size_t)row * CELL_HEIGHT * shadow_stride + x * CELL_WIDTH;
+}
+
+static void mark_dirty(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1)
+{
+    if (dirty_x0 > dirty_x1) {
+        dirty_x0 = x0;
+        dirty_y0 = y0;
+        dirty_x1 = x1;
+        dirty_y1 = y1;
+        return;
+    }
+    if (x0 < dirty_x0) dirty_x0 = x0;
+    if (y0 < dirty_y0) dirty_y0 = y0;
+    if (x1 > dirty_x1) dirty_x1 = x1;
+    if (y1 > dirty_y1) dirty_y1 = y1;
+}
+
+static inline uint32_t current_fg(void)
+{
+    return fbterm_palette[fg_index + (bold ? 8 : 0)];
+}
+
+static void draw_cell(unsigned int x, unsigned int y, char c)
+{
+    unsigned int glyph = (unsigned char)c - FONT8X8_FIRST;
+    if (glyph >= GLYPH_COUNT) {
+        glyph = '?' - FONT8X8_FIRST;
+    }
+
+    const __m128i fg = _mm_set1_epi32(current_fg());
+    const __m128i bg = _mm_set1_epi32(fbterm_palette[bg_index]);
+    uint32_t *dst = shadow_cell(x, y);
+
+    for (int py = 0; py < CELL_HEIGHT; py++, dst += shadow_stride) {
+        const __m128i m0 = _mm_load_si128((const __m128i *)&glyph_cache[glyph][py][0]);
+        const __m128i m1 = _mm_load_si128((const __m128i *)&glyph_cache[glyph][py][4]);
+        _mm_store_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(m0, fg), _mm_andnot_si128(m0, bg)));
+        _mm_store_si128((__m128i *)dst + 1, _mm_or_si128(_mm_and_si128(m1, fg), _mm_andnot_si128(m1, bg)));
+    }
+    mark_dirty(x, y, x, y);
+}
+
+/* fill cells [x0, x1] of text row y with the background colour */
+static void clear_cells(unsigned int x0, unsigned int x1, unsigned int y)
+{
+    const __m128i bg = _mm_set1_epi32(fbterm_palette[bg_index]);
+    uint32_t *dst = shadow_cell(x0, y);
+    const unsigned int vectors = (x1 - x0 + 1) * CELL_WIDTH / 4;
+
+    for (int py = 0; py < CELL_HEIGHT; py++, dst += shadow_stride) {
+        for (unsigned int i = 0; i < vectors; i++) {
+            _mm_store_si128((__m128i *)dst + i, bg);
+        }
+    }
+    mark_dirty(x0, y, x1, y);
+}
+
+static void scroll(void)
+{
+    shadow_top = (shadow_top + 1) % rows;
+    clear_cells(0, cols - 1, rows - 1);
+    mark_dirty(0, 0, cols - 1, rows - 1);
+}
+
+static void newline(void)
+{
+    cursor_x = 0;
+    if (++cursor_y == rows) {
+        cursor_y = rows - 1;
+        scroll();
+    }
+}
+
+static void clear_screen(void)
+{
+    for (unsigned int y = 0; y < rows; y++) {
+        clear_cells(0, cols - 1, y);
+    }
+    cursor_x = 0;
+    cursor_y = 0;
+}
+
+/* copy the dirty rectangle to video memory, in screen order */
+static void flush(void)
+{
+    if (!rows || dirty_x0 > dirty_x1) {
+        return;
+    }
+
+    lfb_surface_t screen;
+    lfb_surface(&screen);
+    const lfb_surface_t shadow_surface = {
+        .pixels = shadow,
+        .width = shadow_stride,
+        .height = rows * CELL_HEIGHT,
+        .pitch = shadow_stride * 4,
+        .video = false,
+    };
+
+    /* the rows are a ring in the shadow buffer, so copy one text row at a time */
+    const int x = dirty_x0 * CELL_WIDTH;
+    const int w = (dirty_x1 - dirty_x0 + 1) * CELL_WIDTH;
+    for (unsigned int y = dirty_y0; y <= dirty_y1; y++) {
+        const int shadow_y = (shadow_top + y) % rows * CELL_HEIGHT;
+        blit_copy(&screen, x, y * CELL_HEIGHT, &shadow_surface, x, shadow_y, w, CELL_HEIGHT);
+    }
+
+    dirty_x0 = 1;
+    dirty_x1 = 0;
+}
+
+static void ansi_sgr(void)
+{
+    if (!ansi_param_count) {
+        ansi_params[ansi_param_count++] = 0;
+    }
+    for (int i = 0; i < ansi_param_count; i++) {
+        const int p = ansi_params[i];
+        if (p == 0) {
+            fg_index = 7;
+            bg_index = 0;
+            bold = false;
+        } else if (p == 1) {
+            bold = true;
+        } else if (p == 22) {
+            bold = false;
+        } else if (p >= 30 && p <= 37) {
+            fg_index = p - 30;
+        } else if (p == 39) {
+            fg_index = 7;
+        } else if (p >= 40 && p <= 47) {
+            bg_index = p - 40;
+        } else if (p == 49) {
+            bg_index = 0;
+        } else if (p >= 90 && p <= 97) {
+            fg_index = p - 90;
+            bold = true;
+        }
+    }
+}
+
+static void ansi_csi(char final)
+{
+    switch (final) {
+    case 'm':
+        ansi_sgr();
+        break;
+    case 'J':
+        if (ansi_param_count && ansi_params[0] == 2) {
+            clear_screen();
+        }
+        break;
+    case 'H':
+        cursor_y = ansi_param_count > 0 && ansi_params[0] > 0 ? (unsigned int)ansi_params[0] - 1 : 0;
+        cursor_x = ansi_param_count > 1 && ansi_params[1] > 0 ? (unsigned int)ansi_params[1] - 1 : 0;
+        if (cursor_y >= rows) cursor_y = rows - 1;
+        if (cursor_x >= cols) cursor_x = cols - 1;
+        break;
+    case 'K':
+        if (cursor_x < cols) {
+            clear_cells(cursor_x, cols - 1, cursor_y);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void put_char(char c)
+{
+    switch (ansi_state) {
+    case ANSI_ESCAPE:
+        if (c == '[') {
+            ansi_state = ANSI_CSI;
+            ansi_param_count = 0;
+            ansi_params[0] = 0;
+            ansi_private = false;
+        } else {
+            ansi_state = ANSI_NORMAL;
+        }
+        return;
+    case ANSI_CSI:
+        if (c >= '0' && c <= '9') {
+            if (!ansi_param_count) {
+                ansi_param_count = 1;
+            }
+            ansi_params[ansi_param_count - 1] = ansi_params[ansi_param_count - 1] * 10 + (c - '0');
+        } else if (c == ';') {
+            if (!ansi_param_count) {
+                ansi_param_count = 1;
+            }
+            if (ansi_param_count < ANSI_MAX_PARAMS) {
+                ansi_params[ansi_param_count++] = 0;
+            }
+        } else if (c >= 0x20 && c <= 0x3F) {
+            /* other parameter bytes (: < = > ?) and intermediate bytes; none of these sequences is supported */
+            ansi_private = true;
+        } else {
+            /* final byte, or a control character that cancels the sequence */
+            if (!ansi_private && c >= 0x40 && c <= 0x7E) {
+                ansi_csi(c);
+            }
+            ansi_state = ANSI_NORMAL;
+        }
+        return;
+    default:
+        break;
+    }
+
+    switch (c) {
+    case '\033':
+        ansi_state = ANSI_ESCAPE;
+        break;
+    case '\n':
+        newline();
+        break;
+    case '\r':
+        cursor_x = 0;
+        break;
+    case '\t':
+        cursor_x = (cursor_x + 8) & ~7U;
+        if (cursor_x >= cols) {
+            newline();
+        }
+        break;
+    case '\b':
+        if (cursor_x) {
+            cursor_x--;
+        }
+        break;
+    default:
+        if (cursor_x == cols) {
+            newline();
+        }
+        draw_cell(cursor_x++, cursor_y, c);
+        break;
+    }
+}
+
+int fbterm_initialize(void)
+{
+    if (!lfb_vid_memory) {
+        return -1;
+    }
+
+    const unsigned int width = lfb_resolution_x < FBTERM_MAX_WIDTH ? lfb_resolution_x : FBTERM_MAX_WIDTH;
+    const unsigned int height = lfb_resolution_y < FBTERM_MAX_HEIGHT ? lfb_resolution_y : FBTERM_MAX_HEIGHT;
+    cols = width / CELL_WIDTH;
+    rows = height / CELL_HEIGHT;
+    if (!cols || !rows) {
+        return -1;
+    }
+    shadow_stride = cols * CELL_WIDTH;
+
+    for (unsigned int g = 0; g < GLYPH_COUNT; g++) {
+        for (int py = 0; py < CELL_HEIGHT; py++) {
+            const uint8_t bits = font8x8[g][py / 2];
+            for (int px = 0; px < CELL_WIDTH; px++) {
+                glyph_cache[g][py][px] = (bits >> px) & 1 ? 0xFFFFFFFF : 0;
+            }
+        }
+    }
+
+    clear_screen();
+    flush();
+    return 0;
+}
+
+void fbterm_write(const char *buf, size_t len)
+{
+    if (!rows) {
+        return;
+    }
+    while (len--) {
+        put_char(*buf++);
+    }
+}
+
+bool fbterm_flush(void)
+{
+    flush();
+    return false;
+}
@@ -0,0 +1,27 @@
+#include <kernel/video.h>
+#include <kernel/mmu.h>
+
+uint8_t  *lfb_vid_memory = NULL;
+uint16_t lfb_resolution_x = 0;
+uint16_t lfb_resolution_y = 0;
+uint16_t lfb_resolution_b = 0;
+uint32_t lfb_resolution_s = 0;
+
+int lfb_initialize(uintptr_t phys, uint32_t pitch, uint32_t width, uint32_t height, uint8_t bpp)
+{
+    if (bpp != 32 || !width || !height || pitch < width * 4) {
+        return -1;
+    }
+
+    void *vid = mmu_map_mmio(phys, (size_t)pitch * height, MMU_CACHE_WC);
+    if (!vid) {
+        return -1;
+    }
+
+    lfb_vid_memory = vid;
+    lfb_resolution_x = width;
+    lfb_resolution_y = height;
+    lfb_resolution_b = bpp;
+    lfb_resolution_s = pitch;
+    return 0;
+}
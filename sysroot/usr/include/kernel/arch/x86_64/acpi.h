@@ -1,6 +1,7 @@
 #pragma once
 
 #include <kernel/types.h>
+#include <kernel/checksum.h>
 
 struct rsdp_descriptor {
 	char     signature[8];
@@ -41,13 +42,194 @@ struct madt {
 	uint32_t lapic_addr;
 	uint32_t flags;
 	uint8_t entries[];
+} __attribute__((packed));
+
+#define MADT_FLAG_PCAT_COMPAT (1 << 0) /* there are 8259s as well */
+
+/* MADT entries, each starting with its type and length */
+enum madt_entry_type {
+	MADT_LAPIC           = 0,
+	MADT_IOAPIC          = 1,
+	MADT_SOURCE_OVERRIDE = 2,
+	MADT_LAPIC_NMI       = 4,
+	MADT_X2APIC          = 9,
 };
 
+struct madt_entry {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed));
+
+#define MADT_LAPIC_ENABLED        (1 << 0)
+#define MADT_LAPIC_ONLINE_CAPABLE (1 << 1)
+
+struct madt_lapic {
+	struct madt_entry entry;
+	uint8_t  processor_id;
+	uint8_t  apic_id;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+	struct madt_entry entry;
+	uint8_t  ioapic_id;
+	uint8_t  _reserved;
+	uint32_t address;
+	uint32_t gsi_base;
+} __attribute__((packed));
+
+/* where an ISA IRQ is wired to on the IOAPICs, if not to the same-numbered input */
+struct madt_source_override {
+	struct madt_entry entry;
+	uint8_t  bus; /* 0, ISA */
+	uint8_t  source;
+	uint32_t gsi;
+	uint16_t flags;
+} __attribute__((packed));
+
+/* MPS INTI flags of overrides and NMI sources */
+#define MADT_POLARITY_MASK 0x3
+#define MADT_POLARITY_LOW  0x3
+#define MADT_TRIGGER_MASK  0xC
+#define MADT_TRIGGER_LEVEL 0xC
+
+struct madt_x2apic {
+	struct madt_entry entry;
+	uint16_t _reserved;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t processor_uid;
+} __attribute__((packed));
+
 static inline int acpi_checksum(struct acpi_sdt_header * header) {
-	uint8_t check = 0;
-	for (size_t i = 0; i < header->length; ++i) {
-		check += ((uint8_t *)header)[i];
-	}
-	return check == 0;
+	return checksum8(header, header->length) == 0;
 }
 
+
+/* Generic Address Structure */
+struct acpi_gas {
+	uint8_t  address_space_id;
+	uint8_t  register_bit_width;
+	uint8_t  register_bit_offset;
+	uint8_t  access_size;
+	uint64_t address;
+} __attribute__((packed));
+
+enum acpi_address_space {
+	ACPI_SPACE_SYSTEM_MEMORY = 0,
+	ACPI_SPACE_SYSTEM_IO     = 1,
+};
+
+/* Fixed ACPI Description Table ("FACP"), up to the extended PM timer block */
+struct fadt {
+	struct acpi_sdt_header header;
+	uint32_t firmware_ctrl;
+	uint32_t dsdt;
+	uint8_t  _reserved0;
+	uint8_t  preferred_pm_profile;
+	uint16_t sci_int;
+	uint32_t smi_cmd;
+	uint8_t  acpi_enable;
+	uint8_t  acpi_disable;
+	uint8_t  s4bios_req;
+	uint8_t  pstate_cnt;
+	uint32_t pm1a_evt_blk;
+	uint32_t pm1b_evt_blk;
+	uint32_t pm1a_cnt_blk;
+	uint32_t pm1b_cnt_blk;
+	uint32_t pm2_cnt_blk;
+	uint32_t pm_tmr_blk;
+	uint32_t gpe0_blk;
+	uint32_t gpe1_blk;
+	uint8_t  pm1_evt_len;
+	uint8_t  pm1_cnt_len;
+	uint8_t  pm2_cnt_len;
+	uint8_t  pm_tmr_len;
+	uint8_t  gpe0_blk_len;
+	uint8_t  gpe1_blk_len;
+	uint8_t  gpe1_base;
+	uint8_t  cst_cnt;
+	uint16_t p_lvl2_lat;
+	uint16_t p_lvl3_lat;
+	uint16_t flush_size;
+	uint16_t flush_stride;
+	uint8_t  duty_offset;
+	uint8_t  duty_width;
+	uint8_t  day_alrm;
+	uint8_t  mon_alrm;
+	uint8_t  century;
+	uint16_t iapc_boot_arch;
+	uint8_t  _reserved1;
+	uint32_t flags;
+	struct acpi_gas reset_reg;
+	uint8_t  reset_value;
+	uint16_t arm_boot_arch;
+	uint8_t  fadt_minor_version;
+	uint64_t x_firmware_ctrl;
+	uint64_t x_dsdt;
+	struct acpi_gas x_pm1a_evt_blk;
+	struct acpi_gas x_pm1b_evt_blk;
+	struct acpi_gas x_pm1a_cnt_blk;
+	struct acpi_gas x_pm1b_cnt_blk;
+	struct acpi_gas x_pm2_cnt_blk;
+	struct acpi_gas x_pm_tmr_blk;
+} __attribute__((packed));
+
+#define FADT_FLAG_TMR_VAL_EXT (1 << 8) /* the PM timer is 32 bits wide instead of 24 */
+
+#define ACPI_PM_TIMER_FREQUENCY 3579545 /* Hz */
+
+/* HPET Description Table ("HPET") */
+struct hpet_table {
+	struct acpi_sdt_header header;
+	uint32_t event_timer_block_id;
+	struct acpi_gas base_address;
+	uint8_t  hpet_number;
+	uint16_t minimum_tick;
+	uint8_t  page_protection;
+} __attribute__((packed));
+
+/**
+ * @brief Find the ACPI tables
+ *
+ * @param rsdp the RSDP passed on by the boot loader, or NULL to search the BIOS areas for it
+ * @return 0, or -1 if there are no (valid) ACPI tables
+ */
+int acpi_initialize(const void *rsdp);
+
+/**
+ * @brief First table with the given four-character @p signature, e.g. "APIC", or NULL
+ */
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+
+/**
+ * @brief Register the ACPI power management timer as a clock source, if the FADT has one
+ */
+int acpi_pm_timer_initialize(void);
+
+#define ACPI_MADT_MAX_CPUS    64
+#define ACPI_MADT_MAX_IOAPICS 8
+#define ACPI_ISA_IRQS         16
+
+/* What the MADT says about the interrupt controllers */
+struct acpi_madt_info {
+	uint32_t flags; /* MADT_FLAG_* */
+	unsigned int cpu_count;
+	uint32_t cpu_apic_ids[ACPI_MADT_MAX_CPUS]; /* enabled or online-capable processors, boot CPU first */
+	unsigned int ioapic_count;
+	struct {
+		uint8_t  id;
+		uint32_t address;
+		uint32_t gsi_base;
+	} ioapics[ACPI_MADT_MAX_IOAPICS];
+	struct {
+		uint32_t gsi;
+		uint16_t flags; /* MADT_POLARITY_*, MADT_TRIGGER_* */
+	} isa_irqs[ACPI_ISA_IRQS]; /* the same-numbered GSI unless overridden */
+};
+
+/**
+ * @brief Collect the processors, IOAPICs and ISA IRQ overrides of the MADT
+ * @return 0, or -1 if there is no MADT
+ */
+int acpi_madt_parse(struct acpi_madt_info *info);
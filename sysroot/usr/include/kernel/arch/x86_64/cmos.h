@@ -14,6 +14,79 @@ typedef struct
     unsigned int year;
 } date_t;
 
+extern unsigned short century_register; /* CMOS register holding the century, from the ACPI FADT; 0 if unknown */
+
+/**
+ * @brief Read the RTC once, find the TSC rate and start the clocks from there
+ */
 void arch_clock_initialize(void);
-date_t read_rtc();
-uint64_t read_epoch_time();
\ No newline at end of file
+
+/**
+ * @brief Take the century from CMOS register @p reg, as named by the ACPI FADT
+ *
+ * Moves the clocks by whole centuries if the boot-time guess was wrong.
+ */
+void arch_clock_set_century_register(unsigned short reg);
+
+/**
+ * @brief Seconds since the Unix epoch
+ *
+ * Kept by the clock sources from the CMOS time read once at boot; lock-free
+ * and callable from anywhere.
+ */
+uint64_t read_epoch_time(void);
+
+/**
+ * @brief Current date and time (UTC), see read_epoch_time()
+ */
+date_t read_date(void);
+
+/**
+ * @brief Seconds since the Unix epoch at @p date, in constant time
+ */
+uint64_t date_to_epoch(const date_t *date);
+
+/**
+ * @brief Date and time at @p epoch seconds since the Unix epoch, in constant time
+ */
+void epoch_to_date(uint64_t epoch, date_t *date);
+
+struct clocksource;
+
+/**
+ * @brief Measure the TSC again against @p ref, e.g. the HPET
+ *
+ * Only done if the boot-time rate was measured against the PIT or is the
+ * nominal one from CPUID 0x16; the new rate is kept if it is more precise.
+ */
+void arch_tsc_calibrate(const struct clocksource *ref);
+
+/**
+ * @brief Stop trusting the TSC as a clock source, e.g. because the CPUs' TSCs disagree
+ *
+ * The clocks switch to the best remaining source; @p reason is logged.
+ */
+void arch_tsc_mark_unstable(const char *reason);
+
+/**
+ * @brief TSC rate in MHz, 2000 if it could not be determined
+ */
+uint64_t arch_cpu_mhz(void);
+
+/**
+ * @brief TSC rate in Hz, 2 GHz if it could not be determined
+ */
+uint64_t arch_tsc_frequency(void);
+
+/**
+ * @brief Change the TSC rate after a recalibration, without a jump in time
+ */
+void arch_tsc_set_frequency(uint64_t hz);
+
+/**
+ * @brief Wall-clock time of TSC value @p tsc, in seconds and microseconds
+ *
+ * Taken from the clocksource time base, see clock_realtime_ns_at();
+ * lock-free and cheap enough for every log line.
+ */
+void arch_tsc_to_time(uint64_t tsc, uint64_t *seconds, uint64_t *subseconds);
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <stddef.h>
+
 /*
     debug console for early logging which uses port 0xE9 to output logging messages
     during the start of the kernel initialization
 */
 void debugcon_init();
-void debugcon_putchar(char ch);
+void debugcon_write(const char *buf, size_t len);
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/**
+ * Segment selectors; code and data are where the bootstrap GDT has them
+ */
+enum GDT_SELECTORS {
+	GDT_KERNEL_CODE = 0x08,
+	GDT_KERNEL_DATA = 0x10,
+	GDT_TSS = 0x18,
+};
+
+/**
+ * Interrupt stack table slots; 0 means "stay on the current stack"
+ *
+ * Only for the exceptions that may come with a broken stack and are not
+ * expected to nest: an exception taken on its own IST stack would
+ * overwrite the frame of one still running there.
+ */
+enum IST_STACKS {
+	IST_DOUBLE_FAULT = 1,
+	IST_NMI = 2,
+	IST_MACHINE_CHECK = 3,
+	IST_COUNT = 3,
+};
+
+#define IST_STACK_SIZE 8192
+
+/**
+ * 64-bit task state segment; only the interrupt stack table is used
+ */
+struct tss {
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t iomap_base;
+} __attribute__((packed));
+
+/**
+ * @brief Load a GDT with a TSS of its own on the calling CPU
+ *
+ * The TSS points the IST slots at stacks reserved for this CPU.
+ */
+void gdt_initialize(void);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+    High Precision Event Timer. The main counter is registered as a clock
+    source, and every comparator as a one-shot clock event device: those
+    that can deliver their interrupt as an MSI (FSB delivery) right away,
+    the others once an IOAPIC input is routed to them. The registers are
+    mapped uncached.
+*/
+
+#define HPET_MAX_COMPARATORS 32
+
+enum HPET_REGISTERS
+{
+    HPET_GENERAL_CAPABILITIES = 0x000, // bits 63-32: counter period in femtoseconds
+    HPET_GENERAL_CONFIG = 0x010,
+    HPET_GENERAL_INT_STATUS = 0x020,
+    HPET_MAIN_COUNTER = 0x0F0,
+    HPET_TIMER_CONFIG = 0x100,     // + 0x20 * comparator; bits 63-32: IOAPIC inputs it can be routed to
+    HPET_TIMER_COMPARATOR = 0x108, // + 0x20 * comparator
+    HPET_TIMER_FSB_ROUTE = 0x110,  // + 0x20 * comparator; bits 31-0: MSI data, bits 63-32: MSI address
+};
+
+#define HPET_TIMER_STRIDE 0x20
+
+enum HPET_GENERAL_CAPABILITIES_BITS
+{
+    HPET_CAP_NUM_TIMERS_SHIFT = 8, // bits 12-8: number of comparators - 1
+    HPET_CAP_NUM_TIMERS_MASK = 0x1F,
+    HPET_CAP_COUNT_SIZE_64 = (1 << 13), // main counter is 64 bits wide
+};
+
+enum HPET_GENERAL_CONFIG_BITS
+{
+    HPET_CONFIG_ENABLE = (1 << 0),
+    HPET_CONFIG_LEGACY_REPLACEMENT = (1 << 1), // comparators 0 and 1 take over the PIT and RTC interrupts
+};
+
+enum HPET_TIMER_CONFIG_BITS
+{
+    HPET_TIMER_LEVEL_TRIGGERED = (1 << 1),
+    HPET_TIMER_INT_ENABLE = (1 << 2),
+    HPET_TIMER_PERIODIC = (1 << 3),
+    HPET_TIMER_PERIODIC_CAP = (1 << 4),
+    HPET_TIMER_SIZE_64_CAP = (1 << 5),
+    HPET_TIMER_VAL_SET = (1 << 6),
+    HPET_TIMER_32BIT_MODE = (1 << 8),
+    HPET_TIMER_INT_ROUTE_SHIFT = 9, // bits 13-9: IOAPIC input, one of those in bits 63-32
+    HPET_TIMER_INT_ROUTE_MASK = 0x1F,
+    HPET_TIMER_FSB_ENABLE = (1 << 14),
+    HPET_TIMER_FSB_CAP = (1 << 15),
+};
+
+struct clocksource;
+
+/**
+ * @brief Find the HPET in the ACPI tables, start its main counter and register its timers
+ *
+ * Comparator interrupts are sent to the calling CPU on vector
+ * IRQ_VECTOR_HPET + comparator number.
+ *
+ * @return 0, or -1 if there is no usable HPET
+ */
+int hpet_initialize(void);
+
+/**
+ * @brief Register the comparators without FSB delivery, each through an IOAPIC input of its own
+ *
+ * Call after ioapic_initialize(), on the CPU that called hpet_initialize();
+ * their interrupts go to it. Does nothing without an HPET.
+ */
+void hpet_route_comparators(void);
+
+/**
+ * @brief Main counter frequency in Hz, 0 before hpet_initialize()
+ */
+uint64_t hpet_frequency(void);
+
+/**
+ * @brief The main counter as a clock source, NULL before hpet_initialize()
+ */
+const struct clocksource *hpet_clocksource_get(void);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <kernel/arch/x86_64/irq.h>
+
+/*
+    I/O APICs, which take device interrupts over from the 8259s; those
+    are moved to IRQ_VECTOR_PIC and masked for good. IOAPIC inputs are
+    numbered as global system interrupts (GSIs); the MADT tells which
+    IOAPIC has which ones, and which ISA IRQs are not wired to the GSI
+    of the same number.
+
+    GSI n is delivered on vector IRQ_VECTOR_IOAPIC + n to a single CPU.
+    Unless pinned with ioapic_set_affinity(), each newly routed GSI goes
+    to the next CPU with a running local APIC, which spreads the IRQs
+    over the CPUs.
+*/
+
+#define IOAPIC_MAX_GSIS (IRQ_VECTOR_IOAPIC_LAST - IRQ_VECTOR_IOAPIC + 1)
+
+enum IOAPIC_REGISTERS
+{
+    IOAPIC_REGSEL = 0x00, // index of the register that IOAPIC_WINDOW accesses
+    IOAPIC_WINDOW = 0x10,
+};
+
+enum IOAPIC_INDIRECT_REGISTERS
+{
+    IOAPIC_ID = 0x00,
+    IOAPIC_VERSION = 0x01, // bits 23-16: number of inputs - 1
+    IOAPIC_REDIRECTION = 0x10, // + 2 * input: bits 31-0, + 2 * input + 1: bits 63-32
+};
+
+enum IOAPIC_REDIRECTION_BITS
+{
+    IOAPIC_ACTIVE_LOW = (1 << 13),
+    IOAPIC_LEVEL_TRIGGERED = (1 << 15),
+    IOAPIC_MASKED = (1 << 16),
+    IOAPIC_DESTINATION_SHIFT = 56, // physical destination mode: APIC ID
+};
+
+/**
+ * @brief Mask the 8259s, then find the IOAPICs in the MADT and mask all their inputs
+ * @return 0, or -1 if there is no MADT or no usable IOAPIC
+ */
+int ioapic_initialize(void);
+
+/**
+ * @brief Deliver @p gsi to @p handler and unmask it
+ *
+ * @param flags IOAPIC_ACTIVE_LOW and/or IOAPIC_LEVEL_TRIGGERED; 0 for active high, edge triggered
+ * @return 0, or -1 if no IOAPIC has @p gsi or it is beyond IOAPIC_MAX_GSIS
+ */
+int ioapic_route_gsi(unsigned int gsi, uint32_t flags, irq_handler_t handler);
+
+/**
+ * @brief Deliver ISA @p irq to @p handler, through whatever GSI the MADT has it on
+ * @return the GSI, or -1 if it cannot be routed
+ */
+int ioapic_route_isa_irq(unsigned int irq, irq_handler_t handler);
+
+/**
+ * @brief Send @p gsi to @p cpu from now on, also when it is routed later
+ * @return 0, or -1 if the local APIC of @p cpu is not running
+ */
+int ioapic_set_affinity(unsigned int gsi, int cpu);
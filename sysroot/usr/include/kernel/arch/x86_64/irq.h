@@ -22,4 +22,68 @@ struct idt_pointer {
 	uintptr_t base;
 } __attribute__((packed));
 
+/**
+ * Interrupt vectors with a fixed use
+ */
+enum IRQ_VECTORS {
+	IRQ_VECTOR_PIC = 0x20,    /* + IRQ, where the masked 8259s are moved to, out of the exceptions */
+	IRQ_VECTOR_IOAPIC = 0x30, /* + GSI, for IOAPIC inputs up to IRQ_VECTOR_IOAPIC_LAST */
+	IRQ_VECTOR_IOAPIC_LAST = 0x5F,
+	IRQ_VECTOR_HPET = 0x60, /* + comparator number, for HPET comparators delivering through the FSB */
+	IRQ_VECTOR_LAPIC_TIMER = 0xF0,
+	IRQ_VECTOR_SPURIOUS = 0xFF, /* the local APIC needs the low 4 bits set on older CPUs */
+};
+
+#define IRQ_VECTORS_COUNT 256
+#define IRQ_EXCEPTIONS_COUNT 32 /* vectors 0-31 are CPU exceptions */
+
+/**
+ * @brief Handler for one vector
+ *
+ * @param regs the full register frame for exceptions; NULL for interrupts,
+ *             whose entry path only saves the caller-saved registers
+ */
+typedef void (*irq_handler_t)(unsigned int vector, struct regs *regs);
 
+/**
+ * Handling time of one vector on one CPU, from the entry stub to the
+ * handler's return. Bucket n of the histogram counts the interrupts
+ * that took [2^(n + IRQ_HISTOGRAM_MIN_SHIFT), 2^(n + 1 + IRQ_HISTOGRAM_MIN_SHIFT))
+ * TSC cycles; the first and the last bucket also take everything below and above.
+ */
+#define IRQ_HISTOGRAM_BUCKETS 16
+#define IRQ_HISTOGRAM_MIN_SHIFT 6
+
+struct irq_stats {
+	uint64_t count;
+	uint64_t cycles;
+	uint32_t histogram[IRQ_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @brief Build the IDT and load it on the calling CPU
+ *
+ * Exceptions run on the IST stacks set up by gdt_initialize(), which has
+ * to run first. Interrupts stay disabled.
+ */
+void idt_initialize(void);
+
+/**
+ * @brief Route @p vector to @p handler, replacing the previous one
+ *
+ * Interrupts from the local APIC are acknowledged after the handler
+ * returns; exceptions without a handler are fatal.
+ */
+void irq_install_handler(unsigned int vector, irq_handler_t handler);
+
+/**
+ * @brief Counters and histogram of @p vector on @p cpu
+ */
+const struct irq_stats *irq_get_stats(int cpu, unsigned int vector);
+
+/**
+ * @brief Log the statistics of every vector that has been taken, per CPU
+ *
+ * Called by arch_hcf(), so they are in the log of every halt and panic.
+ */
+void irq_stats_dump(void);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+    Local APIC of each processor, in x2APIC mode (registers as MSRs) when
+    the CPU has it, otherwise in xAPIC mode (memory-mapped, uncached).
+    Its timer is registered as a per-CPU one-shot clock event device:
+    in TSC-deadline mode when the CPU has it, otherwise counting down
+    from an initial count at a rate measured against the monotonic clock.
+*/
+
+enum LAPIC_REGISTERS
+{
+    LAPIC_ID = 0x020,
+    LAPIC_VERSION = 0x030,
+    LAPIC_TPR = 0x080,
+    LAPIC_EOI = 0x0B0,
+    LAPIC_SVR = 0x0F0, // spurious interrupt vector
+    LAPIC_LVT_TIMER = 0x320,
+    LAPIC_TIMER_INITIAL_COUNT = 0x380,
+    LAPIC_TIMER_CURRENT_COUNT = 0x390,
+    LAPIC_TIMER_DIVIDE = 0x3E0,
+};
+
+enum LAPIC_SVR_BITS
+{
+    LAPIC_SVR_ENABLE = (1 << 8),
+};
+
+enum LAPIC_LVT_BITS
+{
+    LAPIC_LVT_MASKED = (1 << 16),
+    LAPIC_LVT_TIMER_ONESHOT = (0 << 17),
+    LAPIC_LVT_TIMER_PERIODIC = (1 << 17),
+    LAPIC_LVT_TIMER_TSC_DEADLINE = (2 << 17),
+};
+
+enum LAPIC_TIMER_DIVIDE_VALUES
+{
+    LAPIC_TIMER_DIVIDE_BY_16 = 0x3,
+};
+
+enum LAPIC_MSRS
+{
+    IA32_APIC_BASE = 0x1B,
+    IA32_TSC_DEADLINE = 0x6E0,
+    IA32_X2APIC_MSR_BASE = 0x800,
+};
+
+enum IA32_APIC_BASE_BITS
+{
+    IA32_APIC_BASE_X2APIC = (1 << 10),
+    IA32_APIC_BASE_ENABLE = (1 << 11),
+    IA32_APIC_BASE_ADDRESS_MASK = 0xFFFFFF000,
+};
+
+/**
+ * @brief Map and enable the local APIC of the calling CPU
+ * @return 0, or -1 if the CPU has none
+ */
+int lapic_initialize(void);
+
+/**
+ * @brief APIC ID of @p cpu, or -1 if its local APIC is not up (yet)
+ */
+int lapic_apic_id(int cpu);
+
+/**
+ * @brief Register the LAPIC timer of the calling CPU as its clock event device
+ *
+ * Interrupts arrive on IRQ_VECTOR_LAPIC_TIMER. The one-shot rate is
+ * measured on the first CPU and reused by the others.
+ *
+ * @return 0, or -1 if the timer is unusable
+ */
+int lapic_timer_initialize(void);
+
+/**
+ * @brief Signal the end of the interrupt being handled; a no-op without a local APIC
+ */
+void lapic_eoi(void);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <stdbool.h>
+
+/*
+    16550 UART driver. Output goes through a TX ring that is moved into the
+    16-byte transmit FIFO from the THR-empty interrupt, so writers never wait
+    for the line.
+*/
+
+#define SERIAL_PORT_COM1    0x3F8
+#define SERIAL_IRQ_COM1     4
+#define SERIAL_DEFAULT_BAUD 115200
+#define SERIAL_TX_RING_SIZE 4096    /* power of two */
+
+/**
+ * @brief Program the UART at @p port for @p baud 8N1 with FIFOs and the TX interrupt enabled
+ * @return 0, or -1 if there is no working UART at @p port or @p baud is not a divisor of 115200
+ */
+int serial_initialize(unsigned short port, uint32_t baud);
+
+/**
+ * @brief Queue @p len bytes for transmission
+ *
+ * Never waits: what does not fit in the TX ring is dropped (see serial_tx_dropped()).
+ * Not reentrant, callers have to be serialized (the klog sink drain is).
+ */
+void serial_write(const char *buf, size_t len);
+
+/**
+ * @brief Move the next bytes to the UART if it has room, without waiting for the interrupt
+ *
+ * For the klog sink flush hook, so that the ring empties with interrupts disabled too.
+ * @return whether bytes are left in the TX ring
+ */
+bool serial_flush(void);
+
+struct regs;
+
+/**
+ * @brief Interrupt handler for the UART's IRQ line, an irq_handler_t
+ */
+void serial_irq_handler(unsigned int vector, struct regs *regs);
+
+/**
+ * @brief Number of bytes dropped because the TX ring was full
+ */
+uint64_t serial_tx_dropped(void);
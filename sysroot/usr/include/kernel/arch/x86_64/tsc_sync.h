@@ -0,0 +1,46 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+    Keeping the TSCs of all CPUs on one timeline.
+
+    When an AP comes up, the BSP runs tsc_sync_source() while the AP runs
+    tsc_sync_target(). The two bounce a cache line back and forth; each
+    round trip gives the AP's TSC against the midpoint of two BSP reads,
+    and the tightest round trip wins. The AP then corrects its TSC through
+    IA32_TSC_ADJUST if it has one, or else sets its per-CPU offset that
+    arch_tsc_read() adds, and the skew is measured again. If it is still
+    above TSC_SYNC_MAX_SKEW_NS, the TSC is no longer trusted as a clock
+    source.
+*/
+
+#define TSC_SYNC_MAX_SKEW_NS 1000
+
+enum TSC_SYNC_MSRS
+{
+    IA32_TSC_ADJUST = 0x3B,
+};
+
+/**
+ * @brief Check the TSC of the boot CPU before the clock is set up
+ *
+ * Firmware sometimes leaves IA32_TSC_ADJUST non-zero, which would put
+ * the boot CPU off the timeline the APs are compared against; it is
+ * reset to 0.
+ */
+void tsc_sync_initialize(void);
+
+/**
+ * @brief BSP side of the synchronization of @p cpu, which is running tsc_sync_target()
+ * @return the skew left afterwards in TSC cycles, or INT64_MAX if @p cpu did not answer
+ */
+int64_t tsc_sync_source(int cpu);
+
+/**
+ * @brief AP side of the synchronization, run by the AP while the BSP runs tsc_sync_source()
+ *
+ * Returns as soon as the BSP gives up, or after about a second without it,
+ * leaving the TSC as it is.
+ */
+void tsc_sync_target(void);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <stdbool.h>
+
+/*
+    virtio-console (legacy PCI interface) transmit-only driver, for bulk log
+    and trace output to the host, e.g. with QEMU:
+
+        -device virtio-serial -chardev file,id=vcon,path=vcon.log -device virtconsole,chardev=vcon
+
+    Output is gathered into large DMA buffers which are handed to the device
+    whole, so the cost per byte is a memcpy and the cost per buffer one port
+    write at most.
+*/
+
+#define VIRTIO_CONSOLE_TX_BUFFERS     16
+#define VIRTIO_CONSOLE_TX_BUFFER_SIZE 16384
+
+/**
+ * @brief Find the first virtio-console on the PCI bus and set up port 0's transmit queue
+ * @return 0, or -1 if there is none or it cannot be used
+ */
+int virtio_console_initialize(void);
+
+/**
+ * @brief Queue @p len bytes for the host
+ *
+ * Never waits for the device. Data goes out when a buffer fills up or at
+ * the next virtio_console_flush(); what finds no free buffer is dropped
+ * (see virtio_console_dropped()). Not reentrant, callers have to be
+ * serialized (the klog sink drain is).
+ */
+void virtio_console_write(const char *buf, size_t len);
+
+/**
+ * @brief Take back the buffers the device is done with and hand it the partially filled one
+ *
+ * The klog sink flush hook, so klog_poll() hands over everything one drain
+ * pass wrote with a single notify. Must be serialized with virtio_console_write().
+ * @return false, nothing is left for the device to be given
+ */
+bool virtio_console_flush(void);
+
+/**
+ * @brief Number of bytes dropped because all buffers were in flight
+ */
+uint64_t virtio_console_dropped(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/**
+ * @brief Pick the checksum implementations for this CPU and build the lookup tables.
+ *
+ * Must run once (after fpu_initialize). Until it has, crc32c() falls back to
+ * crc32c_sw(), which builds its tables on first use.
+ */
+void checksum_initialize(void);
+
+/**
+ * @brief 8-bit sum of all bytes in @p data (mod 256), as used by ACPI tables.
+ *
+ * Uses SSE2 psadbw to add 16 bytes per instruction.
+ */
+uint8_t checksum8(const void *data, size_t len);
+
+/**
+ * @brief CRC-32C (Castagnoli) of @p data, continuing from @p crc.
+ *
+ * Pass 0 as @p crc for a fresh checksum; feeding the result of a previous call
+ * back in checksums the concatenation of both buffers.
+ * Uses the SSE4.2 crc32 instruction when available, a table-driven
+ * implementation otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @brief Table-driven (slicing-by-8) CRC-32C, regardless of CPU support.
+ * @see crc32c()
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len);
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+    Clock event devices raise an interrupt at a programmed time; they are
+    the counterpart of clock sources, which only tell the time.
+
+    Drivers register every timer they can program. A CPU then claims the
+    best one (highest rating) that can interrupt it and programs it in
+    nanoseconds with clockevent_program_ns().
+
+    Ratings:
+        1-99    only usable when nothing else is there
+        100-199 slow to program (port I/O)
+        200-299 memory-mapped, but shared by all CPUs
+        300-399 local to the CPU
+*/
+
+#define CLOCKEVENT_RATING_HPET         200
+#define CLOCKEVENT_RATING_LAPIC        300
+#define CLOCKEVENT_RATING_TSC_DEADLINE 350
+
+#define CLOCKEVENT_FEATURE_ONESHOT  (1 << 0)
+#define CLOCKEVENT_FEATURE_PERIODIC (1 << 1)
+#define CLOCKEVENT_FEATURE_PERCPU   (1 << 2) /* stops with the CPU it belongs to, e.g. the LAPIC timer */
+
+struct clock_event_device {
+    const char *name;
+    unsigned int features;
+    int rating;
+    int cpu;            /* CPU the interrupt is delivered to, -1 if it can be any */
+    uint64_t frequency; /* Hz */
+    uint64_t min_delta_ticks;
+    uint64_t max_delta_ticks;
+
+    /**
+     * Fire once, @p ticks from now. Returns -1 if the time may have passed
+     * before the device was armed, in which case it will not fire.
+     */
+    int (*set_next_event)(struct clock_event_device *dev, uint64_t ticks);
+    void (*shutdown)(struct clock_event_device *dev);
+
+    /* set by clockevent_claim(), called by the driver from the interrupt handler */
+    void (*event_handler)(struct clock_event_device *dev);
+
+    /* set by clockevent_register(): ticks = (ns * mult) >> shift */
+    uint32_t mult;
+    uint32_t shift;
+    int claimed;
+    struct clock_event_device *next;
+};
+
+/**
+ * @brief Make @p dev available to clockevent_claim()
+ *
+ * @p dev must stay valid forever. name, features, rating, cpu, frequency,
+ * min_delta_ticks, max_delta_ticks, set_next_event and shutdown have to be set.
+ */
+void clockevent_register(struct clock_event_device *dev);
+
+/**
+ * @brief Take the best unclaimed device that interrupts @p cpu and has all of @p features
+ *
+ * @param handler called from the interrupt handler each time the device fires
+ * @return the device, or NULL if there is none
+ */
+struct clock_event_device *clockevent_claim(int cpu, unsigned int features,
+                                            void (*handler)(struct clock_event_device *dev));
+
+/**
+ * @brief Stop @p dev and give it back
+ */
+void clockevent_release(struct clock_event_device *dev);
+
+/**
+ * @brief Fire @p dev once, @p delta_ns from now
+ *
+ * Deltas outside what the device can do are clamped; one that is too
+ * short to arm in time is retried with a longer one, so the event may come
+ * late but is not lost.
+ *
+ * @return 0, or -1 if the device could not be armed at all
+ */
+int clockevent_program_ns(struct clock_event_device *dev, uint64_t delta_ns);
+
+/*
+    Per-CPU event, for the timer code. Each CPU has one one-shot device
+    that is only ever programmed for the earliest pending expiry; there
+    is no periodic tick, so a CPU with nothing pending is not woken up.
+*/
+
+/**
+ * @brief Claim the best one-shot device for the calling CPU
+ *
+ * @param handler called from the interrupt handler when the programmed expiry is reached
+ * @return 0, or -1 if there is no device for this CPU
+ */
+int clockevent_cpu_initialize(void (*handler)(void));
+
+/**
+ * @brief Fire the calling CPU's event at @p expires_ns on the monotonic clock
+ *
+ * Replaces the previous expiry. A time in the past fires as soon as
+ * possible, UINT64_MAX stops the device.
+ */
+void clockevent_cpu_set_next(uint64_t expires_ns);
+
+/**
+ * @brief The expiry the calling CPU's device is programmed for, UINT64_MAX if none
+ */
+uint64_t clockevent_cpu_next(void);
+
+/**
+ * @brief The expiry the device of @p cpu is programmed for, UINT64_MAX if none
+ */
+uint64_t clockevent_cpu_next_of(int cpu);
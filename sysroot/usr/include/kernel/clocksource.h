@@ -0,0 +1,114 @@
+#pragma once
+
+#include <kernel/types.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+    Clock sources are free-running counters. The best one registered
+    (highest rating) drives the monotonic and real-time clocks.
+
+    Ratings:
+        1-99    only usable when nothing else is there
+        100-199 functional, but slow to read or imprecise
+        200-299 good, but slower to read than the CPU counter
+        300-399 fast and accurate
+*/
+
+#define CLOCKSOURCE_RATING_TSC_UNSTABLE 150 /* may change rate with the CPU clock */
+#define CLOCKSOURCE_RATING_PM_TIMER     200
+#define CLOCKSOURCE_RATING_HPET         250
+#define CLOCKSOURCE_RATING_TSC          300
+
+struct clocksource {
+    const char *name;
+    uint64_t (*read)(void);
+    uint64_t mask;      /* the counter wraps from mask to 0 */
+    uint64_t frequency; /* Hz */
+    int rating;
+
+    /* set by clocksource_register(): ns = (cycles * mult) >> shift */
+    uint32_t mult;
+    uint32_t shift;
+    struct clocksource *next;
+};
+
+/**
+ * @brief Compute @p mult and @p shift so that to = (from * mult) >> shift
+ *
+ * Picks the largest shift (at most 32) whose mult still fits in 32 bits.
+ */
+void clocksource_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from_hz, uint64_t to_hz);
+
+/**
+ * @brief Add a clock source and switch to it if it is rated better than the current one
+ *
+ * @p cs must stay valid forever. name, read, mask, frequency and rating have to be set.
+ */
+void clocksource_register(struct clocksource *cs);
+
+/**
+ * @brief Change the frequency of @p cs, e.g. after a recalibration
+ *
+ * If @p cs is in use, the time counted so far stays as it is and only
+ * cycles from now on are converted at the new rate.
+ */
+void clocksource_set_frequency(struct clocksource *cs, uint64_t frequency);
+
+/**
+ * @brief Change the rating of a registered clock source, e.g. when it turns out to be unreliable
+ *
+ * Switches to whichever clock source is then rated best. Before @p cs is
+ * registered, only sets the rating it will be registered with.
+ */
+void clocksource_set_rating(struct clocksource *cs, int rating);
+
+/**
+ * @brief The clock source currently in use, or NULL before the first one is registered
+ */
+const struct clocksource *clocksource_current(void);
+
+/**
+ * @brief Nanoseconds since the first clock source was registered
+ *
+ * Never goes backwards, also across clock source switches. Lock-free: a
+ * reader only retries if the clock was updated while it was reading.
+ * Returns 0 before any clock source is registered.
+ */
+uint64_t clock_monotonic_ns(void);
+
+/**
+ * @brief Nanoseconds since the Unix epoch, as set by clock_set_realtime()
+ */
+uint64_t clock_realtime_ns(void);
+
+/**
+ * @brief Real time, in nanoseconds since the Unix epoch, at which @p cs read @p cycles
+ *
+ * Converts the distance to a fresh read of @p cs at its current rate, so
+ * the stamp follows clock_set_realtime() and clock source switches just
+ * like clock_realtime_ns(). @p cs does not have to be the source in use.
+ * Lock-free, like clock_realtime_ns().
+ */
+uint64_t clock_realtime_ns_at(const struct clocksource *cs, uint64_t cycles);
+
+/**
+ * @brief Set the real-time clock to @p epoch_ns nanoseconds since the Unix epoch
+ */
+void clock_set_realtime(uint64_t epoch_ns);
+
+/**
+ * @brief Fold the cycles counted so far into the clock base
+ *
+ * Counters narrower than 64 bits have to be read at least once per wrap
+ * period, or whole wraps are lost; clock_update_start() makes sure of it.
+ */
+void clock_update(void);
+
+/**
+ * @brief Call clock_update() from a timer every half wrap period of the current counter
+ *
+ * Needs timer_initialize() done on the calling CPU. The period follows
+ * clock source switches.
+ */
+void clock_update_start(void);
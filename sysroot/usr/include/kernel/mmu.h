@@ -0,0 +1,32 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+    The boot code identity maps the first GiB with one 1 GiB page. Device
+    memory above that (framebuffers, local APIC, HPET, ...) is mapped on
+    demand with 2 MiB pages, still identity mapped, so the physical address
+    of a device register is also the pointer to use.
+*/
+
+#define MMU_CACHE_WB 0 // write-back, normal memory
+#define MMU_CACHE_WC 1 // write-combining, for framebuffers
+#define MMU_CACHE_UC 2 // uncached, for device registers
+
+/**
+ * @brief Program the PAT so MMU_CACHE_WC mappings are write-combining
+ *
+ * PAT entry 1 (selected by PWT alone) becomes WC instead of write-through.
+ * Without PAT support MMU_CACHE_WC falls back to write-through.
+ */
+void mmu_init(void);
+
+/**
+ * @brief Identity map [@p phys, @p phys + @p size) with the given caching
+ *
+ * Only the low 4 GiB can be mapped. Mapping granularity is 2 MiB, so the
+ * neighbourhood of the range shares its caching type.
+ *
+ * @return (void *)phys, or NULL if the range cannot be mapped
+ */
+void *mmu_map_mmio(uintptr_t phys, size_t size, int cache);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+    PCI configuration space access through the legacy 0xCF8/0xCFC ports.
+    A device is named by a packed bus/slot/function triple (pci_box_device()).
+*/
+
+#define PCI_VENDOR_ID            0x00 // 2
+#define PCI_DEVICE_ID            0x02 // 2
+#define PCI_COMMAND              0x04 // 2
+#define PCI_STATUS               0x06 // 2
+#define PCI_REVISION_ID          0x08 // 1
+#define PCI_PROG_IF              0x09 // 1
+#define PCI_SUBCLASS             0x0a // 1
+#define PCI_CLASS                0x0b // 1
+#define PCI_HEADER_TYPE          0x0e // 1
+#define PCI_BAR0                 0x10 // 4
+#define PCI_BAR1                 0x14 // 4
+#define PCI_BAR2                 0x18 // 4
+#define PCI_BAR3                 0x1C // 4
+#define PCI_BAR4                 0x20 // 4
+#define PCI_BAR5                 0x24 // 4
+#define PCI_SUBSYSTEM_ID         0x2e // 2
+#define PCI_INTERRUPT_LINE       0x3C // 1
+#define PCI_INTERRUPT_PIN        0x3D // 1
+
+#define PCI_COMMAND_IO           (1 << 0)
+#define PCI_COMMAND_MEMORY       (1 << 1)
+#define PCI_COMMAND_BUS_MASTER   (1 << 2)
+
+#define PCI_BAR_IO               (1 << 0)
+#define PCI_NONE                 0xFFFF
+
+typedef void (*pci_func_t)(uint32_t device, uint16_t vendor_id, uint16_t device_id, void *extra);
+
+static inline int pci_extract_bus(uint32_t device) {
+    return (uint8_t)((device >> 16));
+}
+static inline int pci_extract_slot(uint32_t device) {
+    return (uint8_t)((device >> 8));
+}
+static inline int pci_extract_func(uint32_t device) {
+    return (uint8_t)(device);
+}
+static inline uint32_t pci_box_device(int bus, int slot, int func) {
+    return (uint32_t)((bus << 16) | (slot << 8) | func);
+}
+
+uint32_t pci_read_field(uint32_t device, int field, int size);
+void pci_write_field(uint32_t device, int field, int size, uint32_t value);
+
+/**
+ * @brief Call @p f for every function present on every bus
+ */
+void pci_scan(pci_func_t f, void *extra);
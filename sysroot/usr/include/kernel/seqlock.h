@@ -0,0 +1,98 @@
+#pragma once
+
+#include <kernel/spinlock.h>
+
+/**
+ * @brief Sequence counter for data that is read often and written rarely.
+ *
+ * The count is odd while a writer is in the middle of an update. Readers
+ * copy the data out between read_seqcount_begin() and read_seqcount_retry()
+ * and start over if the count changed; they never store to shared memory,
+ * so readers on different CPUs do not bounce the cache line between them.
+ *
+ * Writers have to be serialized by the caller (see seqlock_t), and must not
+ * be interrupted by a reader on the same CPU, which would spin forever on
+ * the odd count.
+ */
+typedef struct {
+    volatile uint32_t sequence;
+} seqcount_t;
+
+#define SEQCOUNT_INIT { 0 }
+
+static inline uint32_t read_seqcount_begin(const seqcount_t *s)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        __builtin_ia32_pause();
+    }
+    return seq;
+}
+
+/**
+ * @brief Non-zero if the data read since read_seqcount_begin() returned @p start may be torn
+ */
+static inline int read_seqcount_retry(const seqcount_t *s, uint32_t start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Sequence counter with a spin lock that serializes the writers.
+ *
+ * Like spin_lock_t, does not touch the interrupt flag: if readers can run in
+ * interrupt handlers, write with interrupts disabled.
+ */
+typedef struct {
+    seqcount_t seqcount;
+    spin_lock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT { SEQCOUNT_INIT, SPIN_LOCK_INIT }
+
+static inline uint32_t read_seqbegin(const seqlock_t *sl)
+{
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+static inline int read_seqretry(const seqlock_t *sl, uint32_t start)
+{
+    return read_seqcount_retry(&sl->seqcount, start);
+}
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+    spin_lock(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+}
+
+/**
+ * @brief write_seqlock() if no other writer holds the lock
+ * @return non-zero if the lock was taken
+ */
+static inline int write_tryseqlock(seqlock_t *sl)
+{
+    if (!spin_trylock(&sl->lock)) {
+        return 0;
+    }
+    write_seqcount_begin(&sl->seqcount);
+    return 1;
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+    write_seqcount_end(&sl->seqcount);
+    spin_unlock(&sl->lock);
+}
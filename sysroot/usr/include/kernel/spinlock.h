@@ -0,0 +1,34 @@
+#pragma once
+
+#include <kernel/types.h>
+
+/**
+ * @brief Test-and-test-and-set spin lock.
+ *
+ * Does not touch the interrupt flag; a lock that is also taken from interrupt
+ * handlers must be held with interrupts disabled (see arch_irq_save()).
+ */
+typedef struct {
+    volatile int latch;
+} spin_lock_t;
+
+#define SPIN_LOCK_INIT { 0 }
+
+static inline void spin_lock(spin_lock_t *lock)
+{
+    while (__atomic_exchange_n(&lock->latch, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&lock->latch, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+}
+
+static inline int spin_trylock(spin_lock_t *lock)
+{
+    return !__atomic_exchange_n(&lock->latch, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spin_lock_t *lock)
+{
+    __atomic_store_n(&lock->latch, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <stdbool.h>
+
+/**
+ * @brief Branch whose direction is patched into the code instead of tested at runtime.
+ *
+ * Every static_key_false() / static_key_true() site is a 5-byte instruction:
+ * a NOP falling through to the "disabled" path while the key is off, or a JMP
+ * to the "enabled" path while it is on. Each site records itself in the
+ * __jump_table section (collected by linker.ld) so static_key_enable() and
+ * static_key_disable() can find and rewrite it. A disabled site therefore
+ * costs one NOP, and switching is slow (it walks the whole table).
+ *
+ * The two tests only differ in the instruction the compiler emits, which
+ * has to match the key's initial value: use static_key_false() with keys
+ * defined as STATIC_KEY_INIT_FALSE and static_key_true() with STATIC_KEY_INIT_TRUE.
+ */
+typedef struct {
+    int enabled;
+} static_key_t;
+
+#define STATIC_KEY_INIT_FALSE { .enabled = 0 }
+#define STATIC_KEY_INIT_TRUE  { .enabled = 1 }
+
+/**
+ * @brief One patchable site, emitted by the branch macros below.
+ */
+struct jump_entry {
+    uint64_t code;      /* address of the 5-byte NOP/JMP */
+    uint64_t target;    /* where the JMP goes while the key is enabled */
+    static_key_t *key;
+};
+
+extern struct jump_entry __start___jump_table[];
+extern struct jump_entry __stop___jump_table[];
+
+#define STATIC_KEY_JUMP_ENTRY                   \
+    ".pushsection __jump_table, \"aw\"\n\t"     \
+    ".balign 8\n\t"                             \
+    ".quad 1b, %l[l_yes], %c0\n\t"              \
+    ".popsection\n\t"
+
+/**
+ * @brief Test a key that starts out disabled. Compiled as a NOP.
+ */
+static inline __attribute__((always_inline)) bool static_key_false(static_key_t *key)
+{
+    asm goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+             STATIC_KEY_JUMP_ENTRY
+             : : "i"(key) : : l_yes);
+    return false;
+l_yes:
+    return true;
+}
+
+/**
+ * @brief Test a key that starts out enabled. Compiled as a JMP.
+ */
+static inline __attribute__((always_inline)) bool static_key_true(static_key_t *key)
+{
+    asm goto("1: .byte 0xe9\n\t"
+             ".long %l[l_yes] - 2f\n\t"
+             "2:\n\t"
+             STATIC_KEY_JUMP_ENTRY
+             : : "i"(key) : : l_yes);
+    return false;
+l_yes:
+    return true;
+}
+
+static inline bool static_key_enabled(const static_key_t *key)
+{
+    return __atomic_load_n(&key->enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Switch every site of @p key to the "enabled" / "disabled" path.
+ *
+ * Rewrites kernel text with interrupts disabled on the calling CPU, one
+ * switch at a time. The stores are not atomic for other CPUs fetching the
+ * same bytes, so keys can only be switched while the boot CPU runs alone:
+ * after static_key_freeze() they stay as they are.
+ *
+ * @return true if the sites take the requested path, false if @p key would
+ *         have to change after static_key_freeze()
+ */
+bool static_key_enable(static_key_t *key);
+bool static_key_disable(static_key_t *key);
+
+/**
+ * @brief Stop patching kernel text, for good
+ *
+ * Must be called before a second CPU is started.
+ */
+void static_key_freeze(void);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <stdbool.h>
+
+/*
+    Kernel timers, kept per CPU.
+
+    Timeouts go into a hierarchical timer wheel: 5 levels of 64 slots,
+    level 0 slots one TIMER_WHEEL_UNIT_NS wide and each level 64 times
+    coarser than the one below. Adding and cancelling is O(1); a timer on
+    an upper level is only moved down (cascaded) when its slot comes up,
+    so timeouts that are cancelled before that, which is most of them,
+    never cost more than the add and the cancel. Wheel timers fire up to
+    one unit late, never early.
+
+    Deadlines closer than TIMER_HRES_NS go into a small heap instead and
+    fire on time, to the resolution of the CPU's clock event device.
+
+    The CPU's clock event device is programmed for the earliest thing on
+    either; there is no periodic tick.
+*/
+
+#define TIMER_WHEEL_UNIT_SHIFT 20 /* level 0 slots are 2^20 ns, about a millisecond */
+#define TIMER_WHEEL_UNIT_NS    (1ULL << TIMER_WHEEL_UNIT_SHIFT)
+#define TIMER_HRES_NS          1000000ULL
+
+#define TIMER_PINNED (1 << 0) /* never moved to another CPU by timer_migrate() */
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    uint64_t expires;           /* monotonic ns */
+    void (*function)(void *arg); /* called from the timer interrupt, with interrupts disabled */
+    void *arg;
+    unsigned int flags;
+    int cpu;                    /* CPU the timer is queued on, -1 if not pending */
+    int hres_index;             /* position in the high-resolution heap, -1 if on the wheel */
+};
+
+#define TIMER_INIT(fn, a, f) { .function = (fn), .arg = (a), .flags = (f), .cpu = -1, .hres_index = -1 }
+
+static inline void timer_init(struct timer *timer, void (*function)(void *arg), void *arg, unsigned int flags)
+{
+    *timer = (struct timer)TIMER_INIT(function, arg, flags);
+}
+
+/**
+ * @brief Set up the timers of the calling CPU; needs its clock event device registered
+ * @return 0, or -1 if the CPU has no clock event device
+ */
+int timer_initialize(void);
+
+/**
+ * @brief Arm @p timer to fire at @p expires_ns on the monotonic clock, on the calling CPU
+ *
+ * A timer that is already pending is moved to the new expiry.
+ */
+void timer_add(struct timer *timer, uint64_t expires_ns);
+
+/**
+ * @brief Disarm @p timer
+ *
+ * Its function may still be running on another CPU when this returns.
+ *
+ * @return true if the timer was pending
+ */
+bool timer_cancel(struct timer *timer);
+
+static inline bool timer_pending(const struct timer *timer)
+{
+    return __atomic_load_n(&timer->cpu, __ATOMIC_RELAXED) >= 0;
+}
+
+/**
+ * @brief Tell the timer code whether the calling CPU is idle
+ */
+void timer_cpu_set_idle(bool idle);
+
+/**
+ * @brief Move the timers of @p cpu that are not TIMER_PINNED to an idle CPU
+ *
+ * For a CPU that is about to be busy for a long time or go offline.
+ * Idle CPUs cannot be woken up early, so the target is the idle CPU
+ * whose clock event device fires first, and only timers expiring no
+ * earlier than that are moved; it picks them up at that interrupt.
+ *
+ * @return the CPU they went to, or -1 if none could be moved
+ */
+int timer_migrate(int cpu);
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <stdbool.h>
+
+/*
+    Linear framebuffer handed over by the boot loader (multiboot), mapped
+    write-combining. Only 32-bit XRGB modes are used.
+*/
+
+extern uint8_t  *lfb_vid_memory;
+extern uint16_t lfb_resolution_x;
+extern uint16_t lfb_resolution_y;
+extern uint16_t lfb_resolution_b;
+extern uint32_t lfb_resolution_s; /* bytes per scanline */
+
+/**
+ * @brief Map the framebuffer the boot loader set up and make it the current one
+ * @return 0, or -1 if the mode is not 32 bpp or cannot be mapped
+ */
+int lfb_initialize(uintptr_t phys, uint32_t pitch, uint32_t width, uint32_t height, uint8_t bpp);
+
+/**
+ * @brief Text console on the framebuffer
+ *
+ * Understands the ANSI colour sequences kprintf and klog emit (ESC [ ... m)
+ * plus ESC [ 2 J, ESC [ H and ESC [ K; other control sequences are skipped.
+ * Text is drawn into a shadow buffer; only the changed cells are copied to
+ * video memory, by fbterm_flush().
+ */
+int fbterm_initialize(void);
+
+/**
+ * @brief Draw @p len bytes of text into the shadow buffer. Not reentrant, callers have to be serialized.
+ */
+void fbterm_write(const char *buf, size_t len);
+
+/**
+ * @brief Copy what fbterm_write() changed since the last call to video memory
+ *
+ * The klog sink flush hook, serialized with fbterm_write() like it.
+ * @return false, nothing is left over
+ */
+bool fbterm_flush(void);
+
+/*
+    2D blits on 32-bit pixel surfaces.
+
+    A surface is either video memory (write-combining) or a buffer in normal
+    memory. Stores to video memory are streamed a whole row at a time, so the
+    write-combining buffers are flushed as full lines; reading video memory is
+    uncached and very slow, so draw and blend into a system memory surface and
+    copy the result to the screen instead of reading it back.
+
+    All rectangles are clipped to the surfaces involved.
+*/
+
+typedef struct {
+    uint32_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;  /* bytes per row, a multiple of 4 */
+    bool     video;  /* write-combining video memory */
+} lfb_surface_t;
+
+/**
+ * @brief Pick the SSE2 or AVX2 blit routines for this CPU
+ *
+ * Must run once (after fpu_initialize) before any of the blit functions are used.
+ */
+void blit_initialize(void);
+
+/**
+ * @brief The framebuffer set up by lfb_initialize() as a surface
+ * @return 0, or -1 if there is no framebuffer
+ */
+int lfb_surface(lfb_surface_t *surface);
+
+/**
+ * @brief Fill a rectangle with @p color
+ */
+void blit_fill(lfb_surface_t *dst, int x, int y, int w, int h, uint32_t color);
+
+/**
+ * @brief Copy a rectangle between two surfaces that do not overlap
+ */
+void blit_copy(lfb_surface_t *dst, int dx, int dy, const lfb_surface_t *src, int sx, int sy, int w, int h);
+
+/**
+ * @brief Copy a rectangle within one surface; source and destination may overlap
+ *
+ * Scrolling a region up by n rows is blit_move(s, x, y, x, y + n, w, h - n).
+ */
+void blit_move(lfb_surface_t *surface, int dx, int dy, int sx, int sy, int w, int h);
+
+/**
+ * @brief Draw a rectangle of ARGB pixels over @p dst, weighted by their alpha
+ *
+ * Alpha is not premultiplied. Fully opaque and fully transparent groups of
+ * pixels skip the arithmetic.
+ */
+void blit_blend(lfb_surface_t *dst, int dx, int dy, const lfb_surface_t *src, int sx, int sy, int w, int h);
+
+/**
+ * @brief Time the blit routines on the framebuffer and log MPixels/s for each
+ *
+ * Overwrites the screen. @p scratch is system memory for an off-screen
+ * surface of the framebuffer size; without it only fill and move are timed.
+ */
+void blit_benchmark(void *scratch, size_t scratch_size);